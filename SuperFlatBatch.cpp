@@ -0,0 +1,489 @@
+#include <chrono>
+#include <functional>
+#include <pcl/Console.h>
+#include <pcl/ElapsedTime.h>
+#include <pcl/ErrorHandler.h>
+#include <pcl/File.h>
+#include <pcl/FileFormat.h>
+#include <pcl/FileFormatInstance.h>
+#include <pcl/MetaModule.h>
+#include <pcl/StandardStatus.h>
+#include <pcl/Thread.h>
+
+#include "SuperFlatBatch.h"
+#include "SuperFlatBuffers.h"
+#include "SuperFlatInstance.h"
+#include "SuperFlatModule.h"
+#include "SuperFlatParameters.h"
+
+namespace pcl
+{
+
+// Thread running one stage of the pipeline.
+class SuperFlatBatchThread : public Thread
+{
+public:
+    SuperFlatBatchThread(const std::function<void()>& run)
+        : m_run(run)
+    {
+    }
+
+    void Run() override
+    {
+        m_run();
+    }
+
+private:
+    std::function<void()> m_run;
+};
+
+// Status of a frame being processed, which only aborts it once the batch has been cancelled. The progress shown is
+// that of the batch, counted in frames by the calling thread.
+class SuperFlatBatchStatus : public StatusCallback
+{
+public:
+    SuperFlatBatchStatus(const SuperFlatBatch& batch)
+        : m_batch(batch)
+    {
+    }
+
+    int Initialized(const StatusMonitor&) const override
+    {
+        return Aborted();
+    }
+
+    int Updated(const StatusMonitor&) const override
+    {
+        return Aborted();
+    }
+
+    int Completed(const StatusMonitor&) const override
+    {
+        return Aborted();
+    }
+
+    void InfoUpdated(const StatusMonitor&) const override
+    {
+    }
+
+private:
+    const SuperFlatBatch& m_batch;
+
+    int Aborted() const
+    {
+        return m_batch.m_cancel ? 1 : 0;
+    }
+};
+
+// Runs f, and returns the message of the exception it throws, if any.
+template <class F>
+static String Attempt(F f)
+{
+    try {
+        f();
+    } catch (Exception& x) {
+        return x.Message();
+    } catch (std::bad_alloc&) {
+        return "Out of memory";
+    } catch (...) {
+        return "Unknown error";
+    }
+    return String();
+}
+
+// Reads the first image of a file. Integer images are converted to 32-bit floating point.
+static void ReadImage(const String& filePath, SuperFlatBatchFrame& frame)
+{
+    FileFormat format(File::ExtractExtension(filePath), true, false);
+    FileFormatInstance file(format);
+    ImageDescriptionArray images;
+    if (!file.Open(images, filePath))
+        throw Error("Unable to open image file: " + filePath);
+    if (images.IsEmpty())
+        throw Error("Empty image file: " + filePath);
+    frame.options = images[0].options;
+    if (format.CanStoreKeywords())
+        if (!file.ReadFITSKeywords(frame.keywords))
+            throw Error("Unable to read the keywords of image file: " + filePath);
+    frame.image.CreateFloatImage((frame.options.ieeefpSampleFormat && (frame.options.bitsPerSample == 64)) ? 64 : 32);
+    if (!file.ReadImage(frame.image))
+        throw Error("Unable to read image file: " + filePath);
+    frame.image.SetStatusCallback(nullptr);
+    file.Close();
+}
+
+// Writes image as a floating point image, with the options and the keywords of the frame it comes from.
+static void WriteImage(const String& filePath, const ImageVariant& image, const ImageOptions& frameOptions,
+                       const FITSKeywordArray& frameKeywords, const IsoString& history)
+{
+    FileFormat format(File::ExtractExtension(filePath), false, true);
+    FileFormatInstance file(format);
+    if (!file.Create(filePath))
+        throw Error("Unable to create image file: " + filePath);
+    ImageOptions options = frameOptions;
+    options.bitsPerSample = image.BitsPerSample();
+    options.ieeefpSampleFormat = true;
+    file.SetOptions(options);
+    if (format.CanStoreKeywords()) {
+        FITSKeywordArray keywords = frameKeywords;
+        keywords << FITSHeaderKeyword("HISTORY", IsoString(), history);
+        if (!file.WriteFITSKeywords(keywords))
+            throw Error("Unable to write the keywords of image file: " + filePath);
+    }
+    if (!file.WriteImage(image))
+        throw Error("Unable to write image file: " + filePath);
+    file.Close();
+}
+
+SuperFlatBatch::SuperFlatBatch(const SuperFlatInstance& instance)
+    : m_instance(instance)
+    , m_frames(1)
+    , m_stageThreads(0)
+    , m_capacity(3)
+    , m_inMemory(0)
+    , m_processors(0)
+    , m_readDone(false)
+    , m_writeDone(false)
+    , m_cancel(false)
+{
+}
+
+SuperFlatBatch::~SuperFlatBatch()
+{
+    for (SuperFlatBatchFrame* frame : m_read)
+        delete frame;
+    for (SuperFlatBatchFrame* frame : m_processed)
+        delete frame;
+    for (SuperFlatBatchFrame* frame : m_written)
+        delete frame;
+    m_nonSky.Destroy();
+}
+
+bool SuperFlatBatch::Run()
+{
+    Console console;
+    console.EnableAbort();
+
+    // Inputs shared by all frames are loaded once.
+    if (m_instance.useSplineGrid)
+        m_grid.Read(m_instance.splineGridFile);
+    m_nonSkyMask = m_instance.nonSkyMaskImage(32);
+    Plan();
+
+    const size_type count = m_instance.targetFrames.Length();
+    console.WriteLn(String().Format("<end><cbr>SuperFlat batch: %u frames, %d at a time", unsigned(count), m_frames)
+        + ((m_frames > 1) ? String().Format(" on %d threads each", m_stageThreads) : String()));
+    SuperFlatKernelCache& kernelCache = TheSuperFlatModule->KernelCache();
+    const size_type kernelHits = kernelCache.Hits();
+    const size_type kernelMisses = kernelCache.Misses();
+
+    ReferenceArray<SuperFlatBatchThread> threads;
+    threads << new SuperFlatBatchThread([this]() { ReadFrames(); });
+    for (int i = 0; i < m_frames; i++)
+        threads << new SuperFlatBatchThread([this]() { ProcessFrames(); });
+    threads << new SuperFlatBatchThread([this]() { WriteFrames(); });
+    m_processors = m_frames;
+    for (SuperFlatBatchThread& t : threads)
+        t.Start();
+
+    StandardStatus status;
+    StatusMonitor monitor;
+    monitor.SetCallback(&status);
+    monitor.Initialize("Processing frames", count);
+    ElapsedTime T;
+    size_type written = 0;
+    size_type failed = 0;
+    double readTime = 0;
+    double processTime = 0;
+    double writeTime = 0;
+    try {
+        for (;;) {
+            Array<SuperFlatBatchFrame*> frames;
+            bool finished;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_changed.wait_for(lock, std::chrono::milliseconds(100), [this]() { return !m_written.IsEmpty() || m_writeDone; });
+                frames = m_written;
+                m_written.Clear();
+                finished = m_writeDone;
+            }
+
+            for (SuperFlatBatchFrame* frame : frames) {
+                const String& filePath = m_instance.targetFrames[frame->index];
+                if (!frame->error.IsEmpty()) {
+                    console.CriticalLn("<end><cbr>*** Error: " + filePath + ": " + frame->error);
+                    failed++;
+                } else {
+                    console.WriteLn("<end><cbr>" + filePath + " -> " + OutputPath(frame->index, String(), ".xisf"));
+                    if (!m_instance.useSplineGrid)
+                        console.WriteLn(String().Format("Stars: %u, sky pixels: %.1f%%", unsigned(frame->stars), 100 * frame->skyFraction));
+                    console.WriteLn(String().Format("Read %.3f s, processed %.3f s, written %.3f s",
+                        frame->readTime, frame->processTime, frame->writeTime));
+                    written++;
+                }
+                readTime += frame->readTime;
+                processTime += frame->processTime;
+                writeTime += frame->writeTime;
+                delete frame;
+            }
+            monitor += frames.Length();
+
+            if (finished)
+                break;
+            Module->ProcessEvents();
+            if (console.AbortRequested())
+                throw ProcessAborted();
+        }
+    } catch (...) {
+        Cancel();
+        for (SuperFlatBatchThread& t : threads)
+            t.Wait();
+        threads.Destroy();
+        throw;
+    }
+    for (SuperFlatBatchThread& t : threads)
+        t.Wait();
+    threads.Destroy();
+    monitor.Complete();
+
+    const double wall = T();
+    console.WriteLn(String().Format("<end><cbr>%u of %u frames written in %.2f s (%.2f frames/s)",
+        unsigned(written), unsigned(count), wall, written / pcl::Max(wall, 1.0e-9)));
+    console.WriteLn(String().Format("Read %.2f s, processed %.2f s, written %.2f s, added over the frames", readTime, processTime, writeTime));
+    {
+        const size_type hits = kernelCache.Hits() - kernelHits;
+        const size_type lookups = hits + kernelCache.Misses() - kernelMisses;
+        if (lookups > 0)
+            console.WriteLn(String().Format("FFT kernel cache: %u of %u kernel transforms reused (%.0f%%)",
+                unsigned(hits), unsigned(lookups), 100.0 * hits / lookups));
+    }
+    if (failed > 0)
+        console.CriticalLn(String().Format("*** %u frames failed", unsigned(failed)));
+
+    if (!m_instance.masterFlatFile.IsEmpty()) {
+        for (size_type index : m_masterFlat.Rejected())
+            console.WarningLn("** Warning: Left out of the master flat, as its model has another geometry than the first one: "
+                              + m_instance.targetFrames[index]);
+        if (m_masterFlat.Frames() == 0)
+            throw Error("No frame has been combined into the master flat.");
+        WriteImage(m_instance.masterFlatFile, m_masterFlat.Image(), ImageOptions(), FITSKeywordArray(),
+                   IsoString().Format("Master flat combined with SuperFlat from %d frames", m_masterFlat.Frames()));
+        console.WriteLn(String().Format("<end><cbr>Master flat: %d frames, %.2f%% of the samples clipped",
+            m_masterFlat.Frames(), 100.0 * m_masterFlat.Clipped() / pcl::Max(m_masterFlat.Samples(), size_type(1))));
+        console.WriteLn(m_instance.masterFlatFile);
+    }
+
+    return failed == 0;
+}
+
+void SuperFlatBatch::Plan()
+{
+    // The first frame stands for the whole batch. Each frame gets as many workers as its parallel stages can use, most
+    // of them working on rows of the downsampled image, or of the full image when a spline grid is applied.
+    const int threads = TheSuperFlatModule->ThreadPool().NumberOfThreads(PCL_MAX_PROCESSORS);
+    const int factor = m_instance.useSplineGrid ? 1 : m_instance.downsample;
+    size_type samples = 0;
+    Attempt([&]() {
+        const String& filePath = m_instance.targetFrames[0];
+        FileFormat format(File::ExtractExtension(filePath), true, false);
+        FileFormatInstance file(format);
+        ImageDescriptionArray images;
+        if (file.Open(images, filePath) && !images.IsEmpty())
+            samples = size_type(pcl::Max(1, images[0].info.width / factor)) * pcl::Max(1, images[0].info.height / factor)
+                      * images[0].info.numberOfChannels;
+        file.Close();
+    });
+
+    const int frameThreads = (samples > 0) ? int(pcl::Range(samples / SamplesPerThread, size_type(1), size_type(threads))) : threads;
+    m_frames = pcl::Range(threads / frameThreads, 1, int(m_instance.targetFrames.Length()));
+    m_stageThreads = (m_frames > 1) ? pcl::Max(1, threads / m_frames) : 0;
+    // One frame read ahead, and one being written.
+    m_capacity = m_frames + 2;
+}
+
+void SuperFlatBatch::ReadFrames()
+{
+    for (size_type i = 0; i < m_instance.targetFrames.Length(); i++) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_changed.wait(lock, [this]() { return m_cancel || (m_inMemory < m_capacity); });
+            if (m_cancel)
+                break;
+            m_inMemory++;
+        }
+
+        SuperFlatBatchFrame* frame = new SuperFlatBatchFrame;
+        frame->index = i;
+        ElapsedTime T;
+        frame->error = Attempt([&]() {
+            const String& filePath = m_instance.targetFrames[i];
+            if (File::FullPath(OutputPath(i, String(), ".xisf")) == File::FullPath(filePath))
+                throw Error("The output file would replace the target frame.");
+            ReadImage(filePath, *frame);
+        });
+        frame->readTime = T();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (frame->error.IsEmpty())
+                m_read << frame;
+            else
+                m_processed << frame;
+        }
+        m_changed.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_readDone = true;
+    }
+    m_changed.notify_all();
+}
+
+void SuperFlatBatch::ProcessFrames()
+{
+    const SuperFlatInstance& instance = m_instance;
+    const bool apply = (instance.applyMode != SFApplyMode::CreateModel) && !instance.testSkyDetection;
+    SuperFlatBatchStatus callback(*this);
+
+    for (;;) {
+        SuperFlatBatchFrame* frame;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_changed.wait(lock, [this]() { return m_cancel || !m_read.IsEmpty() || m_readDone; });
+            if (m_cancel || m_read.IsEmpty())
+                break;
+            frame = m_read[0];
+            m_read.Remove(m_read.Begin());
+        }
+
+        ElapsedTime T;
+        frame->error = Attempt([&]() {
+            StatusMonitor monitor;
+            monitor.SetCallback(&callback);
+            SuperFlatExecution execution;
+            execution.threads = m_stageThreads;
+            if (instance.useSplineGrid) {
+                instance.applyGrid(frame->image, m_grid, execution, monitor);
+                return;
+            }
+
+            // The star catalog and the spline grid of every frame are written next to its output.
+            execution.starCatalogFile = instance.starCatalogFile.IsEmpty() ? String() : OutputPath(frame->index, "_stars", ".csv");
+            execution.splineGridFile = instance.splineGridFile.IsEmpty() ? String() : OutputPath(frame->index, String(), ".sfgrid");
+            execution.masterFlat = instance.masterFlatFile.IsEmpty() ? nullptr : &m_masterFlat;
+            execution.masterFlatIndex = frame->index;
+            SuperFlatBuffers buffers;
+            ImageVariant downImage = instance.downsampleImage(frame->image, buffers, execution, monitor);
+            const SuperFlatMask& nonSky = NonSkyPixels(downImage);
+            instance.modelImage(downImage, frame->image.Width(), frame->image.Height(), nonSky, frame->model, frame->mask, buffers, execution, monitor);
+            if (!instance.generateSkyMask)
+                frame->mask = ImageVariant();
+            if (apply) {
+                instance.applyModel(frame->image, frame->model, execution, monitor);
+                frame->model = ImageVariant();
+            } else
+                frame->image = ImageVariant();
+            frame->stars = execution.starCount;
+            frame->skyFraction = execution.skyFraction;
+        });
+        frame->processTime = T();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_processed << frame;
+        }
+        m_changed.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_processors--;
+    }
+    m_changed.notify_all();
+}
+
+void SuperFlatBatch::WriteFrames()
+{
+    for (;;) {
+        SuperFlatBatchFrame* frame;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_changed.wait(lock, [this]() { return m_cancel || !m_processed.IsEmpty() || (m_processors == 0); });
+            if (m_cancel || m_processed.IsEmpty())
+                break;
+            frame = m_processed[0];
+            m_processed.Remove(m_processed.Begin());
+        }
+
+        if (frame->error.IsEmpty()) {
+            ElapsedTime T;
+            frame->error = Attempt([&]() {
+                if (frame->model)
+                    WriteImage(OutputPath(frame->index, String(), ".xisf"), frame->model, frame->options, frame->keywords, "Background model made with SuperFlat");
+                else
+                    WriteImage(OutputPath(frame->index, String(), ".xisf"), frame->image, frame->options, frame->keywords, "Background corrected with SuperFlat");
+                if (frame->mask)
+                    WriteImage(OutputPath(frame->index, "_skymask", ".xisf"), frame->mask, frame->options, frame->keywords, "Sky mask made with SuperFlat");
+            });
+            frame->writeTime = T();
+        }
+        frame->image = ImageVariant();
+        frame->model = ImageVariant();
+        frame->mask = ImageVariant();
+        // Frames that failed before their model was combined must not hold back the later ones.
+        if (!m_instance.masterFlatFile.IsEmpty())
+            m_masterFlat.Skip(frame->index);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_inMemory--;
+            m_written << frame;
+        }
+        m_changed.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_writeDone = true;
+    }
+    m_changed.notify_all();
+}
+
+void SuperFlatBatch::Cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cancel = true;
+    }
+    m_changed.notify_all();
+}
+
+const SuperFlatMask& SuperFlatBatch::NonSkyPixels(const ImageVariant& image)
+{
+    if (!m_nonSkyMask)
+        return m_noMask;
+
+    // Frames of the same geometry share the mask binarized for the first of them.
+    std::lock_guard<std::mutex> lock(m_maskMutex);
+    for (const SuperFlatMask& mask : m_nonSky)
+        if ((mask.Width() == image.Width()) && (mask.Height() == image.Height()) && (mask.NumberOfChannels() == image.NumberOfChannels()))
+            return mask;
+    ImageVariant nonSkyMask;
+    nonSkyMask.CreateFloatImage(m_nonSkyMask.BitsPerSample());
+    nonSkyMask.CopyImage(m_nonSkyMask);
+    SuperFlatBuffers buffers;
+    m_nonSky << new SuperFlatMask(m_instance.nonSkyPixels(nonSkyMask, image, buffers));
+    return m_nonSky[m_nonSky.Length() - 1];
+}
+
+String SuperFlatBatch::OutputPath(size_type index, const String& suffix, const String& extension) const
+{
+    const String& filePath = m_instance.targetFrames[index];
+    String directory = m_instance.outputDirectory.IsEmpty() ? File::ExtractDrive(filePath) + File::ExtractDirectory(filePath) : m_instance.outputDirectory;
+    if (!directory.EndsWith('/'))
+        directory += '/';
+    return directory + File::ExtractName(filePath) + m_instance.outputPostfix + suffix + extension;
+}
+
+}	// namespace pcl
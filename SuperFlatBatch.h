@@ -0,0 +1,104 @@
+#ifndef __SuperFlatBatch_h
+#define __SuperFlatBatch_h
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+#include <pcl/Array.h>
+#include <pcl/FITSHeaderKeyword.h>
+#include <pcl/ImageDescription.h>
+#include <pcl/ImageVariant.h>
+#include <pcl/ReferenceArray.h>
+#include <pcl/String.h>
+
+#include "SuperFlatMask.h"
+#include "SuperFlatMasterFlat.h"
+#include "SuperFlatSplineGrid.h"
+
+namespace pcl
+{
+
+class SuperFlatInstance;
+
+// A frame of a batch, from the moment it is read until its outputs are written.
+struct SuperFlatBatchFrame
+{
+    size_type index = 0;
+    // The frame as read, corrected in place when the model is applied; otherwise the model is the output. The sky mask
+    // is only kept if one is generated.
+    ImageVariant image;
+    ImageVariant model;
+    ImageVariant mask;
+    ImageOptions options;
+    FITSKeywordArray keywords;
+    size_type stars = 0;
+    double skyFraction = 0;
+    double readTime = 0;
+    double processTime = 0;
+    double writeTime = 0;
+    String error;
+};
+
+// Global execution over a list of image files, as a pipeline of three stages that overlap: a reader thread loads the
+// frames in order, processing threads compute their models and apply them, and a writer thread saves the results. No
+// more than Capacity frames are held in memory at once, so the reader waits for the writer when processing is the
+// bottleneck. Frames too small to keep all the workers of the pool busy in their parallel stages are processed several
+// at a time, each one with its share of the workers.
+class SuperFlatBatch
+{
+public:
+    // Downsampled samples of a frame per worker of its parallel stages, below which a worker costs more to start than
+    // it saves.
+    static constexpr size_type SamplesPerThread = size_type(1) << 17;
+
+    SuperFlatBatch(const SuperFlatInstance& instance);
+    ~SuperFlatBatch();
+
+    // Processes all frames, reporting each one on the console once it has been written. Returns false if any of them
+    // failed.
+    bool Run();
+
+private:
+    const SuperFlatInstance& m_instance;
+    // Spline grid applied to every frame, and the non-sky mask with its binarized versions for each frame geometry.
+    SuperFlatSplineGrid m_grid;
+    ImageVariant m_nonSkyMask;
+    ReferenceArray<SuperFlatMask> m_nonSky;
+    SuperFlatMask m_noMask;
+    std::mutex m_maskMutex;
+    // Master flat combined from the models of the frames, if one is written.
+    SuperFlatMasterFlat m_masterFlat;
+
+    // Frames processed side by side, workers of each one, and frames held in memory at most.
+    int m_frames;
+    int m_stageThreads;
+    int m_capacity;
+
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    // Frames read and waiting to be processed, processed (or failed) and waiting to be written, and written and waiting
+    // to be reported.
+    Array<SuperFlatBatchFrame*> m_read;
+    Array<SuperFlatBatchFrame*> m_processed;
+    Array<SuperFlatBatchFrame*> m_written;
+    int m_inMemory;
+    int m_processors;
+    bool m_readDone;
+    bool m_writeDone;
+    std::atomic<bool> m_cancel;
+
+    void Plan();
+    void ReadFrames();
+    void ProcessFrames();
+    void WriteFrames();
+    void Cancel();
+    const SuperFlatMask& NonSkyPixels(const ImageVariant& image);
+    String OutputPath(size_type index, const String& suffix, const String& extension) const;
+
+    friend class SuperFlatBatchStatus;
+};
+
+}	// namespace pcl
+
+#endif	// __SuperFlatBatch_h
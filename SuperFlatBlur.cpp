@@ -0,0 +1,164 @@
+#include <pcl/Image.h>
+#include <pcl/ImageVariant.h>
+#include <pcl/Math.h>
+
+#include "SuperFlatBlur.h"
+#include "SuperFlatKernelCache.h"
+#include "SuperFlatModule.h"
+
+namespace pcl
+{
+
+static double ShapeProfile(double x, double sigma)
+{
+    return pcl::Exp(-pcl::Pow(pcl::Abs(x) / sigma, 5.0) / 5);
+}
+
+int SuperFlatShapeBlur::Radius(double sigma)
+{
+    // Farthest sample at or above the 0.01 cutoff of the filter.
+    int radius = int(sigma * pcl::Pow(5 * pcl::Ln(100.0), 0.2));
+    while (ShapeProfile(radius + 1, sigma) >= 0.01)
+        radius++;
+    while ((radius > 0) && (ShapeProfile(radius, sigma) < 0.01))
+        radius--;
+    return radius;
+}
+
+SuperFlatShapeBlur::SuperFlatShapeBlur(double sigma)
+    : m_radius(Radius(sigma))
+{
+    // Kernel g[k], k = -radius ... radius, linear between the knots and zero outside.
+    const int r = m_radius;
+    Array<double> g(2 * r + 1);
+    for (int m = 0; m < Knots; m++) {
+        const int k0 = pcl::RoundInt(double(r) * m / Knots);
+        const int k1 = pcl::RoundInt(double(r) * (m + 1) / Knots);
+        const double g0 = ShapeProfile(k0, sigma);
+        const double g1 = ShapeProfile(k1, sigma);
+        for (int k = k0; k <= k1; k++) {
+            const double v = (k1 > k0) ? g0 + (g1 - g0) * (k - k0) / (k1 - k0) : g0;
+            g[r + k] = g[r - k] = v;
+        }
+    }
+    double weight = 0;
+    for (double v : g)
+        weight += v;
+
+    // y[n] = sum_k g[k] x[n - k] = sum_j (g[j] - 2 g[j-1] + g[j-2]) S[n - j], where S is the line accumulated twice.
+    // Offsets are relative to sample n of a line extended by radius + 2 samples at each end.
+    auto at = [&g, r](int k) { return ((k >= -r) && (k <= r)) ? g[r + k] : 0.0; };
+    for (int j = -r; j <= r + 2; j++) {
+        const double d = at(j) - 2 * at(j - 1) + at(j - 2);
+        if (pcl::Abs(d) > 1.0e-12)
+            m_terms << Term{ r + 2 - j, d / weight };
+    }
+}
+
+bool SuperFlatShapeBlur::IsApplicable(double sigma)
+{
+    return Radius(sigma) >= 4 * Knots;
+}
+
+void SuperFlatShapeBlur::Apply(double* data, int length, int lanes, double* work) const
+{
+    const int pad = m_radius + 2;
+    const int extended = length + 2 * pad;
+    Array<double> first(data, data + lanes);
+    Array<double> s1(lanes, 0.0);
+    Array<double> s2(lanes, 0.0);
+
+    // The sums are taken relative to the first sample of each line to keep them small; the kernel is normalized, so the
+    // offset is simply added back.
+    for (int e = 0; e < extended; e++) {
+        const double* x = data + size_type(pcl::Range(e - pad, 0, length - 1)) * lanes;
+        double* s = work + size_type(e) * lanes;
+        for (int j = 0; j < lanes; j++) {
+            s1[j] += x[j] - first[j];
+            s2[j] += s1[j];
+            s[j] = s2[j];
+        }
+    }
+
+    for (int i = 0; i < length; i++) {
+        double* y = data + size_type(i) * lanes;
+        for (int j = 0; j < lanes; j++)
+            y[j] = first[j];
+        for (const Term& t : m_terms) {
+            const double* s = work + size_type(i + t.offset) * lanes;
+            for (int j = 0; j < lanes; j++)
+                y[j] += t.weight * s[j];
+        }
+    }
+}
+
+// Filters lines laid out as for SuperFlatShapeBlur::Apply() with the exact profile truncated at radius, sample by
+// sample, and with the lines extended with their edge samples as Apply() extends them.
+static void ConvolveDirect(double* data, int length, int lanes, double sigma, int radius)
+{
+    Array<double> g(2 * radius + 1);
+    double weight = 0;
+    for (int k = -radius; k <= radius; k++)
+        weight += g[radius + k] = ShapeProfile(k, sigma);
+
+    Array<double> result(size_type(length) * lanes, 0.0);
+    for (int i = 0; i < length; i++) {
+        double* y = result.At(size_type(i) * lanes);
+        for (int k = -radius; k <= radius; k++) {
+            const double w = g[radius + k] / weight;
+            const double* x = data + size_type(pcl::Range(i - k, 0, length - 1)) * lanes;
+            for (int j = 0; j < lanes; j++)
+                y[j] += w * x[j];
+        }
+    }
+    for (size_type i = 0; i < result.Length(); i++)
+        data[i] = result[i];
+}
+
+SuperFlatShapeBlur::Deviation SuperFlatShapeBlur::Compare(double sigma, int width, int height)
+{
+    // A gradient with uniform noise drawn from a fixed linear congruential sequence.
+    DImage image(width, height);
+    uint32 seed = 12345;
+    for (int y = 0; y < height; y++) {
+        double* row = image.ScanLine(y);
+        for (int x = 0; x < width; x++) {
+            seed = seed * 1664525u + 1013904223u;
+            row[x] = 0.25 + 0.25 * x / width + 0.25 * y / height + 0.25 * (seed >> 8) / 16777216.0;
+        }
+    }
+
+    DImage reference(image);
+    reference.EnsureUnique();
+    ImageVariant variant(&reference);
+    TheSuperFlatModule->KernelCache().Convolve(variant, float(sigma), 5.0f);
+
+    SuperFlatShapeBlur blur(sigma);
+    const int r = blur.m_radius;
+    DImage direct(image);
+    direct.EnsureUnique();
+    for (int y = 0; y < height; y++)
+        ConvolveDirect(direct.ScanLine(y), width, 1, sigma, r);
+    ConvolveDirect(direct.PixelData(), height, width, sigma, r);
+
+    // Rows one at a time, then all columns at once as interleaved lines.
+    Array<double> work(pcl::Max(blur.WorkLength(width), blur.WorkLength(height) * width));
+    for (int y = 0; y < height; y++)
+        blur.Apply(image.ScanLine(y), width, 1, work.Begin());
+    blur.Apply(image.PixelData(), height, width, work.Begin());
+
+    Deviation deviation = { r, 0.0, 0.0 };
+    for (int y = 0; y < height; y++) {
+        const double* a = image.ScanLine(y);
+        const double* b = reference.ScanLine(y);
+        const double* c = direct.ScanLine(y);
+        for (int x = 0; x < width; x++)
+            if ((x >= r) && (x < width - r) && (y >= r) && (y < height - r))
+                deviation.interior = pcl::Max(deviation.interior, pcl::Abs(a[x] - b[x]));
+            else
+                deviation.edges = pcl::Max(deviation.edges, pcl::Abs(a[x] - c[x]));
+    }
+    return deviation;
+}
+
+}	// namespace pcl
@@ -0,0 +1,92 @@
+#ifndef __SuperFlatBlur_h
+#define __SuperFlatBlur_h
+
+#include <pcl/Array.h>
+
+namespace pcl
+{
+
+// Separable form of VariableShapeFilter(sigma, 5, 0.01, 1, 0), the kernel of the background blurs. With rho = 1 and
+// theta = 0 that kernel is the product of two profiles exp(-|x/sigma|^5/5), truncated where they fall below 0.01, so it
+// can be applied along rows and then along columns. The profile is interpolated linearly between a fixed number of
+// knots. The second difference of such a kernel is zero but at the knots, so the convolution is a short weighted sum of
+// samples of the twice accumulated line, and its cost does not depend on sigma.
+class SuperFlatShapeBlur
+{
+public:
+    // Number of linear segments of the half profile.
+    static constexpr int Knots = 24;
+
+    SuperFlatShapeBlur(double sigma);
+
+    // Whether the kernel is large enough for the interpolated profile to pay off. Smaller kernels are better convolved
+    // directly.
+    static bool IsApplicable(double sigma);
+
+    // Filters in place lanes interleaved lines of length samples: sample i of line j is data[i*lanes + j]. Lines are
+    // extended with their edge samples, which FFTConvolution does not do, so within a kernel radius of the edges of an
+    // image the result differs from that of SuperFlatKernelCache::Convolve by more than the interpolation of the
+    // profile alone. work must hold WorkLength(length)*lanes samples.
+    void Apply(double* data, int length, int lanes, double* work) const;
+
+    size_type WorkLength(int length) const
+    {
+        return size_type(length) + 2 * (m_radius + 2);
+    }
+
+    // Largest absolute differences for a kernel of radius samples. Farther than a radius from every edge the reference
+    // is SuperFlatKernelCache::Convolve. Within a radius of the edges, where FFTConvolution does not extend the lines as
+    // Apply() does, it is a direct convolution with the exact profile and the same extension of the edges.
+    struct Deviation
+    {
+        int radius;
+        double interior;
+        double edges;
+    };
+
+    // Blurs the same synthetic 64-bit image of width x height pixels, always the same for a given geometry, with this
+    // class and with the references, and compares the results.
+    static Deviation Compare(double sigma, int width, int height);
+
+private:
+    struct Term
+    {
+        int offset;
+        double weight;
+    };
+
+    int m_radius;
+    Array<Term> m_terms;
+
+    static int Radius(double sigma);
+};
+
+// Weights of the four samples around a point at fraction t of the way from sample 1 to sample 2, for a cubic B-spline
+// approximation (not interpolation) of the samples.
+inline void SuperFlatCubicBSpline(double t, double* w)
+{
+    const double t2 = t * t;
+    const double t3 = t2 * t;
+    w[0] = (1 - t) * (1 - t) * (1 - t) / 6;
+    w[1] = (3 * t3 - 6 * t2 + 4) / 6;
+    w[2] = (-3 * t3 + 3 * t2 + 3 * t + 1) / 6;
+    w[3] = t3 / 6;
+}
+
+// Index of sample i of a sequence of n samples mirrored about its first and last samples.
+inline int SuperFlatMirror(int i, int n)
+{
+    if (n == 1)
+        return 0;
+    for (;;)
+        if (i < 0)
+            i = -i;
+        else if (i >= n)
+            i = 2 * (n - 1) - i;
+        else
+            return i;
+}
+
+}	// namespace pcl
+
+#endif	// __SuperFlatBlur_h
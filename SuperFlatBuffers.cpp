@@ -0,0 +1,116 @@
+#include <cstring>
+
+#include "SuperFlatBuffers.h"
+
+namespace pcl
+{
+
+template <class P>
+static void CopyPixels(GenericImage<P>& target, const GenericImage<P>& source)
+{
+    for (int c = 0; c < source.NumberOfChannels(); c++)
+        ::memcpy(target.PixelData(c), source.PixelData(c), source.NumberOfPixels() * sizeof(typename P::sample));
+}
+
+SuperFlatBuffers::SuperFlatBuffers()
+    : m_current(0)
+    , m_peak(0)
+{
+}
+
+ImageVariant SuperFlatBuffers::Acquire(int bitsPerSample, int width, int height, int numberOfChannels, color_space colorSpace)
+{
+    for (size_type i = 0; i < m_free.Length(); i++) {
+        const ImageVariant& f = m_free[i];
+        if ((f.BitsPerSample() == bitsPerSample) && (f.Width() == width) && (f.Height() == height)
+            && (f.NumberOfChannels() == numberOfChannels)) {
+            ImageVariant image = f;
+            m_free.Remove(m_free.At(i));
+            image.SetColorSpace(colorSpace);
+            return image;
+        }
+    }
+
+    ImageVariant image;
+    image.CreateFloatImage(bitsPerSample);
+    image.AllocateImage(width, height, numberOfChannels, colorSpace);
+    image.SetStatusCallback(nullptr);
+    Track(image);
+    return image;
+}
+
+ImageVariant SuperFlatBuffers::Acquire(const ImageVariant& model)
+{
+    return Acquire(model.BitsPerSample(), model.Width(), model.Height(), model.NumberOfChannels(), model.ColorSpace());
+}
+
+ImageVariant SuperFlatBuffers::Copy(const ImageVariant& source)
+{
+    ImageVariant image = Acquire(source);
+    if (source.BitsPerSample() == 32)
+        CopyPixels(static_cast<Image&>(*image), static_cast<const Image&>(*source));
+    else
+        CopyPixels(static_cast<DImage&>(*image), static_cast<const DImage&>(*source));
+    return image;
+}
+
+void SuperFlatBuffers::Release(ImageVariant& image)
+{
+    if (image) {
+        m_free << image;
+        image = ImageVariant();
+    }
+}
+
+void SuperFlatBuffers::Adopt(const ImageVariant& image)
+{
+    Track(image);
+}
+
+void SuperFlatBuffers::Disown(const ImageVariant& image)
+{
+    Untrack(image);
+}
+
+void SuperFlatBuffers::Resized(const ImageVariant& image)
+{
+    Untrack(image);
+    Track(image);
+}
+
+size_type SuperFlatBuffers::CurrentBytes() const
+{
+    return m_current;
+}
+
+size_type SuperFlatBuffers::PeakBytes() const
+{
+    return m_peak;
+}
+
+void SuperFlatBuffers::Track(const ImageVariant& image)
+{
+    Entry e;
+    e.image = &*image;
+    e.bytes = Bytes(image);
+    m_tracked << e;
+    m_current += e.bytes;
+    m_peak = pcl::Max(m_peak, m_current);
+}
+
+void SuperFlatBuffers::Untrack(const ImageVariant& image)
+{
+    for (Array<Entry>::iterator i = m_tracked.Begin(); i != m_tracked.End(); ++i)
+        if (i->image == &*image) {
+            m_current -= i->bytes;
+            m_tracked.Remove(i);
+            return;
+        }
+}
+
+size_type SuperFlatBuffers::Bytes(const ImageVariant& image)
+{
+    return size_type(image.Width()) * image.Height() * image.NumberOfChannels() * (image.BitsPerSample() >> 3);
+}
+
+}	// namespace pcl
@@ -0,0 +1,60 @@
+#ifndef __SuperFlatBuffers_h
+#define __SuperFlatBuffers_h
+
+#include <pcl/Array.h>
+#include <pcl/ImageVariant.h>
+
+namespace pcl
+{
+
+// Owner of the intermediate images of one execution. Released images are kept and handed out again to later requests
+// with the same sample type and geometry, instead of being freed and allocated anew. The memory held by the live and
+// cached images, plus any image adopted from elsewhere, is tracked to report the peak use of an execution.
+class SuperFlatBuffers
+{
+public:
+    SuperFlatBuffers();
+
+    // An image with undefined pixel values.
+    ImageVariant Acquire(int bitsPerSample, int width, int height, int numberOfChannels, color_space colorSpace);
+
+    // An image with the sample type and geometry of model, and undefined pixel values.
+    ImageVariant Acquire(const ImageVariant& model);
+
+    // An image holding a copy of source. Both must be floating point images.
+    ImageVariant Copy(const ImageVariant& source);
+
+    // Gives image back for reuse and empties the caller's handle.
+    void Release(ImageVariant& image);
+
+    // Counts an image allocated elsewhere (e.g. an output window) until it is disowned.
+    void Adopt(const ImageVariant& image);
+    void Disown(const ImageVariant& image);
+
+    // Call after an acquired or adopted image has been reallocated by an in-place transformation.
+    void Resized(const ImageVariant& image);
+
+    size_type CurrentBytes() const;
+    size_type PeakBytes() const;
+
+private:
+    struct Entry
+    {
+        const AbstractImage* image;
+        size_type bytes;
+    };
+
+    Array<Entry> m_tracked;
+    Array<ImageVariant> m_free;
+    size_type m_current;
+    size_type m_peak;
+
+    void Track(const ImageVariant& image);
+    void Untrack(const ImageVariant& image);
+
+    static size_type Bytes(const ImageVariant& image);
+};
+
+}	// namespace pcl
+
+#endif	// __SuperFlatBuffers_h
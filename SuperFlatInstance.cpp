@@ -1,105 +1,516 @@
-#include <random>
+#include <atomic>
+#include <limits>
 #include <pcl/AutoViewLock.h>
 #include <pcl/Console.h>
-#include <pcl/FFTConvolution.h>
-#include <pcl/IntegerResample.h>
-#include <pcl/MorphologicalTransformation.h>
-#include <pcl/MultiscaleLinearTransform.h>
+#include <pcl/ElapsedTime.h>
+#include <pcl/File.h>
 #include <pcl/PixelInterpolation.h>
 #include <pcl/Resample.h>
+#include <pcl/Selection.h>
 #include <pcl/StandardStatus.h>
-#include <pcl/VariableShapeFilter.h>
 #include <pcl/View.h>
 
+#include "SuperFlatBatch.h"
+#include "SuperFlatBlur.h"
+#include "SuperFlatBuffers.h"
 #include "SuperFlatInstance.h"
+#include "SuperFlatMask.h"
+#include "SuperFlatMasterFlat.h"
+#include "SuperFlatModule.h"
 #include "SuperFlatParameters.h"
+#include "SuperFlatRays.h"
+#include "SuperFlatSelection.h"
+#include "SuperFlatSplineGrid.h"
+#include "SuperFlatStageCache.h"
+#include "SuperFlatStars.h"
 
 namespace pcl
 {
 
+// Range of work items [begin, end) owned by a worker. Both ends are packed in a single atomic word so that the owner,
+// which takes items from the front, and the thieves, which take the back half, never hand out the same item twice.
+class SuperFlatWorkQueue
+{
+public:
+    void Reset(uint32 begin, uint32 end)
+    {
+        m_range.store(Pack(begin, end));
+    }
+
+    uint32 Remaining() const
+    {
+        uint64 r = m_range.load();
+        return (Begin(r) < End(r)) ? End(r) - Begin(r) : 0;
+    }
+
+    bool Pop(uint32& item)
+    {
+        uint64 r = m_range.load();
+        while (Begin(r) < End(r))
+            if (m_range.compare_exchange_weak(r, Pack(Begin(r) + 1, End(r)))) {
+                item = Begin(r);
+                return true;
+            }
+        return false;
+    }
+
+    bool Steal(uint32& begin, uint32& end)
+    {
+        uint64 r = m_range.load();
+        while (Begin(r) < End(r)) {
+            uint32 split = End(r) - (End(r) - Begin(r) + 1) / 2;
+            if (m_range.compare_exchange_weak(r, Pack(Begin(r), split))) {
+                begin = split;
+                end = End(r);
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::atomic<uint64> m_range { 0 };
+
+    static uint64 Pack(uint32 begin, uint32 end)
+    {
+        return (uint64(begin) << 32) | end;
+    }
+
+    static uint32 Begin(uint64 r)
+    {
+        return uint32(r >> 32);
+    }
+
+    static uint32 End(uint64 r)
+    {
+        return uint32(r);
+    }
+};
+
+// Cancellation flag and progress counter shared by the workers of a parallel stage.
+struct SuperFlatStage
+{
+    std::atomic<bool> aborted { false };
+    std::atomic<size_type> done { 0 };
+};
+
+// Work done by one pool worker during a parallel stage.
 template <class P>
-class SuperFlatThread : public Thread
+class SuperFlatThread
 {
 public:
-    typedef void(*LineProcessFunc)(SuperFlatInstance* superFlat, ReferenceArray<GenericImage<P>>&, GenericImage<P>&, int, int);
+    typedef void(*LineProcessFunc)(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>&, GenericImage<P>&, int, int);
+    typedef void(*SpanProcessFunc)(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>&, GenericImage<P>&, const SuperFlatSpan&, int);
+
+    // Longest run of pixels handed out as a single work item.
+    static constexpr int MaxSpanLength = 256;
 
-    SuperFlatThread(int id, LineProcessFunc lineProcessFunc, const AbstractImage::ThreadData& data, SuperFlatInstance* superFlat,
+    // Channel index that makes a line dispatch process every channel of the destination image.
+    static constexpr int AllChannels = -1;
+
+    SuperFlatThread(int id, ReferenceArray<SuperFlatThread>& workers, SuperFlatStage& stage,
+                    LineProcessFunc lineProcessFunc, SpanProcessFunc spanProcessFunc, const SuperFlatSpan* spans, const SuperFlatStageContext& context,
                     ReferenceArray<GenericImage<P>>& srcImages, GenericImage<P>& dstImage,
-                    int channel, int firstRow, int endRow)
+                    int channel, int lines, int firstItem, int endItem)
         : m_id(id)
+        , m_workers(workers)
+        , m_stage(stage)
         , m_lineProcessFunc(lineProcessFunc)
-        , m_data(data)
-        , m_superFlat(superFlat)
+        , m_spanProcessFunc(spanProcessFunc)
+        , m_spans(spans)
+        , m_context(context)
         , m_srcImages(srcImages)
         , m_dstImage(dstImage)
         , m_channel(channel)
-        , m_firstRow(firstRow)
-        , m_endRow(endRow)
+        , m_lines(lines)
         , m_threadErrorMsg("")
     {
+        m_queue.Reset(firstItem, endItem);
     }
 
-    void Run() override
+    void Run()
     {
-        INIT_THREAD_MONITOR();
+        ElapsedTime T;
         try {
-            for (int y = m_firstRow; y < m_endRow; y++) {
-                m_lineProcessFunc(m_superFlat, m_srcImages, m_dstImage, y, m_channel);
-                UPDATE_THREAD_MONITOR(65536);
+            uint32 item;
+            while (!m_stage.aborted && NextItem(item)) {
+                if (m_spanProcessFunc != nullptr)
+                    m_spanProcessFunc(m_context, m_srcImages, m_dstImage, m_spans[item], m_spans[item].channel);
+                else if (m_channel == AllChannels)
+                    m_lineProcessFunc(m_context, m_srcImages, m_dstImage, int(item % m_lines), int(item / m_lines));
+                else
+                    m_lineProcessFunc(m_context, m_srcImages, m_dstImage, int(item), m_channel);
+                m_items++;
+                m_stage.done++;
             }
+        } catch (Exception& x) {
+            m_threadErrorMsg = x.Message();
+        } catch (std::bad_alloc&) {
+            m_threadErrorMsg = "Out of memory";
         } catch (...) {
-            volatile AutoLock lock(m_data.mutex);
-            try {
-                throw;
-            } catch (Exception& x) {
-                m_threadErrorMsg = x.Message();
-            } catch (std::bad_alloc&) {
-                m_threadErrorMsg = "Out of memory";
-            } catch (...) {
-                m_threadErrorMsg = "Unknown error";
-            }
+            m_threadErrorMsg = "Unknown error";
         }
+        if (m_threadErrorMsg != "")
+            m_stage.aborted = true;
+        m_busy = T();
     }
 
-    static void dispatch(LineProcessFunc lineProcessFunc, SuperFlatInstance* superFlat,
-                         ReferenceArray<GenericImage<P>>& srcImages, GenericImage<P>& dstImage, int channel)
+    // Every (line, channel) pair is a work item when channel is AllChannels. Progress is reported to the status
+    // monitor of dstImage in work items.
+    static void dispatch(LineProcessFunc lineProcessFunc, const SuperFlatStageContext& context,
+                         ReferenceArray<GenericImage<P>>& srcImages, GenericImage<P>& dstImage, int channel, int count = -1)
     {
-        Array<size_type> L = Thread::OptimalThreadLoads(dstImage.Height(), 1, PCL_MAX_PROCESSORS);
-        ReferenceArray<SuperFlatThread> threads;
-        AbstractImage::ThreadData data(dstImage, dstImage.NumberOfPixels());
-        for (int i = 0, n = 0; i < int(L.Length()); n += int(L[i++]))
-            threads << new SuperFlatThread(i, lineProcessFunc, data, superFlat, srcImages, dstImage, channel, n, n + int(L[i]));
-        AbstractImage::RunThreads(threads, data);
-        for (SuperFlatThread& t : threads)
-            if (t.m_threadErrorMsg != "")
-                throw Error(t.m_threadErrorMsg);
-        threads.Destroy();
-        dstImage.Status() = data.status;
+        if (count < 0)
+            count = dstImage.Height();
+        int items = (channel == AllChannels) ? count * dstImage.NumberOfChannels() : count;
+        run(lineProcessFunc, nullptr, nullptr, context, srcImages, dstImage, channel, count, items);
+    }
+
+    // Every span is a work item; see HoleSpans().
+    static void dispatch(SpanProcessFunc spanProcessFunc, const SuperFlatStageContext& context,
+                         ReferenceArray<GenericImage<P>>& srcImages, GenericImage<P>& dstImage, const Array<SuperFlatSpan>& spans)
+    {
+        if (!spans.IsEmpty())
+            run(nullptr, spanProcessFunc, spans.Begin(), context, srcImages, dstImage, AllChannels, 0, int(spans.Length()));
     }
 
 private:
     int m_id;
+    ReferenceArray<SuperFlatThread>& m_workers;
+    SuperFlatStage& m_stage;
+    SuperFlatWorkQueue m_queue;
     LineProcessFunc m_lineProcessFunc;
-    const AbstractImage::ThreadData& m_data;
-    SuperFlatInstance* m_superFlat;
+    SpanProcessFunc m_spanProcessFunc;
+    const SuperFlatSpan* m_spans;
+    const SuperFlatStageContext& m_context;
     ReferenceArray<GenericImage<P>>& m_srcImages;
     GenericImage<P>& m_dstImage;
     int m_channel;
-    int m_firstRow;
-    int m_endRow;
+    int m_lines;
+    double m_busy = 0;
+    size_type m_items = 0;
+    size_type m_steals = 0;
     String m_threadErrorMsg;
+
+    // Takes the next item of our own queue. Once it is empty, steals the back half of the fullest queue.
+    bool NextItem(uint32& item)
+    {
+        if (m_queue.Pop(item))
+            return true;
+        for (;;) {
+            SuperFlatThread* victim = nullptr;
+            uint32 most = 0;
+            for (SuperFlatThread& w : m_workers) {
+                uint32 n = w.m_queue.Remaining();
+                if (n > most) {
+                    most = n;
+                    victim = &w;
+                }
+            }
+            if (victim == nullptr)
+                return false;
+            uint32 begin, end;
+            if (victim->m_queue.Steal(begin, end)) {
+                m_steals++;
+                m_queue.Reset(begin + 1, end);
+                item = begin;
+                return true;
+            }
+        }
+    }
+
+    static void run(LineProcessFunc lineProcessFunc, SpanProcessFunc spanProcessFunc, const SuperFlatSpan* spans, const SuperFlatStageContext& context,
+                    ReferenceArray<GenericImage<P>>& srcImages, GenericImage<P>& dstImage, int channel, int lines, int count)
+    {
+        SuperFlatThreadPool& pool = TheSuperFlatModule->ThreadPool();
+        int n = pool.NumberOfThreads(count);
+        SuperFlatExecution& execution = *context.execution;
+        if (execution.threads > 0)
+            n = pcl::Min(n, execution.threads);
+        SuperFlatStage stage;
+        ReferenceArray<SuperFlatThread> threads;
+        for (int i = 0; i < n; i++)
+            threads << new SuperFlatThread(i, threads, stage, lineProcessFunc, spanProcessFunc, spans, context, srcImages, dstImage, channel, lines,
+                                           int(int64(count) * i / n), int(int64(count) * (i + 1) / n));
+        StatusMonitor& status = dstImage.Status();
+        size_type reported = 0;
+        ElapsedTime T;
+        try {
+            pool.Run(n,
+                [&threads](int i) { threads[i].Run(); },
+                [&]() {
+                    size_type done = stage.done;
+                    if (done > reported) {
+                        try {
+                            status += done - reported;
+                        } catch (...) {
+                            stage.aborted = true;
+                            throw;
+                        }
+                        reported = done;
+                    }
+                });
+        } catch (...) {
+            threads.Destroy();
+            throw;
+        }
+        double wall = T();
+        for (SuperFlatThread& t : threads)
+            if (t.m_threadErrorMsg != "") {
+                String message = t.m_threadErrorMsg;
+                threads.Destroy();
+                throw Error(message);
+            }
+        Array<SuperFlatWorkerStats>& stats = execution.workerStats;
+        while (stats.Length() < threads.Length())
+            stats << SuperFlatWorkerStats();
+        for (int i = 0; i < n; i++) {
+            stats[i].busy += threads[i].m_busy;
+            stats[i].idle += pcl::Max(0.0, wall - threads[i].m_busy);
+            stats[i].items += threads[i].m_items;
+            stats[i].steals += threads[i].m_steals;
+        }
+        threads.Destroy();
+        if (stage.done > reported)
+            status += stage.done - reported;
+    }
 };
 
+// Runs of non-sky (zero) pixels of all channels, in channel and row order, cut into pieces of at most maxLength pixels.
+template <class P>
+static Array<SuperFlatSpan> HoleSpans(const GenericImage<P>& image, int maxLength)
+{
+    Array<SuperFlatSpan> spans;
+    const int width = image.Width();
+    for (int c = 0; c < image.NumberOfChannels(); c++)
+        for (int y = 0; y < image.Height(); y++) {
+            const typename P::sample* p = image.ScanLine(y, c);
+            for (int x = 0; x < width;) {
+                if (p[x] > 0.0) {
+                    x++;
+                    continue;
+                }
+                SuperFlatSpan s;
+                s.channel = c;
+                s.y = y;
+                s.x0 = x;
+                while ((x < width) && (x - s.x0 < maxLength) && !(p[x] > 0.0))
+                    x++;
+                s.x1 = x;
+                spans << s;
+            }
+        }
+    return spans;
+}
+
+// Bit x of sky set where image[x] <= ref[x] + threshold, clear elsewhere.
+template <typename T>
+static void SkyBits(const T* image, const T* ref, T threshold, uint64* sky, int n)
+{
+    for (int i = 0; i < ((n + 63) >> 6); i++)
+        sky[i] = 0;
+    for (int x = 0; x < n; x++)
+        if (!(image[x] > ref[x] + threshold))
+            sky[x >> 6] |= uint64(1) << (x & 63);
+}
+
+#ifdef SUPERFLAT_SSE2
+static void SkyBits(const float* image, const float* ref, float threshold, uint64* sky, int n)
+{
+    const __m128 t = _mm_set1_ps(threshold);
+    int x = 0;
+    for (; x + 64 <= n; x += 64) {
+        uint64 word = 0;
+        for (int l = 0; l < 64; l += 4) {
+            const int above = _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(image + x + l), _mm_add_ps(_mm_loadu_ps(ref + x + l), t)));
+            word |= uint64(~above & 15) << l;
+        }
+        sky[x >> 6] = word;
+    }
+    if (x < n)
+        SkyBits<float>(image + x, ref + x, threshold, sky + (x >> 6), n - x);
+}
+#endif
+
+// Cubic B-spline of the coarse image at the centers of the pixels of row y of an image expansion[] times finer: first
+// along the columns of the coarse image, then along the row. The coarse image is extended with its edge samples.
+template <class P>
+static void ExpandRow(const GenericImage<P>& coarse, int channel, const double* expansion, int y, double* out, int outWidth)
+{
+    const int width = coarse.Width();
+    const int height = coarse.Height();
+    double w[4];
+
+    const double v = (y + 0.5) * expansion[1] - 0.5;
+    const int iv = int(pcl::Floor(v));
+    SuperFlatCubicBSpline(v - iv, w);
+    const typename P::sample* pRows[4];
+    for (int k = 0; k < 4; k++)
+        pRows[k] = coarse.ScanLine(pcl::Range(iv - 1 + k, 0, height - 1), channel);
+    Array<double> row(width);
+    for (int x = 0; x < width; x++)
+        row[x] = w[0] * pRows[0][x] + w[1] * pRows[1][x] + w[2] * pRows[2][x] + w[3] * pRows[3][x];
+
+    for (int x = 0; x < outWidth; x++) {
+        const double u = (x + 0.5) * expansion[0] - 0.5;
+        const int iu = int(pcl::Floor(u));
+        SuperFlatCubicBSpline(u - iu, w);
+        double s = 0;
+        for (int k = 0; k < 4; k++)
+            s += w[k] * row[pcl::Range(iu - 1 + k, 0, width - 1)];
+        out[x] = s;
+    }
+}
+
+// Median of a channel of image over the pixels set in sky, or over all of its pixels if there are none. values must
+// hold a sample of every pixel of the channel; its contents are overwritten.
+template <class P>
+static double SkyMedian(const GenericImage<P>& image, const SuperFlatMask& sky, int channel, Array<double>& values)
+{
+    size_type n = 0;
+    for (int pass = 0; (pass < 2) && (n == 0); pass++)
+        for (int y = 0; y < image.Height(); y++) {
+            const typename P::sample* p = image.ScanLine(y, channel);
+            for (int x = 0; x < image.Width(); x++)
+                if ((pass > 0) || sky(x, y, channel))
+                    values[n++] = p[x];
+        }
+    return *pcl::Select(values.Begin(), values.At(n), distance_type(n >> 1));
+}
+
+// One a trous pass of the B3 spline (1, 4, 6, 4, 1)/16, with step - 1 holes between the taps, over n rows of lanes
+// interleaved sequences, the layout of SuperFlatShapeBlur::Apply(). The sequences are mirrored at both ends.
+static void ATrousB3(const double* in, double* out, int n, int lanes, int step)
+{
+    for (int i = 0; i < n; i++) {
+        const double* a = in + size_type(SuperFlatMirror(i - 2 * step, n)) * lanes;
+        const double* b = in + size_type(SuperFlatMirror(i - step, n)) * lanes;
+        const double* c = in + size_type(i) * lanes;
+        const double* d = in + size_type(SuperFlatMirror(i + step, n)) * lanes;
+        const double* e = in + size_type(SuperFlatMirror(i + 2 * step, n)) * lanes;
+        double* o = out + size_type(i) * lanes;
+        for (int j = 0; j < lanes; j++)
+            o[j] = 0.0625 * (a[j] + e[j]) + 0.25 * (b[j] + d[j]) + 0.375 * c[j];
+    }
+}
+
+// Sorts the three samples of every column, lo[x] <= mid[x] <= hi[x], with a min/max network.
+template <typename T>
+static void SortColumns(const T* a, const T* b, const T* c, T* lo, T* mid, T* hi, int n)
+{
+    for (int x = 0; x < n; x++) {
+        const T l = pcl::Min(a[x], b[x]);
+        const T h = pcl::Max(a[x], b[x]);
+        const T m = pcl::Min(h, c[x]);
+        hi[x] = pcl::Max(h, c[x]);
+        lo[x] = pcl::Min(l, m);
+        mid[x] = pcl::Max(l, m);
+    }
+}
+
+// out[x] = median of the 3x3 block of sorted columns x ... x + 2.
+template <typename T>
+static void MedianOfColumns(const T* lo, const T* mid, const T* hi, T* out, int n)
+{
+    for (int x = 0; x < n; x++) {
+        const T a = pcl::Max(pcl::Max(lo[x], lo[x + 1]), lo[x + 2]);
+        const T c = pcl::Min(pcl::Min(hi[x], hi[x + 1]), hi[x + 2]);
+        const T b0 = pcl::Min(mid[x], mid[x + 1]);
+        const T b1 = pcl::Max(mid[x], mid[x + 1]);
+        const T b = pcl::Max(b0, pcl::Min(b1, mid[x + 2]));
+        out[x] = pcl::Max(pcl::Min(a, b), pcl::Min(pcl::Max(a, b), c));
+    }
+}
+
+#ifdef SUPERFLAT_SSE2
+static void SortColumns(const float* a, const float* b, const float* c, float* lo, float* mid, float* hi, int n)
+{
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        const __m128 va = _mm_loadu_ps(a + x);
+        const __m128 vb = _mm_loadu_ps(b + x);
+        const __m128 vc = _mm_loadu_ps(c + x);
+        const __m128 l = _mm_min_ps(va, vb);
+        const __m128 h = _mm_max_ps(va, vb);
+        const __m128 m = _mm_min_ps(h, vc);
+        _mm_storeu_ps(hi + x, _mm_max_ps(h, vc));
+        _mm_storeu_ps(lo + x, _mm_min_ps(l, m));
+        _mm_storeu_ps(mid + x, _mm_max_ps(l, m));
+    }
+    SortColumns<float>(a + x, b + x, c + x, lo + x, mid + x, hi + x, n - x);
+}
+
+static void MedianOfColumns(const float* lo, const float* mid, const float* hi, float* out, int n)
+{
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        const __m128 a = _mm_max_ps(_mm_max_ps(_mm_loadu_ps(lo + x), _mm_loadu_ps(lo + x + 1)), _mm_loadu_ps(lo + x + 2));
+        const __m128 c = _mm_min_ps(_mm_min_ps(_mm_loadu_ps(hi + x), _mm_loadu_ps(hi + x + 1)), _mm_loadu_ps(hi + x + 2));
+        const __m128 m0 = _mm_loadu_ps(mid + x);
+        const __m128 m1 = _mm_loadu_ps(mid + x + 1);
+        const __m128 b = _mm_max_ps(_mm_min_ps(m0, m1), _mm_min_ps(_mm_max_ps(m0, m1), _mm_loadu_ps(mid + x + 2)));
+        _mm_storeu_ps(out + x, _mm_max_ps(_mm_min_ps(a, b), _mm_min_ps(_mm_max_ps(a, b), c)));
+    }
+    MedianOfColumns<float>(lo + x, mid + x, hi + x, out + x, n - x);
+}
+
+static void SortColumns(const double* a, const double* b, const double* c, double* lo, double* mid, double* hi, int n)
+{
+    int x = 0;
+    for (; x + 2 <= n; x += 2) {
+        const __m128d va = _mm_loadu_pd(a + x);
+        const __m128d vb = _mm_loadu_pd(b + x);
+        const __m128d vc = _mm_loadu_pd(c + x);
+        const __m128d l = _mm_min_pd(va, vb);
+        const __m128d h = _mm_max_pd(va, vb);
+        const __m128d m = _mm_min_pd(h, vc);
+        _mm_storeu_pd(hi + x, _mm_max_pd(h, vc));
+        _mm_storeu_pd(lo + x, _mm_min_pd(l, m));
+        _mm_storeu_pd(mid + x, _mm_max_pd(l, m));
+    }
+    SortColumns<double>(a + x, b + x, c + x, lo + x, mid + x, hi + x, n - x);
+}
+
+static void MedianOfColumns(const double* lo, const double* mid, const double* hi, double* out, int n)
+{
+    int x = 0;
+    for (; x + 2 <= n; x += 2) {
+        const __m128d a = _mm_max_pd(_mm_max_pd(_mm_loadu_pd(lo + x), _mm_loadu_pd(lo + x + 1)), _mm_loadu_pd(lo + x + 2));
+        const __m128d c = _mm_min_pd(_mm_min_pd(_mm_loadu_pd(hi + x), _mm_loadu_pd(hi + x + 1)), _mm_loadu_pd(hi + x + 2));
+        const __m128d m0 = _mm_loadu_pd(mid + x);
+        const __m128d m1 = _mm_loadu_pd(mid + x + 1);
+        const __m128d b = _mm_max_pd(_mm_min_pd(m0, m1), _mm_min_pd(_mm_max_pd(m0, m1), _mm_loadu_pd(mid + x + 2)));
+        _mm_storeu_pd(out + x, _mm_max_pd(_mm_min_pd(a, b), _mm_min_pd(_mm_max_pd(a, b), c)));
+    }
+    MedianOfColumns<double>(lo + x, mid + x, hi + x, out + x, n - x);
+}
+#endif
+
 SuperFlatInstance::SuperFlatInstance(const MetaProcess* m)
     : ProcessImplementation(m)
     , skyDetectionThreshold(TheSFSkyDetectionThresholdParameter->DefaultValue())
     , starDetectionSensitivity(TheSFStarDetectionSensitivityParameter->DefaultValue())
     , objectDiffusionDistance(TheSFObjectDiffusionDistanceParameter->DefaultValue())
     , nonSkyMaskViewId()
+    , starCatalogFile()
+    , splineGridFile()
     , smoothness(TheSFSmoothnessParameter->DefaultValue())
     , downsample(TheSFDownsampleParameter->DefaultValue())
     , generateSkyMask(TheSFGenerateSkyMaskParameter->DefaultValue())
     , testSkyDetection(TheSFTestSkyDetectionParameter->DefaultValue())
+    , inpaintingMethod(SFInpaintingMethod::Default)
+    , exactInpainting(TheSFExactInpaintingParameter->DefaultValue())
+    , modelingMethod(SFModelingMethod::Default)
+    , rayCount(SFRayCount::Default)
+    , smoothingMethod(SFSmoothingMethod::Default)
+    , applyMode(SFApplyMode::Default)
+    , useSplineGrid(TheSFUseSplineGridParameter->DefaultValue())
+    , maxThreads(TheSFMaxThreadsParameter->DefaultValue())
+    , stageCacheSize(TheSFStageCacheSizeParameter->DefaultValue())
+    , targetFrames()
+    , outputDirectory()
+    , outputPostfix(TheSFOutputPostfixParameter->DefaultValue())
+    , masterFlatFile()
 {
 }
 
@@ -116,14 +527,32 @@ void SuperFlatInstance::Assign(const ProcessImplementation& p)
         skyDetectionThreshold = x->skyDetectionThreshold;
         starDetectionSensitivity = x->starDetectionSensitivity;
         objectDiffusionDistance = x->objectDiffusionDistance;
+        nonSkyMaskViewId = x->nonSkyMaskViewId;
+        starCatalogFile = x->starCatalogFile;
+        splineGridFile = x->splineGridFile;
         smoothness = x->smoothness;
+        downsample = x->downsample;
         generateSkyMask = x->generateSkyMask;
+        testSkyDetection = x->testSkyDetection;
+        inpaintingMethod = x->inpaintingMethod;
+        exactInpainting = x->exactInpainting;
+        modelingMethod = x->modelingMethod;
+        rayCount = x->rayCount;
+        smoothingMethod = x->smoothingMethod;
+        applyMode = x->applyMode;
+        useSplineGrid = x->useSplineGrid;
+        maxThreads = x->maxThreads;
+        stageCacheSize = x->stageCacheSize;
+        targetFrames = x->targetFrames;
+        outputDirectory = x->outputDirectory;
+        outputPostfix = x->outputPostfix;
+        masterFlatFile = x->masterFlatFile;
     }
 }
 
 bool SuperFlatInstance::IsHistoryUpdater(const View& view) const
 {
-    return false;
+    return (applyMode != SFApplyMode::CreateModel) && (useSplineGrid || !testSkyDetection);
 }
 
 UndoFlags SuperFlatInstance::UndoMode(const View&) const
@@ -159,198 +588,1412 @@ bool SuperFlatInstance::ExecuteOn(View& view)
     if (image.IsComplexSample() || !view.Image().IsFloatSample())
         return false;
 
-    image.SetStatusCallback(&status);
+    StatusMonitor monitor;
+    monitor.SetCallback(&status);
+    SuperFlatExecution execution;
+    execution.starCatalogFile = starCatalogFile;
+    execution.splineGridFile = splineGridFile;
+    TheSuperFlatModule->ThreadPool().SetMaxThreads(maxThreads);
+    SuperFlatKernelCache& kernelCache = TheSuperFlatModule->KernelCache();
+    const size_type kernelHits = kernelCache.Hits();
+    const size_type kernelMisses = kernelCache.Misses();
+
+    if (useSplineGrid) {
+        // Apply a model saved by an earlier execution, in a single pass over the view.
+        if (applyMode == SFApplyMode::CreateModel)
+            throw Error("A saved spline grid model can only be divided into or subtracted from the image.");
+        SuperFlatSplineGrid grid;
+        grid.Read(splineGridFile);
+        applyGrid(image, grid, execution, monitor);
+        monitor.Complete();
+        return true;
+    }
+
+    const int imageWidth = image.Width();
+    const int imageHeight = image.Height();
+    SuperFlatBuffers buffers;
 
-    // Downsample
+    // When the model is applied to the view it is kept in a buffer rather than shown, and the view stays locked for
+    // writing until it has been corrected. Otherwise the view is not needed any more once it has been downsampled.
+    const bool apply = (applyMode != SFApplyMode::CreateModel) && !testSkyDetection;
+    // The downsampled image and the stages computed from it are reused from an earlier execution on the same state of
+    // the view, if the stage cache still holds them.
+    SuperFlatStageCache& stageCache = TheSuperFlatModule->StageCache();
+    stageCache.SetCapacity(size_type(stageCacheSize) << 20);
+    if (stageCacheSize > 0)
+        execution.cachedStages = &stageCache.Find(SuperFlatStageCache::KeyOf(view, image, downsample));
     ImageVariant downImage;
-    downImage.CopyImage(image);
-    downImage.EnsureUniqueImage();
-    downImage.SetStatusCallback(nullptr);
-    if (downsample > 1) {
-        IntegerResample ir(-downsample);
-        ir >> downImage;
-    }
-
-    // Step 1: Star detection
-    ImageVariant starMask;
-    starMask.CopyImage(downImage);
-    starMask.EnsureUniqueImage();
-    starMask.SetStatusCallback(nullptr);
-    image.Status().Initialize("Performing star detection", 3);
-    MultiscaleLinearTransform mlt(4);
-    mlt << starMask;
-    mlt.DisableLayer(0);
-    mlt.DisableLayer(4);
-    mlt >> starMask;
-    starMask.Truncate(0.0f, 1.0f);
-    starMask.Normalize();
-    image.Status() += 1;
-
-    MorphologicalTransformation mf;
-    mf.SetStructure(BoxStructure(3));
-    mf.SetOperator(MedianFilter());
-    mf >> starMask;
-    starMask.Binarize(pcl::Pow10(-starDetectionSensitivity));
-    image.Status() += 1;
-
-    MorphologicalTransformation df;
-    df.SetStructure(CircularStructure(2 * objectDiffusionDistance + 3));
-    df.SetOperator(DilationFilter());
-    df >> starMask;
-    image.Status() += 1;
-    starMask.Invert();
-
-    // Step 2: Convolution
-    ImageVariant ref;
-    ref.CopyImage(downImage);
-    ref.EnsureUniqueImage();
-    ref.SetStatusCallback(nullptr);
-    image.Status().Initialize("Creating sky mask", objectDiffusionDistance + 3);
-    float sigma = 255.0f;
-    VariableShapeFilter H(sigma, 5.0f, 0.01f, 1.0f, 0.0f);
-    FFTConvolution(H) >> ref;
+    if ((execution.cachedStages != nullptr) && execution.cachedStages->downImage) {
+        downImage = execution.cachedStages->downImage;
+        execution.reusedStages << "downsampling";
+    } else {
+        downImage = downsampleImage(image, buffers, execution, monitor);
+        if (execution.cachedStages != nullptr) {
+            buffers.Disown(downImage);
+            execution.cachedStages->downImage = downImage;
+        }
+    }
+    if (!apply) {
+        image = ImageVariant();
+        lock.Unlock();
+    }
 
-    // Step 3: Create sky mask
-    ImageVariant mask;
-    mask.CopyImage(downImage);
-    mask.EnsureUniqueImage();
-    mask.SetStatusCallback(nullptr);
-    mf >> mask;
-    MorphologicalTransformation sf;
-    sf.SetStructure(CircularStructure(25));
-    sf.SetOperator(SelectionFilter(0.9f));
-    for (int i = 0; i < objectDiffusionDistance; i++) {
-        sf >> mask;
-        image.Status() += 1;
+    // Step 5: Load user-defined non-sky mask
+    ImageVariant nonSkyMask = nonSkyMaskImage(downImage.BitsPerSample());
+    SuperFlatMask nonSky;
+    if (nonSkyMask)
+        nonSky = nonSkyPixels(nonSkyMask, downImage, buffers);
+
+    auto outputWindow = [&](const char* suffix) {
+        IsoString id = view.FullId() + suffix;
+        ImageWindow window(downImage.Width(), downImage.Height(), downImage.NumberOfChannels(), downImage.BitsPerSample(), true, downImage.IsColor(), true, id);
+        if (window.IsNull())
+            throw Error("Unable to create image window: " + id);
+        window.MainView().Lock();
+        return window;
+    };
+    ImageWindow flatWindow;
+    ImageWindow maskWindow;
+    try {
+        ImageVariant flat;
+        if (!apply) {
+            flatWindow = outputWindow("_flat");
+            flat = flatWindow.MainView().Image();
+            flat.SetStatusCallback(nullptr);
+        }
+        ImageVariant mask;
+        if (generateSkyMask) {
+            maskWindow = outputWindow("_skymask");
+            mask = maskWindow.MainView().Image();
+            mask.SetStatusCallback(nullptr);
+        }
+
+        modelImage(downImage, imageWidth, imageHeight, nonSky, flat, mask, buffers, execution, monitor);
+        if (execution.cachedStages != nullptr)
+            stageCache.Update(*execution.cachedStages);
+
+        if (apply) {
+            // Step 9: Divide or subtract the model at full resolution
+            applyModel(image, flat, execution, monitor);
+            monitor.Complete();
+        }
+    } catch (...) {
+        if (!flatWindow.IsNull())
+            flatWindow.ForceClose();
+        if (!maskWindow.IsNull())
+            maskWindow.ForceClose();
+        throw;
     }
-    if (image.BitsPerSample() == 32) {
-        ReferenceArray<GenericImage<FloatPixelTraits>> input;
-        input << &static_cast<Image&>(*ref);
-        for (int c = 0; c < image.NumberOfChannels(); c++)
-            SuperFlatThread<FloatPixelTraits>::dispatch(genSkyMask<FloatPixelTraits>, this, input, static_cast<Image&>(*mask), c);
-    } else if (image.BitsPerSample() == 64) {
-        ReferenceArray<GenericImage<DoublePixelTraits>> input;
-        input << &static_cast<DImage&>(*ref);
-        for (int c = 0; c < image.NumberOfChannels(); c++)
-            SuperFlatThread<DoublePixelTraits>::dispatch(genSkyMask<DoublePixelTraits>, this, input, static_cast<DImage&>(*mask), c);
+
+    if (!flatWindow.IsNull()) {
+        flatWindow.MainView().Unlock();
+        flatWindow.Show();
+    }
+    if (!maskWindow.IsNull()) {
+        maskWindow.MainView().Unlock();
+        maskWindow.Show();
     }
-    image.Status() += 1;
 
-    // Step 4: Remove noise using 3x3 median filter, add star mask
-    mf >> mask;
-    mask.Multiply(starMask);
+    console.WriteLn(String().Format("<end><cbr>Stars: %u", unsigned(execution.starCount)));
+    if (!starCatalogFile.IsEmpty())
+        console.WriteLn("Star catalog: " + starCatalogFile);
+    if (!splineGridFile.IsEmpty() && !testSkyDetection)
+        console.WriteLn("Spline grid model: " + splineGridFile);
+    console.WriteLn(String().Format("Sky pixels: %.1f%%", 100 * execution.skyFraction));
+    console.WriteLn(String().Format("Peak image memory: %.1f MiB", buffers.PeakBytes() / 1048576.0));
+    if (!execution.reusedStages.IsEmpty()) {
+        String reused;
+        for (const String& stage : execution.reusedStages) {
+            if (!reused.IsEmpty())
+                reused += ", ";
+            reused += stage;
+        }
+        console.WriteLn("Reused from an earlier execution: " + reused);
+    }
+    {
+        const size_type hits = kernelCache.Hits() - kernelHits;
+        const size_type lookups = hits + kernelCache.Misses() - kernelMisses;
+        if (lookups > 0)
+            console.WriteLn(String().Format("FFT kernel cache: %u of %u kernel transforms reused (%.0f%%)",
+                unsigned(hits), unsigned(lookups), 100.0 * hits / lookups));
+    }
 
-    image.Status() += 1;
+    if (!execution.workerStats.IsEmpty()) {
+        console.WriteLn("<end><cbr>Worker load balance:");
+        for (size_type i = 0; i < execution.workerStats.Length(); i++) {
+            const SuperFlatWorkerStats& w = execution.workerStats[i];
+            console.WriteLn(String().Format("%3d: busy %8.3f s, idle %8.3f s (%5.1f%%), %8llu items, %6llu steals",
+                int(i), w.busy, w.idle, 100 * w.idle / pcl::Max(w.busy + w.idle, 1.0e-9),
+                (unsigned long long)w.items, (unsigned long long)w.steals));
+        }
+    }
 
-    // Step 5: Add user-defined non-sky mask
+    return true;
+}
+
+bool SuperFlatInstance::CanExecuteGlobal(String& whyNot) const
+{
+    if (targetFrames.IsEmpty()) {
+        whyNot = "No target frames have been specified.";
+        return false;
+    }
+    if (useSplineGrid && (applyMode == SFApplyMode::CreateModel)) {
+        whyNot = "A saved spline grid model can only be divided into or subtracted from the target frames.";
+        return false;
+    }
+    if (!outputDirectory.IsEmpty() && !File::DirectoryExists(outputDirectory)) {
+        whyNot = "The output directory does not exist: " + outputDirectory;
+        return false;
+    }
+    if (!masterFlatFile.IsEmpty() && (useSplineGrid || testSkyDetection)) {
+        whyNot = "A master flat can only be combined from the sky models of the target frames.";
+        return false;
+    }
+
+    return true;
+}
+
+bool SuperFlatInstance::ExecuteGlobal()
+{
+    String whyNot;
+    if (!CanExecuteGlobal(whyNot))
+        throw Error(whyNot);
+
+    TheSuperFlatModule->ThreadPool().SetMaxThreads(maxThreads);
+    SuperFlatBatch batch(*this);
+    return batch.Run();
+}
+
+void* SuperFlatInstance::LockParameter(const MetaParameter* p, size_type tableRow)
+{
+    if (p == TheSFSkyDetectionThresholdParameter)
+        return &skyDetectionThreshold;
+    if (p == TheSFStarDetectionSensitivityParameter)
+        return &starDetectionSensitivity;
+    if (p == TheSFObjectDiffusionDistanceParameter)
+        return &objectDiffusionDistance;
+    if (p == TheSFSmoothnessParameter)
+        return &smoothness;
+    if (p == TheSFDownsampleParameter)
+        return &downsample;
+    if (p == TheSFGenerateSkyMaskParameter)
+        return &generateSkyMask;
+    if (p == TheSFTestSkyDetectionParameter)
+        return &testSkyDetection;
+    if (p == TheSFInpaintingMethodParameter)
+        return &inpaintingMethod;
+    if (p == TheSFExactInpaintingParameter)
+        return &exactInpainting;
+    if (p == TheSFModelingMethodParameter)
+        return &modelingMethod;
+    if (p == TheSFRayCountParameter)
+        return &rayCount;
+    if (p == TheSFSmoothingMethodParameter)
+        return &smoothingMethod;
+    if (p == TheSFApplyModeParameter)
+        return &applyMode;
+    if (p == TheSFUseSplineGridParameter)
+        return &useSplineGrid;
+    if (p == TheSFMaxThreadsParameter)
+        return &maxThreads;
+    if (p == TheSFStageCacheSizeParameter)
+        return &stageCacheSize;
+    if (p == TheSFNonSkyMaskViewIdParameter)
+        return nonSkyMaskViewId.Begin();
+    if (p == TheSFStarCatalogFileParameter)
+        return starCatalogFile.Begin();
+    if (p == TheSFSplineGridFileParameter)
+        return splineGridFile.Begin();
+    if (p == TheSFTargetFramePathParameter)
+        return targetFrames[tableRow].Begin();
+    if (p == TheSFOutputDirectoryParameter)
+        return outputDirectory.Begin();
+    if (p == TheSFOutputPostfixParameter)
+        return outputPostfix.Begin();
+    if (p == TheSFMasterFlatFileParameter)
+        return masterFlatFile.Begin();
+    return nullptr;
+}
+
+bool SuperFlatInstance::AllocateParameter(size_type sizeOrLength, const MetaParameter* p, size_type tableRow)
+{
+    String* value;
+    if (p == TheSFTargetFramesParameter) {
+        targetFrames.Clear();
+        if (sizeOrLength > 0)
+            targetFrames.Add(String(), sizeOrLength);
+        return true;
+    } else if (p == TheSFTargetFramePathParameter)
+        value = &targetFrames[tableRow];
+    else if (p == TheSFNonSkyMaskViewIdParameter)
+        value = &nonSkyMaskViewId;
+    else if (p == TheSFStarCatalogFileParameter)
+        value = &starCatalogFile;
+    else if (p == TheSFSplineGridFileParameter)
+        value = &splineGridFile;
+    else if (p == TheSFOutputDirectoryParameter)
+        value = &outputDirectory;
+    else if (p == TheSFOutputPostfixParameter)
+        value = &outputPostfix;
+    else if (p == TheSFMasterFlatFileParameter)
+        value = &masterFlatFile;
+    else
+        return false;
+
+    value->Clear();
+    if (sizeOrLength > 0)
+        value->SetLength(sizeOrLength);
+    return true;
+}
+
+size_type SuperFlatInstance::ParameterLength(const MetaParameter* p, size_type tableRow) const
+{
+    if (p == TheSFTargetFramesParameter)
+        return targetFrames.Length();
+    if (p == TheSFTargetFramePathParameter)
+        return targetFrames[tableRow].Length();
+    if (p == TheSFNonSkyMaskViewIdParameter)
+        return nonSkyMaskViewId.Length();
+    if (p == TheSFStarCatalogFileParameter)
+        return starCatalogFile.Length();
+    if (p == TheSFSplineGridFileParameter)
+        return splineGridFile.Length();
+    if (p == TheSFOutputDirectoryParameter)
+        return outputDirectory.Length();
+    if (p == TheSFOutputPostfixParameter)
+        return outputPostfix.Length();
+    if (p == TheSFMasterFlatFileParameter)
+        return masterFlatFile.Length();
+    return 0;
+}
+
+ImageVariant SuperFlatInstance::downsampleImage(ImageVariant& image, SuperFlatBuffers& buffers, SuperFlatExecution& execution, StatusMonitor& status) const
+{
+    // Downsample by averaging, reading the pixels of the image directly. Partial blocks at the right and bottom edges
+    // are discarded, as IntegerResample does.
+    const int factor = int(downsample);
+    ImageVariant downImage = buffers.Acquire(image.BitsPerSample(), pcl::Max(1, image.Width() / factor),
+                                             pcl::Max(1, image.Height() / factor), image.NumberOfChannels(), image.ColorSpace());
+    status.Initialize("Downsampling", downImage.Height() * downImage.NumberOfChannels());
+    downImage.Status() = status;
+    decimateImage(image, downImage, factor, execution);
+    status = downImage.Status();
+    downImage.SetStatusCallback(nullptr);
+    return downImage;
+}
+
+ImageVariant SuperFlatInstance::nonSkyMaskImage(int bitsPerSample) const
+{
+    ImageVariant nonSkyMask;
     if (!nonSkyMaskViewId.IsEmpty()) {
         View nonSkyMaskView = View::ViewById(nonSkyMaskViewId);
         if (nonSkyMaskView.IsNull())
             throw Error("No such view (non-sky mask): " + nonSkyMaskViewId);
 
-        ImageVariant nonSkyMask;
-        {
-            AutoViewLock viewLock(nonSkyMaskView);
-            nonSkyMask.CopyImage(nonSkyMaskView.Image());
-            nonSkyMask.EnsureUniqueImage();
-            nonSkyMask.SetStatusCallback(nullptr);
+        nonSkyMask.CreateFloatImage(bitsPerSample);
+        AutoViewLock viewLock(nonSkyMaskView);
+        nonSkyMask.CopyImage(nonSkyMaskView.Image());
+        nonSkyMask.EnsureUniqueImage();
+        nonSkyMask.SetStatusCallback(nullptr);
+    }
+    return nonSkyMask;
+}
+
+SuperFlatMask SuperFlatInstance::nonSkyPixels(ImageVariant& nonSkyMask, const ImageVariant& image, SuperFlatBuffers& buffers) const
+{
+    // The mask is resampled in place to the geometry of image, binarized and released.
+    buffers.Adopt(nonSkyMask);
+    if ((nonSkyMask.Width() != image.Width()) || (nonSkyMask.Height() != image.Height())) {
+        BicubicFilterPixelInterpolation bs(2, 2, CubicBSplineFilter());
+        Resample rs(bs, double(image.Width()) / nonSkyMask.Width(), double(image.Height()) / nonSkyMask.Height());
+        rs >> nonSkyMask;
+        buffers.Resized(nonSkyMask);
+    }
+    if ((nonSkyMask.NumberOfChannels() != image.NumberOfChannels()) && (nonSkyMask.ColorSpace() == ColorSpace::Gray)) {
+        nonSkyMask.SetColorSpace(image.ColorSpace());
+        buffers.Resized(nonSkyMask);
+    }
+
+    if (nonSkyMask.NumberOfChannels() != image.NumberOfChannels())
+        throw Error("Number of channels of non-sky mask mismatch with the image being processed.");
+
+    SuperFlatMask nonSky;
+    nonSky.Binarize(nonSkyMask, 0.5);
+    buffers.Disown(nonSkyMask);
+    nonSkyMask = ImageVariant();
+    return nonSky;
+}
+
+void SuperFlatInstance::modelImage(ImageVariant& downImage, int width, int height, const SuperFlatMask& nonSky,
+                                   ImageVariant& flat, ImageVariant& mask, SuperFlatBuffers& buffers, SuperFlatExecution& execution, StatusMonitor& monitor) const
+{
+    // Stages whose parameters have not changed since an earlier execution on the same image are taken from the stage
+    // cache entry of the execution, if there is one; the others are computed and stored into it.
+    SuperFlatStageCache::Entry* cached = execution.cachedStages;
+
+    // Step 1: Star detection. Layers 1 to 3 of a four layer starlet transform add up to the difference between its
+    // first and its fourth smoothing, so only those two are computed; the band-pass image is then truncated,
+    // normalized, filtered with a 3x3 median and thresholded in a single pass over them.
+    SuperFlatStarCatalog catalog;
+    if ((cached != nullptr) && cached->hasCatalog && (cached->starSensitivity == starDetectionSensitivity)) {
+        catalog = cached->catalog;
+        execution.reusedStages << "star detection";
+    } else {
+        monitor.Initialize("Performing star detection", 3);
+        ImageVariant fine = buffers.Copy(downImage);
+        atrous(fine, 1, execution);
+        ImageVariant coarse = buffers.Copy(fine);
+        for (int step = 2; step <= 8; step *= 2)
+            atrous(coarse, step, execution);
+        monitor += 1;
+
+        SuperFlatMask starPixels;
+        detectStars(fine, coarse, starPixels, execution);
+        monitor += 1;
+
+        catalog.Extract(starPixels, fine, coarse);
+        buffers.Release(fine);
+        buffers.Release(coarse);
+        monitor += 1;
+        if (cached != nullptr) {
+            cached->catalog = catalog;
+            cached->starSensitivity = starDetectionSensitivity;
+            cached->hasCatalog = true;
         }
-        if ((nonSkyMask.Width() != mask.Width()) || (nonSkyMask.Height() != mask.Height())) {
-            BicubicFilterPixelInterpolation bs(2, 2, CubicBSplineFilter());
-            Resample rs(bs, double(mask.Width()) / nonSkyMask.Width(), double(mask.Height()) / nonSkyMask.Height());
-            rs >> nonSkyMask;
+    }
+
+    // The stars are listed as connected components of the detected pixels, and drawn back as disks whose margin grows
+    // with their peak, from half to four times the object diffusion distance, but to no more than
+    // SuperFlatStarCatalog::MaximumMargin pixels.
+    SuperFlatMask stars(downImage.Width(), downImage.Height(), downImage.NumberOfChannels());
+    catalog.Stamp(stars, objectDiffusionDistance + 1.5);
+    if (!execution.starCatalogFile.IsEmpty())
+        catalog.WriteCSV(execution.starCatalogFile, downsample);
+    execution.starCount = catalog.Length();
+
+    // Step 2: Convolution. A reference or a smoothed image computed again makes the cached sky mask stale.
+    monitor.Initialize("Creating sky mask", objectDiffusionDistance + 2);
+    ImageVariant ref;
+    if ((cached != nullptr) && cached->ref && (cached->refMethod == smoothingMethod)) {
+        ref = cached->ref;
+        execution.reusedStages << "sky reference";
+    } else {
+        ref = buffers.Copy(downImage);
+        blur(ref, 255.0f, buffers, execution);
+        if (cached != nullptr) {
+            buffers.Disown(ref);
+            cached->ref = ref;
+            cached->refMethod = smoothingMethod;
+            cached->sky = SuperFlatMask();
         }
-        if ((nonSkyMask.NumberOfChannels() != mask.NumberOfChannels()) && (nonSkyMask.ColorSpace() == ColorSpace::Gray))
-            nonSkyMask.SetColorSpace(mask.ColorSpace());
+    }
 
-        if (nonSkyMask.NumberOfChannels() != mask.NumberOfChannels())
-            throw Error("Number of channels of non-sky mask mismatch with the image being processed.");
+    // Step 3: Create sky mask
+    ImageVariant smoothed;
+    if ((cached != nullptr) && cached->smoothed && (cached->smoothedDistance == objectDiffusionDistance)) {
+        smoothed = cached->smoothed;
+        monitor += objectDiffusionDistance + 1;
+        execution.reusedStages << "selection filters";
+    } else {
+        smoothed = buffers.Copy(downImage);
+        select(smoothed, SuperFlatSelection(3, false, 0.5), 1, buffers, execution, monitor);
+        select(smoothed, SuperFlatSelection(25, true, 0.9), objectDiffusionDistance, buffers, execution, monitor);
+        if (cached != nullptr) {
+            buffers.Disown(smoothed);
+            cached->smoothed = smoothed;
+            cached->smoothedDistance = objectDiffusionDistance;
+            cached->sky = SuperFlatMask();
+        }
+    }
 
-        nonSkyMask.Binarize(0.5);
-        mask.Multiply(nonSkyMask.Invert());
+    // Steps 3-6: Threshold against the reference, remove noise using 3x3 median filter, remove the star mask and the
+    // non-sky mask, extract sky as flat. The masks are combined as packed bits; the sky mask is only written out as an
+    // image for the output window or for the normalized convolution, in the same pass that extracts the sky.
+    SuperFlatMask sky;
+    if ((cached != nullptr) && (cached->sky.Width() > 0) && (cached->skyThreshold == skyDetectionThreshold)) {
+        sky = cached->sky;
+        execution.reusedStages << "sky detection";
+    } else {
+        SuperFlatMask thresholded(downImage.Width(), downImage.Height(), downImage.NumberOfChannels());
+        SuperFlatStageContext stage(this, execution);
+        stage.maskTarget = &thresholded;
+        if (downImage.BitsPerSample() == 32) {
+            ReferenceArray<GenericImage<FloatPixelTraits>> input;
+            input << &static_cast<Image&>(*ref);
+            SuperFlatThread<FloatPixelTraits>::dispatch(detectSky<FloatPixelTraits>, stage, input, static_cast<Image&>(*smoothed), SuperFlatThread<FloatPixelTraits>::AllChannels);
+        } else if (downImage.BitsPerSample() == 64) {
+            ReferenceArray<GenericImage<DoublePixelTraits>> input;
+            input << &static_cast<DImage&>(*ref);
+            SuperFlatThread<DoublePixelTraits>::dispatch(detectSky<DoublePixelTraits>, stage, input, static_cast<DImage&>(*smoothed), SuperFlatThread<DoublePixelTraits>::AllChannels);
+        }
+        sky = thresholded.Median();
+        if (cached != nullptr) {
+            cached->sky = sky;
+            cached->skyThreshold = skyDetectionThreshold;
+        }
+    }
+    // Images held by the cache are not given back to the buffers.
+    if (cached == nullptr) {
+        buffers.Release(ref);
+        buffers.Release(smoothed);
+    }
+    ref = ImageVariant();
+    smoothed = ImageVariant();
+    SuperFlatMask skyMask = sky;
+    sky = SuperFlatMask();
+    skyMask.AndNot(stars);
+    if (nonSky.Width() > 0)
+        skyMask.AndNot(nonSky);
+    execution.skyFraction = double(skyMask.Count()) / (size_type(skyMask.Width()) * skyMask.Height() * skyMask.NumberOfChannels());
+
+    // The model and the sky mask go to the images given by the caller, or else to buffers.
+    if (flat)
+        buffers.Adopt(flat);
+    else
+        flat = buffers.Acquire(downImage);
+    if (mask)
+        buffers.Adopt(mask);
+    else if (generateSkyMask || (!testSkyDetection && (modelingMethod == SFModelingMethod::NormalizedConvolution)))
+        mask = buffers.Acquire(downImage);
+
+    SuperFlatStageContext stage(this, execution);
+    stage.maskSource = &skyMask;
+    if (flat.BitsPerSample() == 32) {
+        ReferenceArray<GenericImage<FloatPixelTraits>> input;
+        input << &static_cast<Image&>(*downImage);
+        if (mask)
+            input << &static_cast<Image&>(*mask);
+        SuperFlatThread<FloatPixelTraits>::dispatch(extractSky<FloatPixelTraits>, stage, input, static_cast<Image&>(*flat), SuperFlatThread<FloatPixelTraits>::AllChannels);
+    } else if (flat.BitsPerSample() == 64) {
+        ReferenceArray<GenericImage<DoublePixelTraits>> input;
+        input << &static_cast<DImage&>(*downImage);
+        if (mask)
+            input << &static_cast<DImage&>(*mask);
+        SuperFlatThread<DoublePixelTraits>::dispatch(extractSky<DoublePixelTraits>, stage, input, static_cast<DImage&>(*flat), SuperFlatThread<DoublePixelTraits>::AllChannels);
     }
+    // A cached downsampled image belongs to the cache.
+    if (cached != nullptr)
+        downImage = ImageVariant();
+    else
+        buffers.Release(downImage);
+    monitor += 1;
+    monitor.Complete();
 
-    // Step 6: Extract sky as flat
-    ImageVariant flat;
-    flat.CopyImage(downImage);
-    flat.EnsureUniqueImage();
+    if (!testSkyDetection && (modelingMethod == SFModelingMethod::NormalizedConvolution)) {
+        // Step 7-8: Normalized convolution of the sky samples
+        if (flat.BitsPerSample() == 32)
+            normalizedConvolution(static_cast<Image&>(*flat), static_cast<Image&>(*mask), buffers, execution, monitor);
+        else if (flat.BitsPerSample() == 64)
+            normalizedConvolution(static_cast<DImage&>(*flat), static_cast<DImage&>(*mask), buffers, execution, monitor);
+        monitor.Complete();
+    } else if (!testSkyDetection) {
+        // Step 7: Inpaint. The inpainted model depends on nothing else than the sky mask and the inpainting parameters,
+        // so that changing the smoothness alone only repeats step 8.
+        if ((cached != nullptr) && cached->inpainted && (cached->inpaintedSky == skyMask)
+            && (cached->inpaintingMethod == inpaintingMethod) && (cached->rayCount == rayCount)
+            && (cached->exactInpainting == exactInpainting)) {
+            flat.CopyImage(cached->inpainted);
+            execution.reusedStages << "inpainting";
+        } else {
+            if (flat.BitsPerSample() == 32)
+                inpaintImage(static_cast<Image&>(*flat), buffers, execution, monitor);
+            else if (flat.BitsPerSample() == 64)
+                inpaintImage(static_cast<DImage&>(*flat), buffers, execution, monitor);
+            monitor.Complete();
+            if (cached != nullptr) {
+                cached->inpainted = ImageVariant();
+                cached->inpainted.CreateFloatImage(flat.BitsPerSample());
+                cached->inpainted.CopyImage(flat);
+                cached->inpaintedSky = skyMask;
+                cached->inpaintingMethod = inpaintingMethod;
+                cached->rayCount = rayCount;
+                cached->exactInpainting = exactInpainting;
+            }
+        }
+
+        // Step 8: Blur
+        blur(flat, pcl::Pow(1.7f, smoothness), buffers, execution);
+    }
+
+    // The sky levels are needed to apply the model, now or later from its spline grid, and to combine it into a master
+    // flat.
+    const bool apply = (applyMode != SFApplyMode::CreateModel) && !testSkyDetection;
+    const bool saveGrid = !execution.splineGridFile.IsEmpty() && !testSkyDetection;
+    const bool combine = (execution.masterFlat != nullptr) && !testSkyDetection;
+    if (apply || saveGrid || combine)
+        skyLevels(flat, skyMask, execution);
+    if (saveGrid) {
+        SuperFlatSplineGrid grid;
+        grid.Fit(flat, execution.skyLevels, width, height, downsample);
+        grid.Write(execution.splineGridFile);
+    }
+    if (combine)
+        execution.masterFlat->Add(execution.masterFlatIndex, flat, skyMask, execution.skyLevels);
+}
+
+void SuperFlatInstance::applyGrid(ImageVariant& image, const SuperFlatSplineGrid& grid, SuperFlatExecution& execution, StatusMonitor& status) const
+{
+    if ((grid.Width() != image.Width()) || (grid.Height() != image.Height()) || (grid.NumberOfChannels() != image.NumberOfChannels()))
+        throw Error("The spline grid model was fitted to an image of a different geometry: " + splineGridFile);
+    execution.skyLevels.Clear();
+    for (int c = 0; c < grid.NumberOfChannels(); c++)
+        execution.skyLevels << grid.SkyLevel(c);
+    ImageVariant model;
+    applyModel(image, model, execution, status, &grid);
+}
+
+template <class P>
+void SuperFlatInstance::inpaintImage(GenericImage<P>& flat, SuperFlatBuffers& buffers, SuperFlatExecution& execution, StatusMonitor& status) const
+{
+    ImageVariant flat0 = buffers.Copy(ImageVariant(&flat));
+
+    if (inpaintingMethod == SFInpaintingMethod::Multigrid) {
+        status.Initialize("Inpainting", flat.NumberOfChannels());
+        for (int c = 0; c < flat.NumberOfChannels(); c++) {
+            solveLaplace(flat, static_cast<GenericImage<P>&>(*flat0), c, execution);
+            status += 1;
+        }
+    } else {
+        switch (rayCount) {
+        case SFRayCount::Rays8:
+            inpaintRays<P, 8>(flat, static_cast<GenericImage<P>&>(*flat0), buffers, execution, status);
+            break;
+        case SFRayCount::Rays16:
+            inpaintRays<P, 16>(flat, static_cast<GenericImage<P>&>(*flat0), buffers, execution, status);
+            break;
+        default:
+        case SFRayCount::Rays32:
+            inpaintRays<P, 32>(flat, static_cast<GenericImage<P>&>(*flat0), buffers, execution, status);
+            break;
+        case SFRayCount::Rays64:
+            inpaintRays<P, 64>(flat, static_cast<GenericImage<P>&>(*flat0), buffers, execution, status);
+            break;
+        }
+    }
+    buffers.Release(flat0);
+}
+
+template <class P, int N>
+void SuperFlatInstance::inpaintRays(GenericImage<P>& flat, GenericImage<P>& flat0, SuperFlatBuffers& buffers, SuperFlatExecution& execution, StatusMonitor& status) const
+{
+    // Only the non-sky pixels are scheduled; the sky pixels of flat are already equal to flat0. All channels are
+    // processed by each dispatch, and the work items of all dispatches are reported to status as a single stage.
+    const int channels = flat.NumberOfChannels();
+    Array<SuperFlatSpan> spans = HoleSpans(flat0, SuperFlatThread<P>::MaxSpanLength);
+    ReferenceArray<GenericImage<P>> input;
+    input << &flat0;
+    const SuperFlatStageContext stage(this, execution);
+
+    if (inpaintingMethod == SFInpaintingMethod::DistanceTransform) {
+        ImageVariant nearestXBuffer = buffers.Acquire(ImageVariant(&flat));
+        ImageVariant nearestYBuffer = buffers.Acquire(ImageVariant(&flat));
+        GenericImage<P>& nearestX = static_cast<GenericImage<P>&>(*nearestXBuffer);
+        GenericImage<P>& nearestY = static_cast<GenericImage<P>&>(*nearestYBuffer);
+        ReferenceArray<GenericImage<P>> columns;
+        columns << &nearestY;
+        input << &nearestX << &nearestY;
+        status.Initialize("Inpainting", size_type(flat.Width() + flat.Height()) * channels + spans.Length());
+        nearestY.Status() = status;
+        SuperFlatThread<P>::dispatch(nearestSkyColumn<P>, stage, input, nearestY, SuperFlatThread<P>::AllChannels, flat.Width());
+        nearestX.Status() = nearestY.Status();
+        SuperFlatThread<P>::dispatch(nearestSkyRow<P>, stage, columns, nearestX, SuperFlatThread<P>::AllChannels);
+        flat.Status() = nearestX.Status();
+        SuperFlatThread<P>::dispatch(exactInpainting ? inpaintTraced<P, N> : inpaintNearest<P, N>, stage, input, flat, spans);
+        nearestX.SetStatusCallback(nullptr);
+        nearestY.SetStatusCallback(nullptr);
+        buffers.Release(nearestXBuffer);
+        buffers.Release(nearestYBuffer);
+    } else {
+        status.Initialize("Inpainting", spans.Length());
+        flat.Status() = status;
+        SuperFlatThread<P>::dispatch(inpaint<P, N>, stage, input, flat, spans);
+    }
+    status = flat.Status();
     flat.SetStatusCallback(nullptr);
-    flat.Multiply(mask);
-    image.Status() += 1;
-    image.Status().Complete();
-
-    if (!testSkyDetection) {
-        // Step 7: Inpaint
-        image.Status().Initialize("Inpainting", image.NumberOfChannels() + 1);
-        ImageVariant flat0;
-        flat0.CopyImage(flat);
-        flat0.EnsureUniqueImage();
-        flat0.SetStatusCallback(nullptr);
-        image.Status() += 1;
+}
+
+template <class P>
+void SuperFlatInstance::solveLaplace(GenericImage<P>& flat, GenericImage<P>& flat0, int channel, SuperFlatExecution& execution) const
+{
+    // Fills the non-sky pixels of one channel with the solution of the Laplace equation, using the sky pixels as
+    // Dirichlet boundary conditions. Level 0 works directly on the channel of flat; every coarser level solves the
+    // error equation of the level above on single-channel images, where a pixel is fixed if any of its children is.
+    const int minSize = 4;
+    const int maxCycles = 30;
+    const double tolerance = 16 * std::numeric_limits<typename P::sample>::epsilon();
+
+    double mean = 0;
+    size_type count = 0;
+    for (const typename P::sample* f = flat0.PixelData(channel), * end = f + flat0.NumberOfPixels(); f < end; f++)
+        if (*f > 0.0) {
+            mean += *f;
+            count++;
+        }
+    if (count == 0) {
+        for (typename P::sample* f = flat.PixelData(channel), * end = f + flat.NumberOfPixels(); f < end; f++)
+            *f = 0.0;
+        return;
+    }
+    mean /= count;
+    for (typename P::sample* f = flat.PixelData(channel), * f0 = flat0.PixelData(channel), * end = f + flat.NumberOfPixels(); f < end; f++, f0++)
+        *f = (*f0 > 0.0) ? *f0 : typename P::sample(mean);
+
+    int levels = 1;
+    for (int w = flat.Width(), h = flat.Height(); (w > minSize) && (h > minSize); w = (w + 1) >> 1, h = (h + 1) >> 1)
+        levels++;
+    Array<GenericImage<P>> U(levels), F(levels), R(levels), K(levels);
+    auto u = [&](int l) -> GenericImage<P>& { return (l > 0) ? U[l] : flat; };
+    auto known = [&](int l) -> GenericImage<P>& { return (l > 0) ? K[l] : flat0; };
+    for (int l = 0, w = flat.Width(), h = flat.Height(); l < levels; l++, w = (w + 1) >> 1, h = (h + 1) >> 1) {
+        R[l].AllocateData(w, h).SetStatusCallback(nullptr);
+        if (l == 0)
+            continue;
+        U[l].AllocateData(w, h).SetStatusCallback(nullptr);
+        F[l].AllocateData(w, h).SetStatusCallback(nullptr);
+        K[l].AllocateData(w, h).SetStatusCallback(nullptr);
+        const GenericImage<P>& k = known(l - 1);
+        const int kch = (l == 1) ? channel : 0;
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++) {
+                bool fixed = false;
+                for (int j = 2 * y; j < pcl::Min(2 * y + 2, k.Height()); j++)
+                    for (int i = 2 * x; i < pcl::Min(2 * x + 2, k.Width()); i++)
+                        if (k(i, j, kch) > 0.0)
+                            fixed = true;
+                K[l](x, y) = fixed ? 1.0 : 0.0;
+            }
+    }
+
+    const SuperFlatStageContext stage(this, execution);
+    auto relax = [&](int l, int sweeps) {
+        ReferenceArray<GenericImage<P>> input;
+        input << &known(l);
+        if (l > 0)
+            input << &F[l];
+        for (int i = 0; i < sweeps; i++) {
+            SuperFlatThread<P>::dispatch(relaxRed<P>, stage, input, u(l), (l > 0) ? 0 : channel);
+            SuperFlatThread<P>::dispatch(relaxBlack<P>, stage, input, u(l), (l > 0) ? 0 : channel);
+        }
+    };
+
+    for (int cycle = 0; cycle < maxCycles; cycle++) {
+        // V-cycle: pre-smoothing and restriction of the residual down to the coarsest level...
+        for (int l = 0; l < levels - 1; l++) {
+            if (l > 0)
+                U[l].Zero();
+            relax(l, 2);
+            ReferenceArray<GenericImage<P>> input;
+            input << &u(l) << &known(l);
+            if (l > 0)
+                input << &F[l];
+            SuperFlatThread<P>::dispatch(residual<P>, stage, input, R[l], (l > 0) ? 0 : channel);
+            if (l == 0) {
+                double norm = 0;
+                for (const typename P::sample* e = R[0].PixelData(), * end = e + R[0].NumberOfPixels(); e < end; e++)
+                    norm = pcl::Max(norm, double(pcl::Abs(*e)));
+                if (norm < tolerance)
+                    return;
+            }
+            ReferenceArray<GenericImage<P>> fine;
+            fine << &R[l];
+            SuperFlatThread<P>::dispatch(restrictResidual<P>, stage, fine, F[l + 1], 0);
+        }
+        U[levels - 1].Zero();
+        relax(levels - 1, 2 * (U[levels - 1].Width() + U[levels - 1].Height()));
+
+        // ...then prolongation of the corrections and post-smoothing back up to level 0.
+        for (int l = levels - 2; l >= 0; l--) {
+            ReferenceArray<GenericImage<P>> input;
+            input << &U[l + 1] << &known(l);
+            SuperFlatThread<P>::dispatch(prolongate<P>, stage, input, u(l), (l > 0) ? 0 : channel);
+            relax(l, 2);
+        }
+    }
+}
+
+template <class P>
+static void RelaxLine(ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& u, int y, int channel, int parity)
+{
+    // Gauss-Seidel update of the pixels of one color of k*u - sum(neighbours) = f, where k is the number of
+    // neighbours inside the image (Neumann boundary conditions).
+    const int width = u.Width();
+    const typename P::sample* pKnown = inputs[0].ScanLine(y, channel);
+    const typename P::sample* pF = (inputs.Length() > 1) ? inputs[1].ScanLine(y) : nullptr;
+    const typename P::sample* pN = (y > 0) ? u.ScanLine(y - 1, channel) : nullptr;
+    const typename P::sample* pS = (y < u.Height() - 1) ? u.ScanLine(y + 1, channel) : nullptr;
+    typename P::sample* pU = u.ScanLine(y, channel);
+    for (int x = (y + parity) & 1; x < width; x += 2) {
+        if (pKnown[x] > 0.0)
+            continue;
+        double s = (pF != nullptr) ? pF[x] : 0.0;
+        int k = 0;
+        if (x > 0)
+            s += pU[x - 1], k++;
+        if (x < width - 1)
+            s += pU[x + 1], k++;
+        if (pN != nullptr)
+            s += pN[x], k++;
+        if (pS != nullptr)
+            s += pS[x], k++;
+        if (k > 0)
+            pU[x] = s / k;
+    }
+}
+
+template <class P>
+void SuperFlatInstance::relaxRed(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& u, int y, int channel)
+{
+    RelaxLine(inputs, u, y, channel, 0);
+}
+
+template <class P>
+void SuperFlatInstance::relaxBlack(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& u, int y, int channel)
+{
+    RelaxLine(inputs, u, y, channel, 1);
+}
+
+template <class P>
+void SuperFlatInstance::residual(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& r, int y, int channel)
+{
+    const GenericImage<P>& u = inputs[0];
+    const int width = u.Width();
+    const typename P::sample* pKnown = inputs[1].ScanLine(y, channel);
+    const typename P::sample* pF = (inputs.Length() > 2) ? inputs[2].ScanLine(y) : nullptr;
+    const typename P::sample* pN = (y > 0) ? u.ScanLine(y - 1, channel) : nullptr;
+    const typename P::sample* pS = (y < u.Height() - 1) ? u.ScanLine(y + 1, channel) : nullptr;
+    const typename P::sample* pU = u.ScanLine(y, channel);
+    typename P::sample* pR = r.ScanLine(y);
+    for (int x = 0; x < width; x++) {
+        if (pKnown[x] > 0.0) {
+            pR[x] = 0.0;
+            continue;
+        }
+        double s = (pF != nullptr) ? pF[x] : 0.0;
+        int k = 0;
+        if (x > 0)
+            s += pU[x - 1], k++;
+        if (x < width - 1)
+            s += pU[x + 1], k++;
+        if (pN != nullptr)
+            s += pN[x], k++;
+        if (pS != nullptr)
+            s += pS[x], k++;
+        pR[x] = s - k * pU[x];
+    }
+}
+
+template <class P>
+void SuperFlatInstance::restrictResidual(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& f, int y, int channel)
+{
+    // The coarse grid has twice the spacing, so the averaged residual is scaled by 2^2.
+    const GenericImage<P>& r = inputs[0];
+    const typename P::sample* pR0 = r.ScanLine(2 * y);
+    const typename P::sample* pR1 = (2 * y + 1 < r.Height()) ? r.ScanLine(2 * y + 1) : nullptr;
+    typename P::sample* pF = f.ScanLine(y);
+    for (int x = 0; x < f.Width(); x++) {
+        double s = 0;
+        int n = 0;
+        for (int i = 2 * x; i < pcl::Min(2 * x + 2, r.Width()); i++) {
+            s += pR0[i], n++;
+            if (pR1 != nullptr)
+                s += pR1[i], n++;
+        }
+        pF[x] = 4.0 * s / n;
+    }
+}
+
+template <class P>
+void SuperFlatInstance::prolongate(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& u, int y, int channel)
+{
+    // Bilinear interpolation of the coarse correction between cell centers.
+    const GenericImage<P>& e = inputs[0];
+    const typename P::sample* pKnown = inputs[1].ScanLine(y, channel);
+    typename P::sample* pU = u.ScanLine(y, channel);
+    const int Y = y >> 1;
+    const int Yn = pcl::Range((y & 1) ? Y + 1 : Y - 1, 0, e.Height() - 1);
+    const typename P::sample* pE = e.ScanLine(Y);
+    const typename P::sample* pEn = e.ScanLine(Yn);
+    for (int x = 0; x < u.Width(); x++) {
+        if (pKnown[x] > 0.0)
+            continue;
+        const int X = x >> 1;
+        const int Xn = pcl::Range((x & 1) ? X + 1 : X - 1, 0, e.Width() - 1);
+        pU[x] += (9.0 * pE[X] + 3.0 * (pE[Xn] + pEn[X]) + pEn[Xn]) / 16.0;
+    }
+}
+
+void SuperFlatInstance::decimateImage(ImageVariant& source, ImageVariant& target, int factor, SuperFlatExecution& execution) const
+{
+    SuperFlatStageContext stage(this, execution);
+    stage.decimation = factor;
+    if (source.BitsPerSample() == 32) {
+        ReferenceArray<GenericImage<FloatPixelTraits>> input;
+        input << &static_cast<Image&>(*source);
+        SuperFlatThread<FloatPixelTraits>::dispatch(decimate<FloatPixelTraits>, stage, input, static_cast<Image&>(*target), SuperFlatThread<FloatPixelTraits>::AllChannels);
+    } else if (source.BitsPerSample() == 64) {
+        ReferenceArray<GenericImage<DoublePixelTraits>> input;
+        input << &static_cast<DImage&>(*source);
+        SuperFlatThread<DoublePixelTraits>::dispatch(decimate<DoublePixelTraits>, stage, input, static_cast<DImage&>(*target), SuperFlatThread<DoublePixelTraits>::AllChannels);
+    }
+}
+
+void SuperFlatInstance::blur(ImageVariant& image, float sigma, SuperFlatBuffers& buffers, SuperFlatExecution& execution) const
+{
+    if ((smoothingMethod == SFSmoothingMethod::Multiresolution) && (sigma >= 2 * MultiresolutionSigma))
+        smooth(image, image, sigma, buffers, execution);
+    else
+        convolve(image, sigma, execution);
+}
+
+void SuperFlatInstance::smooth(ImageVariant& source, ImageVariant& target, float sigma, SuperFlatBuffers& buffers, SuperFlatExecution& execution) const
+{
+    // Multiresolution approximation of convolve(), with a result of any size. The source is averaged down by the power
+    // of two that leaves at least MultiresolutionSigma pixels of sigma, blurred there, and expanded to the geometry of
+    // target with a cubic B-spline. The box average and the B-spline add a blur of about half the factor in pixels,
+    // which is negligible against sigma.
+    int factor = 1;
+    while (sigma / (2 * factor) >= MultiresolutionSigma)
+        factor *= 2;
+    ImageVariant coarse = buffers.Acquire(source.BitsPerSample(), (source.Width() + factor - 1) / factor,
+                                          (source.Height() + factor - 1) / factor, source.NumberOfChannels(), source.ColorSpace());
+    decimateImage(source, coarse, factor, execution);
+    convolve(coarse, sigma / factor, execution);
+
+    SuperFlatStageContext stage(this, execution);
+    stage.expansion[0] = double(source.Width()) / factor / target.Width();
+    stage.expansion[1] = double(source.Height()) / factor / target.Height();
+    if (target.BitsPerSample() == 32) {
+        ReferenceArray<GenericImage<FloatPixelTraits>> input;
+        input << &static_cast<Image&>(*coarse);
+        SuperFlatThread<FloatPixelTraits>::dispatch(expand<FloatPixelTraits>, stage, input, static_cast<Image&>(*target), SuperFlatThread<FloatPixelTraits>::AllChannels);
+    } else if (target.BitsPerSample() == 64) {
+        ReferenceArray<GenericImage<DoublePixelTraits>> input;
+        input << &static_cast<DImage&>(*coarse);
+        SuperFlatThread<DoublePixelTraits>::dispatch(expand<DoublePixelTraits>, stage, input, static_cast<DImage&>(*target), SuperFlatThread<DoublePixelTraits>::AllChannels);
+    }
+    buffers.Release(coarse);
+}
+
+void SuperFlatInstance::convolve(ImageVariant& image, float sigma, SuperFlatExecution& execution) const
+{
+    // Convolution with VariableShapeFilter(sigma, 5, 0.01, 1, 0). Large kernels are applied as separable running sums,
+    // whose cost does not grow with sigma and which need no padded transforms of the image.
+    if (!SuperFlatShapeBlur::IsApplicable(sigma)) {
+        TheSuperFlatModule->KernelCache().Convolve(image, sigma, 5.0f);
+        return;
+    }
+
+    SuperFlatShapeBlur filter(sigma);
+    SuperFlatStageContext stage(this, execution);
+    stage.shapeBlur = &filter;
+    const int blocks = (image.Width() + BlurBlockWidth - 1) / BlurBlockWidth;
+    if (image.BitsPerSample() == 32) {
+        ReferenceArray<GenericImage<FloatPixelTraits>> input;
+        SuperFlatThread<FloatPixelTraits>::dispatch(blurRows<FloatPixelTraits>, stage, input, static_cast<Image&>(*image), SuperFlatThread<FloatPixelTraits>::AllChannels);
+        SuperFlatThread<FloatPixelTraits>::dispatch(blurColumns<FloatPixelTraits>, stage, input, static_cast<Image&>(*image), SuperFlatThread<FloatPixelTraits>::AllChannels, blocks);
+    } else if (image.BitsPerSample() == 64) {
+        ReferenceArray<GenericImage<DoublePixelTraits>> input;
+        SuperFlatThread<DoublePixelTraits>::dispatch(blurRows<DoublePixelTraits>, stage, input, static_cast<DImage&>(*image), SuperFlatThread<DoublePixelTraits>::AllChannels);
+        SuperFlatThread<DoublePixelTraits>::dispatch(blurColumns<DoublePixelTraits>, stage, input, static_cast<DImage&>(*image), SuperFlatThread<DoublePixelTraits>::AllChannels, blocks);
+    }
+}
+
+void SuperFlatInstance::atrous(ImageVariant& image, int step, SuperFlatExecution& execution) const
+{
+    // In place, rows first, then blocks of BlurBlockWidth columns as in convolve().
+    SuperFlatStageContext stage(this, execution);
+    stage.atrousStep = step;
+    const int blocks = (image.Width() + BlurBlockWidth - 1) / BlurBlockWidth;
+    if (image.BitsPerSample() == 32) {
+        ReferenceArray<GenericImage<FloatPixelTraits>> input;
+        SuperFlatThread<FloatPixelTraits>::dispatch(atrousRows<FloatPixelTraits>, stage, input, static_cast<Image&>(*image), SuperFlatThread<FloatPixelTraits>::AllChannels);
+        SuperFlatThread<FloatPixelTraits>::dispatch(atrousColumns<FloatPixelTraits>, stage, input, static_cast<Image&>(*image), SuperFlatThread<FloatPixelTraits>::AllChannels, blocks);
+    } else if (image.BitsPerSample() == 64) {
+        ReferenceArray<GenericImage<DoublePixelTraits>> input;
+        SuperFlatThread<DoublePixelTraits>::dispatch(atrousRows<DoublePixelTraits>, stage, input, static_cast<DImage&>(*image), SuperFlatThread<DoublePixelTraits>::AllChannels);
+        SuperFlatThread<DoublePixelTraits>::dispatch(atrousColumns<DoublePixelTraits>, stage, input, static_cast<DImage&>(*image), SuperFlatThread<DoublePixelTraits>::AllChannels, blocks);
+    }
+}
+
+void SuperFlatInstance::detectStars(ImageVariant& fine, ImageVariant& coarse, SuperFlatMask& stars, SuperFlatExecution& execution) const
+{
+    // The band-pass image fine - coarse is never stored. A first pass finds its extremes; truncation to [0, 1] and
+    // normalization are increasing maps, which commute with the median, so the second pass takes the median of the
+    // band-pass samples and compares it with the level that normalization would have brought to the threshold.
+    const int rows = coarse.Height() * coarse.NumberOfChannels();
+    Array<double> bandMinimum(rows, 0.0);
+    Array<double> bandMaximum(rows, 0.0);
+    SuperFlatStageContext stage(this, execution);
+    stage.bandMinimum = bandMinimum.Begin();
+    stage.bandMaximum = bandMaximum.Begin();
+    if (coarse.BitsPerSample() == 32) {
+        ReferenceArray<GenericImage<FloatPixelTraits>> input;
+        input << &static_cast<Image&>(*fine);
+        SuperFlatThread<FloatPixelTraits>::dispatch(bandRange<FloatPixelTraits>, stage, input, static_cast<Image&>(*coarse), SuperFlatThread<FloatPixelTraits>::AllChannels);
+    } else if (coarse.BitsPerSample() == 64) {
+        ReferenceArray<GenericImage<DoublePixelTraits>> input;
+        input << &static_cast<DImage&>(*fine);
+        SuperFlatThread<DoublePixelTraits>::dispatch(bandRange<DoublePixelTraits>, stage, input, static_cast<DImage&>(*coarse), SuperFlatThread<DoublePixelTraits>::AllChannels);
+    }
+    double low = std::numeric_limits<double>::max();
+    double high = -std::numeric_limits<double>::max();
+    for (int i = 0; i < rows; i++) {
+        low = pcl::Min(low, bandMinimum[i]);
+        high = pcl::Max(high, bandMaximum[i]);
+    }
+    low = pcl::Range(low, 0.0, 1.0);
+    high = pcl::Range(high, 0.0, 1.0);
+    const double threshold = pcl::Pow10(-starDetectionSensitivity);
+    stage.starThreshold = (high > low) ? low + threshold * (high - low) : threshold;
+
+    stars = SuperFlatMask(coarse.Width(), coarse.Height(), coarse.NumberOfChannels());
+    stage.maskTarget = &stars;
+    if (coarse.BitsPerSample() == 32) {
+        ReferenceArray<GenericImage<FloatPixelTraits>> input;
+        input << &static_cast<Image&>(*fine);
+        SuperFlatThread<FloatPixelTraits>::dispatch(starBits<FloatPixelTraits>, stage, input, static_cast<Image&>(*coarse), SuperFlatThread<FloatPixelTraits>::AllChannels);
+    } else if (coarse.BitsPerSample() == 64) {
+        ReferenceArray<GenericImage<DoublePixelTraits>> input;
+        input << &static_cast<DImage&>(*fine);
+        SuperFlatThread<DoublePixelTraits>::dispatch(starBits<DoublePixelTraits>, stage, input, static_cast<DImage&>(*coarse), SuperFlatThread<DoublePixelTraits>::AllChannels);
+    }
+}
+
+void SuperFlatInstance::skyLevels(ImageVariant& model, const SuperFlatMask& sky, SuperFlatExecution& execution) const
+{
+    // The sky level of each channel is the median of the model over the sky pixels, or over the whole model if there
+    // are none, found by selection in a buffer shared by all channels.
+    execution.skyLevels.Clear();
+    Array<double> values(size_type(model.Width()) * model.Height());
+    for (int c = 0; c < model.NumberOfChannels(); c++)
+        if (model.BitsPerSample() == 32)
+            execution.skyLevels << SkyMedian(static_cast<const Image&>(*model), sky, c, values);
+        else if (model.BitsPerSample() == 64)
+            execution.skyLevels << SkyMedian(static_cast<const DImage&>(*model), sky, c, values);
+}
+
+void SuperFlatInstance::applyModel(ImageVariant& image, ImageVariant& model, SuperFlatExecution& execution, StatusMonitor& status,
+                                   const SuperFlatSplineGrid* grid) const
+{
+    // The image is corrected a row at a time to the sky levels of the execution. Each row of the model is evaluated
+    // from grid if there is one, or else expanded from the rows of model it needs, so the model never exists at full
+    // resolution.
+    SuperFlatStageContext stage(this, execution);
+    stage.expansion[0] = stage.expansion[1] = 1.0 / downsample;
+    stage.skyLevels = execution.skyLevels.Begin();
+    stage.splineGrid = grid;
+    status.Initialize("Applying the model", image.Height() * image.NumberOfChannels());
+    image.Status() = status;
+    if (image.BitsPerSample() == 32) {
+        ReferenceArray<GenericImage<FloatPixelTraits>> input;
+        if (model)
+            input << &static_cast<Image&>(*model);
+        SuperFlatThread<FloatPixelTraits>::dispatch(correct<FloatPixelTraits>, stage, input, static_cast<Image&>(*image), SuperFlatThread<FloatPixelTraits>::AllChannels);
+    } else if (image.BitsPerSample() == 64) {
+        ReferenceArray<GenericImage<DoublePixelTraits>> input;
+        if (model)
+            input << &static_cast<DImage&>(*model);
+        SuperFlatThread<DoublePixelTraits>::dispatch(correct<DoublePixelTraits>, stage, input, static_cast<DImage&>(*image), SuperFlatThread<DoublePixelTraits>::AllChannels);
+    }
+    status = image.Status();
+    image.SetStatusCallback(nullptr);
+}
+
+void SuperFlatInstance::select(ImageVariant& image, const SuperFlatSelection& filter, int passes, SuperFlatBuffers& buffers, SuperFlatExecution& execution, StatusMonitor& status) const
+{
+    // Every pass reads one image and writes another, so the result ends up in either the original image or a buffer
+    // of the same geometry; image must have been acquired from buffers. The quantization levels span the range of the
+    // samples, which no pass can widen, so the levels of one pass are reproduced exactly by the next one. The 3x3
+    // median has a kernel of its own, which is exact and needs no quantization.
+    if (passes <= 0)
+        return;
+
+    const bool median3x3 = filter.IsMedian3x3();
+    SuperFlatStageContext stage(this, execution);
+    stage.selection = &filter;
+    for (int c = 0; !median3x3 && (c < image.NumberOfChannels()); c++) {
+        const double low = image.MinimumSampleValue(Rect(0), c, c);
+        const double high = image.MaximumSampleValue(Rect(0), c, c);
+        stage.selectionLow << low;
+        stage.selectionStep << ((high > low) ? (high - low) / (SuperFlatSelection::Levels - 1) : 1.0);
+    }
+
+    const int items = median3x3 ? image.Height() : (image.Height() + SelectionBandHeight - 1) / SelectionBandHeight;
+    ImageVariant source = image;
+    ImageVariant target = buffers.Acquire(image);
+    for (int i = 0; i < passes; i++) {
         if (image.BitsPerSample() == 32) {
             ReferenceArray<GenericImage<FloatPixelTraits>> input;
-            input << &static_cast<Image&>(*flat0);
-            for (int c = 0; c < image.NumberOfChannels(); c++) {
-                SuperFlatThread<FloatPixelTraits>::dispatch(inpaint<FloatPixelTraits>, this, input, static_cast<Image&>(*flat), c);
-                image.Status() += 1;
-            }
+            input << &static_cast<Image&>(*source);
+            SuperFlatThread<FloatPixelTraits>::dispatch(median3x3 ? median3<FloatPixelTraits> : selectBand<FloatPixelTraits>, stage, input, static_cast<Image&>(*target), SuperFlatThread<FloatPixelTraits>::AllChannels, items);
         } else if (image.BitsPerSample() == 64) {
             ReferenceArray<GenericImage<DoublePixelTraits>> input;
-            input << &static_cast<DImage&>(*flat0);
-            for (int c = 0; c < image.NumberOfChannels(); c++) {
-                SuperFlatThread<DoublePixelTraits>::dispatch(inpaint<DoublePixelTraits>, this, input, static_cast<DImage&>(*flat), c);
-                image.Status() += 1;
+            input << &static_cast<DImage&>(*source);
+            SuperFlatThread<DoublePixelTraits>::dispatch(median3x3 ? median3<DoublePixelTraits> : selectBand<DoublePixelTraits>, stage, input, static_cast<DImage&>(*target), SuperFlatThread<DoublePixelTraits>::AllChannels, items);
+        }
+        pcl::Swap(source, target);
+        status += 1;
+    }
+    buffers.Release(target);
+    image = source;
+}
+
+template <class P>
+void SuperFlatInstance::selectBand(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, int band, int channel)
+{
+    // The rows of the band, and the rows and columns around them that the window reaches, are quantized once with
+    // their edges extended. The window then runs down the band in a serpentine, so every move, sideways or down,
+    // exchanges a single row or column of the window.
+    const SuperFlatSelection& filter = *stage.selection;
+    const GenericImage<P>& source = inputs[0];
+    const int width = output.Width();
+    const int height = output.Height();
+    const int r = filter.Radius();
+    const int y0 = band * SelectionBandHeight;
+    const int y1 = pcl::Min(height, y0 + SelectionBandHeight);
+    const int stride = width + 2 * r;
+    const double low = stage.selectionLow[channel];
+    const double step = stage.selectionStep[channel];
+
+    Array<uint16> levels(size_type(y1 - y0 + 2 * r) * stride);
+    for (int i = 0; i < y1 - y0 + 2 * r; i++) {
+        const typename P::sample* p = source.ScanLine(pcl::Range(y0 - r + i, 0, height - 1), channel);
+        uint16* q = levels.At(size_type(i) * stride);
+        for (int j = 0; j < stride; j++)
+            q[j] = uint16(pcl::RoundInt((p[pcl::Range(j - r, 0, width - 1)] - low) / step));
+    }
+    auto level = [&levels, stride, r, y0](int x, int y) { return int(levels[size_type(y - y0 + r) * stride + x + r]); };
+
+    SuperFlatSelectionHistogram histogram(filter.Rank());
+    for (int dy = -r; dy <= r; dy++)
+        for (int dx = -filter.HalfWidth(dy); dx <= filter.HalfWidth(dy); dx++)
+            histogram.Add(level(dx, y0 + dy));
+
+    for (int y = y0;;) {
+        typename P::sample* p = output.ScanLine(y, channel);
+        const int direction = ((y - y0) & 1) ? -1 : 1;
+        int x = (direction > 0) ? 0 : width - 1;
+        for (int n = 0;; n++, x += direction) {
+            p[x] = typename P::sample(low + step * histogram.Select());
+            if (n == width - 1)
+                break;
+            for (int dy = -r; dy <= r; dy++) {
+                const int w = filter.HalfWidth(dy);
+                histogram.Remove(level(x - direction * w, y + dy));
+                histogram.Add(level(x + direction * (w + 1), y + dy));
             }
         }
-        image.Status().Complete();
+        if (++y == y1)
+            break;
+        for (int dx = -r; dx <= r; dx++) {
+            const int h = filter.HalfWidth(dx);
+            histogram.Remove(level(x + dx, y - 1 - h));
+            histogram.Add(level(x + dx, y + h));
+        }
+    }
+}
+
+template <class P>
+void SuperFlatInstance::median3(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, int y, int channel)
+{
+    // The three samples of every column are sorted once, and each sorted column serves the three pixels around it.
+    // The median of the block is then the median of the largest of the minima, the median of the medians and the
+    // smallest of the maxima of its columns. Rows and columns are extended with their edge samples.
+    const GenericImage<P>& source = inputs[0];
+    const int width = output.Width();
+    const int height = output.Height();
+    Array<typename P::sample> columns(3 * size_type(width + 2));
+    typename P::sample* lo = columns.Begin();
+    typename P::sample* mid = lo + width + 2;
+    typename P::sample* hi = mid + width + 2;
+    SortColumns(source.ScanLine(pcl::Max(y - 1, 0), channel), source.ScanLine(y, channel), source.ScanLine(pcl::Min(y + 1, height - 1), channel),
+                lo + 1, mid + 1, hi + 1, width);
+    for (typename P::sample* v : { lo, mid, hi }) {
+        v[0] = v[1];
+        v[width + 1] = v[width];
+    }
+    MedianOfColumns(lo, mid, hi, output.ScanLine(y, channel), width);
+}
+
+template <class P>
+void SuperFlatInstance::blurRows(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& image, int y, int channel)
+{
+    const SuperFlatShapeBlur& filter = *stage.shapeBlur;
+    const int width = image.Width();
+    Array<double> row(width);
+    Array<double> work(filter.WorkLength(width));
+    typename P::sample* p = image.ScanLine(y, channel);
+    for (int x = 0; x < width; x++)
+        row[x] = p[x];
+    filter.Apply(row.Begin(), width, 1, work.Begin());
+    for (int x = 0; x < width; x++)
+        p[x] = typename P::sample(row[x]);
+}
+
+template <class P>
+void SuperFlatInstance::blurColumns(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& image, int block, int channel)
+{
+    // BlurBlockWidth adjacent columns are filtered together, so the inner loops run along the rows of the block.
+    const SuperFlatShapeBlur& filter = *stage.shapeBlur;
+    const int x0 = block * BlurBlockWidth;
+    const int lanes = pcl::Min(BlurBlockWidth, image.Width() - x0);
+    const int height = image.Height();
+    Array<double> columns(size_type(height) * lanes);
+    Array<double> work(filter.WorkLength(height) * lanes);
+    for (int y = 0; y < height; y++) {
+        const typename P::sample* p = image.ScanLine(y, channel) + x0;
+        double* c = columns.At(size_type(y) * lanes);
+        for (int j = 0; j < lanes; j++)
+            c[j] = p[j];
+    }
+    filter.Apply(columns.Begin(), height, lanes, work.Begin());
+    for (int y = 0; y < height; y++) {
+        typename P::sample* p = image.ScanLine(y, channel) + x0;
+        const double* c = columns.At(size_type(y) * lanes);
+        for (int j = 0; j < lanes; j++)
+            p[j] = typename P::sample(c[j]);
+    }
+}
+
+template <class P>
+void SuperFlatInstance::atrousRows(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& image, int y, int channel)
+{
+    const int width = image.Width();
+    Array<double> row(width);
+    Array<double> result(width);
+    typename P::sample* p = image.ScanLine(y, channel);
+    for (int x = 0; x < width; x++)
+        row[x] = p[x];
+    ATrousB3(row.Begin(), result.Begin(), width, 1, stage.atrousStep);
+    for (int x = 0; x < width; x++)
+        p[x] = typename P::sample(result[x]);
+}
+
+template <class P>
+void SuperFlatInstance::atrousColumns(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& image, int block, int channel)
+{
+    const int x0 = block * BlurBlockWidth;
+    const int lanes = pcl::Min(BlurBlockWidth, image.Width() - x0);
+    const int height = image.Height();
+    Array<double> columns(size_type(height) * lanes);
+    Array<double> result(size_type(height) * lanes);
+    for (int y = 0; y < height; y++) {
+        const typename P::sample* p = image.ScanLine(y, channel) + x0;
+        double* c = columns.At(size_type(y) * lanes);
+        for (int j = 0; j < lanes; j++)
+            c[j] = p[j];
+    }
+    ATrousB3(columns.Begin(), result.Begin(), height, lanes, stage.atrousStep);
+    for (int y = 0; y < height; y++) {
+        typename P::sample* p = image.ScanLine(y, channel) + x0;
+        const double* c = result.At(size_type(y) * lanes);
+        for (int j = 0; j < lanes; j++)
+            p[j] = typename P::sample(c[j]);
+    }
+}
+
+template <class P>
+void SuperFlatInstance::bandRange(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& coarse, int y, int channel)
+{
+    const typename P::sample* f = inputs[0].ScanLine(y, channel);
+    const typename P::sample* c = coarse.ScanLine(y, channel);
+    typename P::sample low = f[0] - c[0];
+    typename P::sample high = low;
+    for (int x = 1; x < coarse.Width(); x++) {
+        const typename P::sample d = f[x] - c[x];
+        low = pcl::Min(low, d);
+        high = pcl::Max(high, d);
+    }
+    const int i = channel * coarse.Height() + y;
+    stage.bandMinimum[i] = low;
+    stage.bandMaximum[i] = high;
+}
+
+template <class P>
+void SuperFlatInstance::starBits(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& coarse, int y, int channel)
+{
+    // Row y of the star mask: the 3x3 median of the band-pass image, as in median3(), truncated and compared with
+    // starThreshold.
+    const GenericImage<P>& fine = inputs[0];
+    const int width = coarse.Width();
+    const int height = coarse.Height();
+    Array<typename P::sample> band(3 * size_type(width));
+    for (int i = 0; i < 3; i++) {
+        const int row = pcl::Range(y - 1 + i, 0, height - 1);
+        const typename P::sample* f = fine.ScanLine(row, channel);
+        const typename P::sample* c = coarse.ScanLine(row, channel);
+        typename P::sample* b = band.At(size_type(i) * width);
+        for (int x = 0; x < width; x++)
+            b[x] = f[x] - c[x];
+    }
+    Array<typename P::sample> columns(4 * size_type(width + 2));
+    typename P::sample* lo = columns.Begin();
+    typename P::sample* mid = lo + width + 2;
+    typename P::sample* hi = mid + width + 2;
+    typename P::sample* median = hi + width + 2;
+    SortColumns(band.At(0), band.At(width), band.At(2 * size_type(width)), lo + 1, mid + 1, hi + 1, width);
+    for (typename P::sample* v : { lo, mid, hi }) {
+        v[0] = v[1];
+        v[width + 1] = v[width];
+    }
+    MedianOfColumns(lo, mid, hi, median, width);
+
+    const double threshold = stage.starThreshold;
+    uint64* bits = stage.maskTarget->Row(y, channel);
+    for (int x = 0; x < width; x++)
+        if (pcl::Range(double(median[x]), 0.0, 1.0) >= threshold)
+            bits[x >> 6] |= uint64(1) << (x & 63);
+}
+
+template <class P>
+void SuperFlatInstance::normalizedConvolution(GenericImage<P>& flat, GenericImage<P>& mask, SuperFlatBuffers& buffers, SuperFlatExecution& execution, StatusMonitor& status) const
+{
+    // The masked sky and the mask are blurred with the same kernel and divided. Pixels too far from any sky sample
+    // for the kernel to reach are resolved again with a kernel four times wider, until the whole image is covered.
+    // Both go through blur(), so they get the same smoothing method, and the same running sums, as inpainting. The
+    // monitor counts the convolutions of every pass that may be needed, and advances after each of them.
+    ImageVariant sky = buffers.Copy(ImageVariant(&flat));
+    flat.Fill(-1.0);
+
+    const float minSigma = pcl::Pow(1.7f, smoothness);
+    const float maxSigma = pcl::Max(flat.Width(), flat.Height());
+    int passes = 1;
+    for (float sigma = minSigma; sigma < maxSigma; sigma *= 4.0f)
+        passes++;
+    status.Initialize("Normalized convolution", 2 * passes);
+
+    const SuperFlatStageContext stage(this, execution);
+    for (float sigma = minSigma;; sigma *= 4.0f) {
+        ImageVariant numerator = buffers.Copy(sky);
+        blur(numerator, sigma, buffers, execution);
+        status += 1;
+        ImageVariant denominator = buffers.Copy(ImageVariant(&mask));
+        blur(denominator, sigma, buffers, execution);
+        status += 1;
+
+        ReferenceArray<GenericImage<P>> input;
+        input << &static_cast<GenericImage<P>&>(*numerator) << &static_cast<GenericImage<P>&>(*denominator);
+        bool resolved = true;
+        SuperFlatThread<P>::dispatch(normalizeWeights<P>, stage, input, flat, SuperFlatThread<P>::AllChannels);
+        for (int c = 0; c < flat.NumberOfChannels(); c++) {
+            for (const typename P::sample* f = flat.PixelData(c), * end = f + flat.NumberOfPixels(); f < end; f++)
+                if (*f < 0.0) {
+                    resolved = false;
+                    break;
+                }
+        }
+        buffers.Release(numerator);
+        buffers.Release(denominator);
+        if (resolved || (sigma >= maxSigma))
+            break;
+    }
+    buffers.Release(sky);
 
-        // Step 8: Blur
-        VariableShapeFilter H2(pcl::Pow(1.7f, smoothness), 5.0f, 0.01f, 1.0f, 0.0f);
-        FFTConvolution(H2) >> flat;
-    }
-
-    IsoString id = view.FullId() + "_flat";
-    ImageWindow OutputWindow = ImageWindow(flat.Width(), flat.Height(), flat.NumberOfChannels(), flat.BitsPerSample(), true, flat.IsColor(), true, id);
-    if (OutputWindow.IsNull())
-        throw Error("Unable to create image window: " + id);
-    OutputWindow.MainView().Lock();
-    OutputWindow.MainView().Image().CopyImage(flat);
-    OutputWindow.MainView().Unlock();
-    OutputWindow.Show();
-
-    if (generateSkyMask) {
-        IsoString id = view.FullId() + "_skymask";
-        ImageWindow OutputWindow = ImageWindow(mask.Width(), mask.Height(), mask.NumberOfChannels(), mask.BitsPerSample(), true, mask.IsColor(), true, id);
-        if (OutputWindow.IsNull())
-            throw Error("Unable to create image window: " + id);
-        OutputWindow.MainView().Lock();
-        OutputWindow.MainView().Image().CopyImage(mask);
-        OutputWindow.MainView().Unlock();
-        OutputWindow.Show();
+    for (int c = 0; c < flat.NumberOfChannels(); c++) {
+        for (typename P::sample* f = flat.PixelData(c), * end = f + flat.NumberOfPixels(); f < end; f++)
+            if (*f < 0.0)
+                *f = 0.0;
     }
+}
 
-    return true;
+template <class P>
+void SuperFlatInstance::normalizeWeights(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, int y, int channel)
+{
+    const typename P::sample* pNum = inputs[0].ScanLine(y, channel);
+    const typename P::sample* pDen = inputs[1].ScanLine(y, channel);
+    typename P::sample* pOut = output.ScanLine(y, channel);
+    for (int x = 0; x < output.Width(); x++)
+        if ((pOut[x] < 0.0) && (pDen[x] > 0.001))
+            pOut[x] = pNum[x] / pDen[x];
 }
 
-void* SuperFlatInstance::LockParameter(const MetaParameter* p, size_type /*tableRow*/)
+template <class P>
+void SuperFlatInstance::decimate(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, int y, int channel)
 {
-    return 0;
+    // Average of the n x n source pixels of each pixel of one output row. The n source rows are read sequentially
+    // and accumulated, so only one output row worth of sums is live per thread. Blocks at the right and bottom edges
+    // are averaged over the source pixels they actually cover.
+    const GenericImage<P>& source = inputs[0];
+    const int n = stage.decimation;
+    const int rows = pcl::Min(n, source.Height() - y * n);
+    const int width = output.Width();
+    Array<double> sum(width, 0.0);
+    for (int i = 0; i < rows; i++) {
+        const typename P::sample* pSource = source.ScanLine(y * n + i, channel);
+        for (int x = 0; x < width; x++) {
+            const int columns = pcl::Min(n, source.Width() - x * n);
+            double s = 0;
+            for (int j = 0; j < columns; j++)
+                s += pSource[x * n + j];
+            sum[x] += s;
+        }
+    }
+    typename P::sample* pOut = output.ScanLine(y, channel);
+    for (int x = 0; x < width; x++)
+        pOut[x] = typename P::sample(sum[x] / (rows * pcl::Min(n, source.Width() - x * n)));
 }
 
 template <class P>
-void SuperFlatInstance::genSkyMask(SuperFlatInstance* superFlat, ReferenceArray<GenericImage<P>>& ref, GenericImage<P>& maskImage, int y, int channel)
+void SuperFlatInstance::expand(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, int y, int channel)
 {
-    const typename P::sample* pRef = ref[0].ScanLine(y, channel);
-    typename P::sample* pMask = maskImage.ScanLine(y, channel);
-    for (int x = 0; x < maskImage.Width(); x++)
-        if (pMask[x] > pRef[x] + superFlat->skyDetectionThreshold)
-            pMask[x] = 0.0;
-        else
-            pMask[x] = 1.0;
+    Array<double> row(output.Width());
+    ExpandRow(inputs[0], channel, stage.expansion, y, row.Begin(), output.Width());
+    typename P::sample* pOut = output.ScanLine(y, channel);
+    for (int x = 0; x < output.Width(); x++)
+        pOut[x] = typename P::sample(row[x]);
 }
 
 template <class P>
-void SuperFlatInstance::diffuse(SuperFlatInstance* superFlat, ReferenceArray<GenericImage<P>>& pyramid, GenericImage<P>& maskImage, int y, int channel)
+void SuperFlatInstance::correct(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& image, int y, int channel)
+{
+    // One row of the model at the resolution of the image, divided into it or subtracted from it and brought back to
+    // the sky level of the model.
+    const int width = image.Width();
+    Array<double> model(width);
+    if (stage.splineGrid != nullptr)
+        stage.splineGrid->EvaluateRow(y, channel, model.Begin());
+    else
+        ExpandRow(inputs[0], channel, stage.expansion, y, model.Begin(), width);
+    const double level = stage.skyLevels[channel];
+    typename P::sample* p = image.ScanLine(y, channel);
+    if (stage.superFlat->applyMode == SFApplyMode::Divide) {
+        for (int x = 0; x < width; x++)
+            if (model[x] > 0)
+                p[x] = typename P::sample(pcl::Range(p[x] * level / model[x], 0.0, 1.0));
+    } else {
+        for (int x = 0; x < width; x++)
+            p[x] = typename P::sample(pcl::Range(p[x] - model[x] + level, 0.0, 1.0));
+    }
+}
+
+template <class P>
+void SuperFlatInstance::detectSky(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& smoothed, int y, int channel)
+{
+    // Step 3 of one row: a pixel is sky when the smoothed image does not exceed the reference by more than the
+    // threshold.
+    const GenericImage<P>& ref = inputs[0];
+    SkyBits(smoothed.ScanLine(y, channel), ref.ScanLine(y, channel), typename P::sample(stage.superFlat->skyDetectionThreshold),
+            stage.maskTarget->Row(y, channel), smoothed.Width());
+}
+
+template <class P>
+void SuperFlatInstance::extractSky(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& flat, int y, int channel)
+{
+    // Step 6 of one row: the sky samples of the image, and the sky mask as an image if there is one.
+    const uint64* bits = stage.maskSource->Row(y, channel);
+    const typename P::sample* pImage = inputs[0].ScanLine(y, channel);
+    typename P::sample* pMask = (inputs.Length() > 1) ? inputs[1].ScanLine(y, channel) : nullptr;
+    typename P::sample* pFlat = flat.ScanLine(y, channel);
+    for (int x = 0; x < flat.Width(); x++) {
+        const bool sky = ((bits[x >> 6] >> (x & 63)) & 1) != 0;
+        pFlat[x] = sky ? pImage[x] : typename P::sample(0);
+        if (pMask != nullptr)
+            pMask[x] = sky ? 1 : 0;
+    }
+}
+
+template <class P>
+void SuperFlatInstance::diffuse(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& pyramid, GenericImage<P>& maskImage, int y, int channel)
 {
     typename P::sample* pMask = maskImage.ScanLine(y, channel);
     for (int x = 0; x < maskImage.Width(); x++) {
@@ -366,51 +2009,189 @@ void SuperFlatInstance::diffuse(SuperFlatInstance* superFlat, ReferenceArray<Gen
     }
 }
 
- template <class P>
-void SuperFlatInstance::inpaint(SuperFlatInstance* superFlat, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, int y, int channel)
+template <class P, int N>
+void SuperFlatInstance::inpaint(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, const SuperFlatSpan& span, int channel)
 {
-    typename P::sample* pOut = output.ScanLine(y, channel);
+    typename P::sample* pOut = output.ScanLine(span.y, channel);
+    const GenericImage<P>& input = inputs[0];
+    const typename P::sample* pIn = input.PixelData(channel);
+    const int width = output.Width();
+    const int height = output.Height();
+    const int steps = SuperFlatRays<N>::table.StepsWithin(pcl::Max(width, height));
+
+    int x = span.x0;
+#ifdef SUPERFLAT_SSE2
+    for (; x + 4 <= span.x1; x += 4)
+        MarchRays4<typename P::sample, N, SuperFlatGeometricSteps>(pIn, width, height, x, span.y, steps, pOut + x);
+#endif
+    for (; x < span.x1; x++)
+        pOut[x] = MarchRays<typename P::sample, N, SuperFlatGeometricSteps>(pIn, width, height, x, span.y, steps);
+}
+
+template <class P>
+void SuperFlatInstance::nearestSkyColumn(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& nearestY, int x, int channel)
+{
+    // Row of the closest sky pixel within column x, or -1 if the column has no sky at all.
     GenericImage<P>& input = inputs[0];
-    const int n = 32;
-    const int distance = pcl::Max(output.Width(), output.Height());
-    std::minstd_rand rg(output.Height() * channel + y);
-    std::uniform_real_distribution<float> ud(-0.5f, 0.5f);
-
-    for (int x = 0; x < output.Width(); x++) {
-        typename P::sample in = input(x, y, channel);
-        if (in > 0.0) {
-            pOut[x] = in;
+    const int height = input.Height();
+    int last = -1;
+    for (int y = 0; y < height; y++) {
+        if (input(x, y, channel) != 0.0)
+            last = y;
+        nearestY(x, y, channel) = last;
+    }
+    last = -1;
+    for (int y = height - 1; y >= 0; y--) {
+        if (input(x, y, channel) != 0.0)
+            last = y;
+        if (last >= 0) {
+            typename P::sample& ny = nearestY(x, y, channel);
+            if ((ny < 0.0) || (last - y < y - ny))
+                ny = last;
+        }
+    }
+}
+
+template <class P>
+void SuperFlatInstance::nearestSkyRow(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& columns, GenericImage<P>& nearestX, int y, int channel)
+{
+    // Lower envelope of the parabolas (x - u)^2 + (y - nearestY(u))^2 over all columns u containing sky
+    // (Felzenszwalb & Huttenlocher). Both maps are rewritten with the coordinates of the nearest sky pixel.
+    GenericImage<P>& nearestY = columns[0];
+    const int width = nearestX.Width();
+    typename P::sample* pY = nearestY.ScanLine(y, channel);
+    typename P::sample* pX = nearestX.ScanLine(y, channel);
+    Array<int> rows(width);
+    Array<int> v(width);
+    Array<double> z(width + 1);
+    for (int u = 0; u < width; u++)
+        rows[u] = int(pY[u]);
+
+    auto f = [&](int u) { double dy = y - rows[u]; return dy * dy + double(u) * u; };
+    auto intersection = [&](int q, int u) { return (f(u) - f(q)) / (2.0 * (u - q)); };
+    int k = -1;
+    for (int u = 0; u < width; u++) {
+        if (rows[u] < 0)
+            continue;
+        if (k < 0) {
+            v[k = 0] = u;
+            z[0] = -std::numeric_limits<double>::max();
+            z[1] = std::numeric_limits<double>::max();
+            continue;
+        }
+        double s = intersection(v[k], u);
+        while (s <= z[k])
+            s = intersection(v[--k], u);
+        v[++k] = u;
+        z[k] = s;
+        z[k + 1] = std::numeric_limits<double>::max();
+    }
+
+    if (k < 0) {
+        for (int x = 0; x < width; x++)
+            pX[x] = pY[x] = -1;
+        return;
+    }
+    for (int x = 0, i = 0; x < width; x++) {
+        while (z[i + 1] < x)
+            i++;
+        pX[x] = v[i];
+        pY[x] = rows[v[i]];
+    }
+}
+
+template <class P, int N>
+void SuperFlatInstance::inpaintNearest(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, const SuperFlatSpan& span, int channel)
+{
+    // Each ray is sphere-traced through the nearest sky map for a bounded number of steps, and the sky pixel
+    // closest to where it stops contributes with the same 1/distance weight used by the ray marching kernel.
+    typename P::sample* pOut = output.ScanLine(span.y, channel);
+    const int y = span.y;
+    GenericImage<P>& input = inputs[0];
+    GenericImage<P>& nearestX = inputs[1];
+    GenericImage<P>& nearestY = inputs[2];
+    const SuperFlatRayTable<N>& rays = SuperFlatRays<N>::table;
+    const int maxSteps = 8;
+    const int width = output.Width();
+    const int height = output.Height();
+
+    for (int x = span.x0; x < span.x1; x++) {
+        if (nearestX(x, y, channel) < 0.0) {
+            pOut[x] = 0.0;
             continue;
         }
         typename P::sample p = 0.0;
         float w0 = 0.0f;
-        for (int i = 0; i < n; i++) {
-            float rad = pcl::Pi() * 2.0f * i / n;
-            float step_x = pcl::Cos(rad);
-            float step_y = pcl::Sin(rad);
-            for (int j = 1; j < distance; j = (j < 16) ? j + 1 : j * 1.1f) {
-                if ((j < 64) && (i % 2 != 0))
-                    continue;
-                float w = 1.0f / float(j);
+        for (int i = 0; i < N; i++) {
+            int ix = x, iy = y;
+            float t = 0.0f;
+            for (int k = 0; k < maxSteps; k++) {
+                float dx = ix - float(nearestX(ix, iy, channel));
+                float dy = iy - float(nearestY(ix, iy, channel));
+                float d = pcl::Sqrt(dx * dx + dy * dy);
+                if (d < 1.0f)
+                    break;
+                t += d;
+                ix = pcl::Range(int(x + rays.dx[i] * t + 0.5f), 0, width - 1);
+                iy = pcl::Range(int(y + rays.dy[i] * t + 0.5f), 0, height - 1);
+            }
+            int sx = int(nearestX(ix, iy, channel));
+            int sy = int(nearestY(ix, iy, channel));
+            float r = pcl::Sqrt(float(sx - x) * (sx - x) + float(sy - y) * (sy - y));
+            float w = 1.0f / pcl::Max(r, 1.0f);
+            if (w < w0 * 0.01f)
+                continue;
+            p += input(sx, sy, channel) * w;
+            w0 += w;
+        }
+        if (w0 > 0.0f)
+            pOut[x] = p / w0;
+        else
+            pOut[x] = 0.0;
+    }
+}
+
+template <class P, int N>
+void SuperFlatInstance::inpaintTraced(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, const SuperFlatSpan& span, int channel)
+{
+    // Same rays, steps and weights as inpaint(), but whenever a step lands on a non-sky pixel at distance d
+    // from the nearest sky pixel, every following step closer than d - 1.5 along the ray is skipped. Clamping
+    // and rounding move a sample by less than sqrt(2)/2 on each end, so the skipped samples are provably
+    // non-sky and the result is identical to inpaint().
+    typename P::sample* pOut = output.ScanLine(span.y, channel);
+    const int y = span.y;
+    GenericImage<P>& input = inputs[0];
+    GenericImage<P>& nearestX = inputs[1];
+    GenericImage<P>& nearestY = inputs[2];
+    const SuperFlatRayTable<N>& rays = SuperFlatRays<N>::table;
+    const int width = output.Width();
+    const int height = output.Height();
+    const int steps = rays.StepsWithin(pcl::Max(width, height));
+
+    for (int x = span.x0; x < span.x1; x++) {
+        if (nearestX(x, y, channel) < 0.0) {
+            pOut[x] = 0.0;
+            continue;
+        }
+        typename P::sample p = 0.0;
+        float w0 = 0.0f;
+        for (int i = 0; i < N; i++) {
+            for (int k = (i % 2 != 0) ? rays.firstFarStep : 0; k < steps; k++) {
+                const float w = rays.weight[k];
                 if (w < w0 * 0.01f)
-                    continue;
-                float rx = ud(rg) * j * 6.0f / n;
-                float ry = ud(rg) * j * 6.0f / n;
-                rx = 0.0;
-                ry = 0.0;
-                int ix = int(x + step_x * j + rx + 0.5f);
-                int iy = int(y + step_y * j + ry + 0.5f);
-                if (ix < 0)
-                    ix = 0;
-                else if (ix >= input.Width())
-                    ix = input.Width() - 1;
-                if (iy < 0)
-                    iy = 0;
-                else if (iy >= input.Height())
-                    iy = input.Height() - 1;
+                    break;
+                const int j = rays.step[k];
+                const int ix = pcl::Range(int(x + rays.dx[i] * j + 0.5f), 0, width - 1);
+                const int iy = pcl::Range(int(y + rays.dy[i] * j + 0.5f), 0, height - 1);
                 typename P::sample in = input(ix, iy, channel);
-                if (in == 0.0)
+                if (in == 0.0) {
+                    float dx = ix - float(nearestX(ix, iy, channel));
+                    float dy = iy - float(nearestY(ix, iy, channel));
+                    float skip = pcl::Sqrt(dx * dx + dy * dy) - 1.5f;
+                    while ((k + 1 < steps) && (rays.step[k + 1] - j < skip))
+                        k++;
                     continue;
+                }
                 p += in * w;
                 w0 += w;
                 break;
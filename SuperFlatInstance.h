@@ -2,11 +2,108 @@
 #define __SuperFlatInstance_h
 
 #include <pcl/ProcessImplementation.h>
+#include <pcl/Array.h>
+#include <pcl/ImageVariant.h>
 #include <pcl/MetaParameter.h> // pcl_enum
+#include <pcl/StringList.h>
 
 namespace pcl
 {
 
+// A run of consecutive non-sky pixels [x0, x1) of row y of a channel.
+struct SuperFlatSpan
+{
+    int channel;
+    int y;
+    int x0;
+    int x1;
+};
+
+// Load balance of one worker thread, accumulated over the parallel stages of an execution.
+struct SuperFlatWorkerStats
+{
+    double busy = 0;
+    double idle = 0;
+    size_type items = 0;
+    size_type steals = 0;
+};
+
+template <class P>
+class SuperFlatThread;
+class SuperFlatBuffers;
+class SuperFlatMask;
+class SuperFlatMasterFlat;
+class SuperFlatSelection;
+class SuperFlatShapeBlur;
+class SuperFlatSplineGrid;
+struct SuperFlatStageCacheEntry;
+class SuperFlatInstance;
+
+// State of one execution of the process on an image, kept apart from the parameters of the instance so that the frames
+// of a batch can be processed side by side with the same instance.
+struct SuperFlatExecution
+{
+    // Workers a parallel stage may use, zero for all those of the pool, and their load balance over all the stages.
+    int threads = 0;
+    Array<SuperFlatWorkerStats> workerStats;
+    // Files the star catalog and the spline grid model are written to, none if empty, and master flat the model is
+    // combined into as the frame masterFlatIndex, if any.
+    String starCatalogFile;
+    String splineGridFile;
+    SuperFlatMasterFlat* masterFlat = nullptr;
+    size_type masterFlatIndex = 0;
+    // Results of earlier executions on the same image that the stages may reuse and update, if any.
+    SuperFlatStageCacheEntry* cachedStages = nullptr;
+
+    // What the model found: the number of stars, the fraction of sky pixels and the sky level of every channel, and
+    // the stages taken from the cache rather than computed.
+    size_type starCount = 0;
+    double skyFraction = 0;
+    Array<double> skyLevels;
+    StringList reusedStages;
+};
+
+// Transient state of one parallel stage, passed to its kernels along with the instance whose parameters they apply.
+// Each stage fills in the members it needs before its dispatch.
+struct SuperFlatStageContext
+{
+    const SuperFlatInstance* superFlat;
+    SuperFlatExecution* execution;
+
+    // Filter of a blur, and step between the taps of an a trous pass.
+    const SuperFlatShapeBlur* shapeBlur = nullptr;
+    int atrousStep = 1;
+
+    // Factor of a decimation, and coarse pixels per output pixel of an expansion.
+    int decimation = 1;
+    double expansion[2] = { 1, 1 };
+
+    // Sky level of every channel of the model applied to an image, and the spline grid it is evaluated from, if any.
+    const double* skyLevels = nullptr;
+    const SuperFlatSplineGrid* splineGrid = nullptr;
+
+    // Filter of a selection, and the lowest sample and the spacing of the quantization levels of each channel.
+    const SuperFlatSelection* selection = nullptr;
+    Array<double> selectionLow;
+    Array<double> selectionStep;
+
+    // Packed masks read and written.
+    const SuperFlatMask* maskSource = nullptr;
+    SuperFlatMask* maskTarget = nullptr;
+
+    // Extremes of every row of the band-pass image of the star detection, and the level of that image above which a
+    // pixel is a star.
+    double* bandMinimum = nullptr;
+    double* bandMaximum = nullptr;
+    double starThreshold = 0;
+
+    SuperFlatStageContext(const SuperFlatInstance* instance, SuperFlatExecution& exec)
+        : superFlat(instance)
+        , execution(&exec)
+    {
+    }
+};
+
 class SuperFlatInstance : public ProcessImplementation
 {
 public:
@@ -18,27 +115,129 @@ public:
     UndoFlags UndoMode(const View&) const override;
     bool CanExecuteOn(const View&, pcl::String& whyNot) const override;
     bool ExecuteOn(View&) override;
+    bool CanExecuteGlobal(String& whyNot) const override;
+    bool ExecuteGlobal() override;
     void* LockParameter(const MetaParameter*, size_type tableRow) override;
+    bool AllocateParameter(size_type sizeOrLength, const MetaParameter* p, size_type tableRow) override;
+    size_type ParameterLength(const MetaParameter* p, size_type tableRow) const override;
 
 private:
     float skyDetectionThreshold;
     float starDetectionSensitivity;
-    int objectDiffusionDistance;
+    int8 objectDiffusionDistance;
     String nonSkyMaskViewId;
+    String starCatalogFile;
+    String splineGridFile;
     float smoothness;
-    int downsample;
-    bool generateSkyMask;
-    bool testSkyDetection;
+    uint32 downsample;
+    pcl_bool generateSkyMask;
+    pcl_bool testSkyDetection;
+    pcl_enum inpaintingMethod;
+    pcl_bool exactInpainting;
+    pcl_enum modelingMethod;
+    pcl_enum rayCount;
+    pcl_enum smoothingMethod;
+    pcl_enum applyMode;
+    pcl_bool useSplineGrid;
+    uint32 maxThreads;
+    // Memory the stage cache may hold, in MiB; zero disables it.
+    uint32 stageCacheSize;
+    // Image files processed by a global execution, the directory their outputs are written to (the directory of each
+    // file if empty), and the text appended to the names of the outputs.
+    StringList targetFrames;
+    String outputDirectory;
+    String outputPostfix;
+    // File the master flat combined from the sky models of all target frames is written to, none if empty.
+    String masterFlatFile;
+
+    // Smallest sigma, in pixels of the coarse image, left to the blur of the multiresolution smoothing.
+    static constexpr float MultiresolutionSigma = 16;
+    // Number of columns of the work items of the vertical blur passes, and of rows of those of the selections.
+    static constexpr int BlurBlockWidth = 32;
+    static constexpr int SelectionBandHeight = 16;
+
+    ImageVariant downsampleImage(ImageVariant& image, SuperFlatBuffers& buffers, SuperFlatExecution& execution, StatusMonitor& status) const;
+    ImageVariant nonSkyMaskImage(int bitsPerSample) const;
+    SuperFlatMask nonSkyPixels(ImageVariant& nonSkyMask, const ImageVariant& image, SuperFlatBuffers& buffers) const;
+    void modelImage(ImageVariant& downImage, int width, int height, const SuperFlatMask& nonSky,
+                    ImageVariant& flat, ImageVariant& mask, SuperFlatBuffers& buffers, SuperFlatExecution& execution, StatusMonitor& status) const;
+    void applyGrid(ImageVariant& image, const SuperFlatSplineGrid& grid, SuperFlatExecution& execution, StatusMonitor& status) const;
+    template <class P>
+    void inpaintImage(GenericImage<P>& flat, SuperFlatBuffers& buffers, SuperFlatExecution& execution, StatusMonitor& status) const;
+    template <class P, int N>
+    void inpaintRays(GenericImage<P>& flat, GenericImage<P>& flat0, SuperFlatBuffers& buffers, SuperFlatExecution& execution, StatusMonitor& status) const;
+    template <class P>
+    void solveLaplace(GenericImage<P>& flat, GenericImage<P>& flat0, int channel, SuperFlatExecution& execution) const;
+    void decimateImage(ImageVariant& source, ImageVariant& target, int factor, SuperFlatExecution& execution) const;
+    void blur(ImageVariant& image, float sigma, SuperFlatBuffers& buffers, SuperFlatExecution& execution) const;
+    void smooth(ImageVariant& source, ImageVariant& target, float sigma, SuperFlatBuffers& buffers, SuperFlatExecution& execution) const;
+    void convolve(ImageVariant& image, float sigma, SuperFlatExecution& execution) const;
+    void atrous(ImageVariant& image, int step, SuperFlatExecution& execution) const;
+    void detectStars(ImageVariant& fine, ImageVariant& coarse, SuperFlatMask& stars, SuperFlatExecution& execution) const;
+    void skyLevels(ImageVariant& model, const SuperFlatMask& sky, SuperFlatExecution& execution) const;
+    void applyModel(ImageVariant& image, ImageVariant& model, SuperFlatExecution& execution, StatusMonitor& status,
+                    const SuperFlatSplineGrid* grid = nullptr) const;
+    void select(ImageVariant& image, const SuperFlatSelection& filter, int passes, SuperFlatBuffers& buffers, SuperFlatExecution& execution, StatusMonitor& status) const;
+    template <class P>
+    void normalizedConvolution(GenericImage<P>& flat, GenericImage<P>& mask, SuperFlatBuffers& buffers, SuperFlatExecution& execution, StatusMonitor& status) const;
 
     template <class P>
-    static void genSkyMask(SuperFlatInstance* superFlat, ReferenceArray<GenericImage<P>>& ref, GenericImage<P>& maskImage, int y, int channel);
+    static void decimate(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, int y, int channel);
+    template <class P>
+    static void expand(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, int y, int channel);
+    template <class P>
+    static void correct(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& image, int y, int channel);
+    template <class P>
+    static void blurRows(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& image, int y, int channel);
+    template <class P>
+    static void blurColumns(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& image, int block, int channel);
+    template <class P>
+    static void atrousRows(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& image, int y, int channel);
+    template <class P>
+    static void atrousColumns(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& image, int block, int channel);
+    template <class P>
+    static void bandRange(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& coarse, int y, int channel);
+    template <class P>
+    static void starBits(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& coarse, int y, int channel);
+    template <class P>
+    static void median3(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, int y, int channel);
     template <class P>
-    static void diffuse(SuperFlatInstance* superFlat, ReferenceArray<GenericImage<P>>& pyramid, GenericImage<P>& maskImage, int y, int channel);
+    static void selectBand(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, int band, int channel);
     template <class P>
-    static void inpaint(SuperFlatInstance* superFlat, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, int y, int channel);
+    static void detectSky(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& smoothed, int y, int channel);
+    template <class P>
+    static void extractSky(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& flat, int y, int channel);
+    template <class P>
+    static void diffuse(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& pyramid, GenericImage<P>& maskImage, int y, int channel);
+    template <class P, int N>
+    static void inpaint(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, const SuperFlatSpan& span, int channel);
+    template <class P>
+    static void relaxRed(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& u, int y, int channel);
+    template <class P>
+    static void relaxBlack(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& u, int y, int channel);
+    template <class P>
+    static void residual(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& r, int y, int channel);
+    template <class P>
+    static void restrictResidual(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& f, int y, int channel);
+    template <class P>
+    static void prolongate(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& u, int y, int channel);
+    template <class P>
+    static void normalizeWeights(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, int y, int channel);
+    template <class P>
+    static void nearestSkyColumn(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& nearestY, int x, int channel);
+    template <class P>
+    static void nearestSkyRow(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& nearestX, int y, int channel);
+    template <class P, int N>
+    static void inpaintNearest(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, const SuperFlatSpan& span, int channel);
+    template <class P, int N>
+    static void inpaintTraced(const SuperFlatStageContext& stage, ReferenceArray<GenericImage<P>>& inputs, GenericImage<P>& output, const SuperFlatSpan& span, int channel);
 
+    template <class P>
+    friend class SuperFlatThread;
+    friend class SuperFlatBatch;
     friend class SuperFlatProcess;
     friend class SuperFlatInterface;
+    friend class SuperFlatSelfTest;
 };
 
 }	// namespace pcl
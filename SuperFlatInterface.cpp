@@ -1,8 +1,11 @@
 #include "SuperFlatInterface.h"
+#include "SuperFlatModule.h"
 #include "SuperFlatParameters.h"
 #include "SuperFlatProcess.h"
 
 #include <pcl/ErrorHandler.h>
+#include <pcl/File.h>
+#include <pcl/FileDialog.h>
 #include <pcl/ViewSelectionDialog.h>
 
 namespace pcl
@@ -39,7 +42,7 @@ IsoString SuperFlatInterface::IconImageSVG() const
 
 InterfaceFeatures SuperFlatInterface::Features() const
 {
-	return InterfaceFeature::Default;
+	return InterfaceFeature::Default | InterfaceFeature::ApplyGlobalButton;
 }
 
 void SuperFlatInterface::ApplyInstance() const
@@ -47,6 +50,11 @@ void SuperFlatInterface::ApplyInstance() const
 	instance.LaunchOnCurrentView();
 }
 
+void SuperFlatInterface::ApplyInstanceGlobal() const
+{
+	instance.LaunchGlobal();
+}
+
 void SuperFlatInterface::ResetInstance()
 {
 	SuperFlatInstance defaultInstance(TheSuperFlatProcess);
@@ -101,10 +109,39 @@ void SuperFlatInterface::UpdateControls()
 	GUI->StarDetectionSensitivity_NumericControl.SetValue(instance.starDetectionSensitivity);
 	GUI->ObjectDiffusionDistance_NumericControl.SetValue(instance.objectDiffusionDistance);
 	GUI->NonSkyMaskView_Edit.SetText(NONSKY_MASK_ID);
+	GUI->StarCatalog_Edit.SetText(instance.starCatalogFile);
 	GUI->Smoothness_NumericControl.SetValue(instance.smoothness);
+	GUI->SmoothingMethod_ComboBox.SetCurrentItem(instance.smoothingMethod);
 	GUI->Downsample_SpinBox.SetValue(instance.downsample);
+	GUI->MaxThreads_SpinBox.SetValue(instance.maxThreads);
+	GUI->StageCache_SpinBox.SetValue(instance.stageCacheSize);
+	GUI->ApplyMode_ComboBox.SetCurrentItem(instance.applyMode);
+	GUI->SplineGrid_Edit.SetText(instance.splineGridFile);
+	GUI->UseSplineGrid_CheckBox.SetChecked(instance.useSplineGrid);
+	GUI->ModelingMethod_ComboBox.SetCurrentItem(instance.modelingMethod);
+	GUI->InpaintingMethod_ComboBox.SetCurrentItem(instance.inpaintingMethod);
+	GUI->InpaintingMethod_ComboBox.Enable(instance.modelingMethod == SFModelingMethod::InpaintAndSmooth);
+	GUI->ExactInpainting_CheckBox.SetChecked(instance.exactInpainting);
+	GUI->ExactInpainting_CheckBox.Enable(instance.modelingMethod == SFModelingMethod::InpaintAndSmooth
+		&& instance.inpaintingMethod == SFInpaintingMethod::DistanceTransform);
+	GUI->RayCount_ComboBox.SetCurrentItem(instance.rayCount);
+	GUI->RayCount_ComboBox.Enable(instance.modelingMethod == SFModelingMethod::InpaintAndSmooth
+		&& instance.inpaintingMethod != SFInpaintingMethod::Multigrid);
 	GUI->GenerateSkyMask_CheckBox.SetChecked(instance.generateSkyMask);
 	GUI->TestSkyDetection_CheckBox.SetChecked(instance.testSkyDetection);
+
+	GUI->TargetFrames_TreeBox.DisableUpdates();
+	GUI->TargetFrames_TreeBox.Clear();
+	for (const String& filePath : instance.targetFrames)
+	{
+		TreeBox::Node* node = new TreeBox::Node(GUI->TargetFrames_TreeBox);
+		node->SetText(0, File::ExtractNameAndExtension(filePath));
+		node->SetToolTip(0, filePath);
+	}
+	GUI->TargetFrames_TreeBox.EnableUpdates();
+	GUI->OutputDirectory_Edit.SetText(instance.outputDirectory);
+	GUI->OutputPostfix_Edit.SetText(instance.outputPostfix);
+	GUI->MasterFlat_Edit.SetText(instance.masterFlatFile);
 }
 
 void SuperFlatInterface::__GetFocus(Control& sender)
@@ -142,6 +179,31 @@ void SuperFlatInterface::__EditCompleted(Edit& sender)
 			sender.Focus();
 		}
 	}
+	else if (sender == GUI->StarCatalog_Edit)
+	{
+		instance.starCatalogFile = sender.Text().Trimmed();
+		sender.SetText(instance.starCatalogFile);
+	}
+	else if (sender == GUI->SplineGrid_Edit)
+	{
+		instance.splineGridFile = sender.Text().Trimmed();
+		sender.SetText(instance.splineGridFile);
+	}
+	else if (sender == GUI->OutputDirectory_Edit)
+	{
+		instance.outputDirectory = sender.Text().Trimmed();
+		sender.SetText(instance.outputDirectory);
+	}
+	else if (sender == GUI->OutputPostfix_Edit)
+	{
+		instance.outputPostfix = sender.Text().Trimmed();
+		sender.SetText(instance.outputPostfix);
+	}
+	else if (sender == GUI->MasterFlat_Edit)
+	{
+		instance.masterFlatFile = sender.Text().Trimmed();
+		sender.SetText(instance.masterFlatFile);
+	}
 }
 
 void SuperFlatInterface::__EditValueUpdated(NumericEdit& sender, double value)
@@ -160,6 +222,10 @@ void SuperFlatInterface::__SpinBoxValueUpdated(SpinBox& sender, int value)
 {
 	if (sender == GUI->Downsample_SpinBox)
 		instance.downsample = value;
+	else if (sender == GUI->MaxThreads_SpinBox)
+		instance.maxThreads = value;
+	else if (sender == GUI->StageCache_SpinBox)
+		instance.stageCacheSize = value;
 }
 
 void SuperFlatInterface::__Click(Button& sender, bool checked)
@@ -171,10 +237,100 @@ void SuperFlatInterface::__Click(Button& sender, bool checked)
 			instance.nonSkyMaskViewId = d.Id();
 			GUI->NonSkyMaskView_Edit.SetText(NONSKY_MASK_ID);
 		}
+	} else if (sender == GUI->StarCatalog_ToolButton) {
+		SaveFileDialog d;
+		d.SetCaption("SuperFlat: Star Catalog File");
+		d.SetFilter(FileFilter("CSV Files", ".csv"));
+		d.EnableOverwritePrompt();
+		if (d.Execute())
+		{
+			instance.starCatalogFile = d.FileName();
+			GUI->StarCatalog_Edit.SetText(instance.starCatalogFile);
+		}
+	} else if (sender == GUI->SplineGrid_ToolButton) {
+		// The file is read when a saved model is applied, and written otherwise.
+		if (instance.useSplineGrid)
+		{
+			OpenFileDialog d;
+			d.SetCaption("SuperFlat: Spline Grid Model File");
+			d.SetFilter(FileFilter("SuperFlat Spline Grid Files", ".sfgrid"));
+			if (d.Execute())
+				instance.splineGridFile = d.FileName();
+		}
+		else
+		{
+			SaveFileDialog d;
+			d.SetCaption("SuperFlat: Spline Grid Model File");
+			d.SetFilter(FileFilter("SuperFlat Spline Grid Files", ".sfgrid"));
+			d.EnableOverwritePrompt();
+			if (d.Execute())
+				instance.splineGridFile = d.FileName();
+		}
+		GUI->SplineGrid_Edit.SetText(instance.splineGridFile);
+	} else if (sender == GUI->UseSplineGrid_CheckBox) {
+		instance.useSplineGrid = checked;
 	} else if (sender == GUI->GenerateSkyMask_CheckBox) {
 		instance.generateSkyMask = checked;
 	} else if (sender == GUI->TestSkyDetection_CheckBox) {
 		instance.testSkyDetection = checked;
+	} else if (sender == GUI->ExactInpainting_CheckBox) {
+		instance.exactInpainting = checked;
+	} else if (sender == GUI->ClearStageCache_PushButton) {
+		TheSuperFlatModule->StageCache().Clear();
+	} else if (sender == GUI->AddFrames_PushButton) {
+		OpenFileDialog d;
+		d.SetCaption("SuperFlat: Target Frames");
+		d.LoadImageFilters();
+		d.EnableMultipleSelections();
+		if (d.Execute())
+		{
+			for (const String& filePath : d.FileNames())
+				instance.targetFrames << filePath;
+			UpdateControls();
+		}
+	} else if (sender == GUI->RemoveFrames_PushButton) {
+		for (int i = GUI->TargetFrames_TreeBox.NumberOfChildren(); --i >= 0;)
+			if (GUI->TargetFrames_TreeBox[i]->IsSelected())
+				instance.targetFrames.Remove(instance.targetFrames.At(i));
+		UpdateControls();
+	} else if (sender == GUI->ClearFrames_PushButton) {
+		instance.targetFrames.Clear();
+		UpdateControls();
+	} else if (sender == GUI->OutputDirectory_ToolButton) {
+		GetDirectoryDialog d;
+		d.SetCaption("SuperFlat: Output Directory");
+		if (d.Execute())
+		{
+			instance.outputDirectory = d.Directory();
+			GUI->OutputDirectory_Edit.SetText(instance.outputDirectory);
+		}
+	} else if (sender == GUI->MasterFlat_ToolButton) {
+		SaveFileDialog d;
+		d.SetCaption("SuperFlat: Master Flat File");
+		d.SetFilter(FileFilter("XISF Files", ".xisf"));
+		d.EnableOverwritePrompt();
+		if (d.Execute())
+		{
+			instance.masterFlatFile = d.FileName();
+			GUI->MasterFlat_Edit.SetText(instance.masterFlatFile);
+		}
+	}
+}
+
+void SuperFlatInterface::__ItemSelected(ComboBox& sender, int itemIndex)
+{
+	if (sender == GUI->ModelingMethod_ComboBox) {
+		instance.modelingMethod = itemIndex;
+		UpdateControls();
+	} else if (sender == GUI->InpaintingMethod_ComboBox) {
+		instance.inpaintingMethod = itemIndex;
+		UpdateControls();
+	} else if (sender == GUI->RayCount_ComboBox) {
+		instance.rayCount = itemIndex;
+	} else if (sender == GUI->SmoothingMethod_ComboBox) {
+		instance.smoothingMethod = itemIndex;
+	} else if (sender == GUI->ApplyMode_ComboBox) {
+		instance.applyMode = itemIndex;
 	}
 }
 
@@ -234,13 +390,15 @@ SuperFlatInterface::GUIData::GUIData(SuperFlatInterface& w)
 
 	ObjectDiffusionDistance_NumericControl.label.SetText("Object diffusion distance:");
 	ObjectDiffusionDistance_NumericControl.label.SetFixedWidth(labelWidth1);
-	ObjectDiffusionDistance_NumericControl.slider.SetRange(0, 1000);
+	ObjectDiffusionDistance_NumericControl.slider.SetRange(0, 10);
 	ObjectDiffusionDistance_NumericControl.slider.SetScaledMinWidth(300);
 	ObjectDiffusionDistance_NumericControl.SetInteger();
 	ObjectDiffusionDistance_NumericControl.SetRange(TheSFObjectDiffusionDistanceParameter->MinimumValue(), TheSFObjectDiffusionDistanceParameter->MaximumValue());
 	ObjectDiffusionDistance_NumericControl.edit.SetFixedWidth(editWidth1);
 	ObjectDiffusionDistance_NumericControl.SetToolTip("<p>After a non-sky mask is generated in sky detection, the mask will be diffused in order to protect the edges "
-		                                              "and flares of stars or deep sky objects. This value describes the distance of the diffusion.</p>");
+		                                              "and flares of stars or deep sky objects. This value describes the distance of the diffusion. "
+		                                              "Each star is masked with a margin from half to four times this distance, growing with its brightness, "
+		                                              "but no wider than 128 pixels.</p>");
 	ObjectDiffusionDistance_NumericControl.OnValueUpdated((NumericEdit::value_event_handler) & SuperFlatInterface::__EditValueUpdated, w);
 	ObjectDiffusionDistance_Sizer.SetSpacing(4);
 	ObjectDiffusionDistance_Sizer.Add(ObjectDiffusionDistance_NumericControl);
@@ -263,6 +421,22 @@ SuperFlatInterface::GUIData::GUIData(SuperFlatInterface& w)
 	NonSkyMaskView_Sizer.Add(NonSkyMaskView_Edit);
 	NonSkyMaskView_Sizer.Add(NonSkyMaskView_ToolButton);
 
+	StarCatalog_Label.SetText("Star catalog file:");
+	StarCatalog_Label.SetFixedWidth(labelWidth1);
+	StarCatalog_Label.SetTextAlignment(TextAlign::Right | TextAlign::VertCenter);
+	StarCatalog_Edit.SetToolTip("<p>Optional CSV file where the stars found by the star detection are written, one per line: "
+		"channel, centroid, peak of the band-pass image, area, bounding box size and radius of the masked disk, "
+		"in pixels of the full resolution image. Leave empty to skip the file.</p>");
+	StarCatalog_Edit.OnEditCompleted((Edit::edit_event_handler) & SuperFlatInterface::__EditCompleted, w);
+	StarCatalog_ToolButton.SetIcon(Bitmap(w.ScaledResource(":/icons/select-file.png")));
+	StarCatalog_ToolButton.SetScaledFixedSize(20, 20);
+	StarCatalog_ToolButton.SetToolTip("<p>Select the star catalog file.</p>");
+	StarCatalog_ToolButton.OnClick((Button::click_event_handler) & SuperFlatInterface::__Click, w);
+	StarCatalog_Sizer.SetSpacing(4);
+	StarCatalog_Sizer.Add(StarCatalog_Label);
+	StarCatalog_Sizer.Add(StarCatalog_Edit);
+	StarCatalog_Sizer.Add(StarCatalog_ToolButton);
+
 	Smoothness_NumericControl.label.SetText("Smoothness:");
 	Smoothness_NumericControl.label.SetFixedWidth(labelWidth1);
 	Smoothness_NumericControl.slider.SetRange(0, 1000);
@@ -277,6 +451,22 @@ SuperFlatInterface::GUIData::GUIData(SuperFlatInterface& w)
 	Smoothness_Sizer.Add(Smoothness_NumericControl);
 	Smoothness_Sizer.AddStretch();
 
+	SmoothingMethod_Label.SetText("Smoothing method:");
+	SmoothingMethod_Label.SetFixedWidth(labelWidth1);
+	SmoothingMethod_Label.SetTextAlignment(TextAlign::Right | TextAlign::VertCenter);
+	SmoothingMethod_ComboBox.AddItem("Convolution");
+	SmoothingMethod_ComboBox.AddItem("Multiresolution");
+	SmoothingMethod_ComboBox.SetToolTip("<p>How the large scale blurs of the sky reference and of the final model are computed.</p>"
+		"<p><b>Convolution</b> convolves the image at the working resolution.</p>"
+		"<p><b>Multiresolution</b> averages the image down by a factor proportional to the blur size, blurs the small image "
+		"and expands it back with a cubic B-spline. It is much faster for large blurs, at the cost of a slightly "
+		"different kernel.</p>");
+	SmoothingMethod_ComboBox.OnItemSelected((ComboBox::item_event_handler) & SuperFlatInterface::__ItemSelected, w);
+	SmoothingMethod_Sizer.SetSpacing(4);
+	SmoothingMethod_Sizer.Add(SmoothingMethod_Label);
+	SmoothingMethod_Sizer.Add(SmoothingMethod_ComboBox);
+	SmoothingMethod_Sizer.AddStretch();
+
 	Downsample_Label.SetText("Downsample");
 	Downsample_Label.SetFixedWidth(labelWidth1);
 	Downsample_Label.SetTextAlignment(TextAlign::Right | TextAlign::VertCenter);
@@ -287,6 +477,132 @@ SuperFlatInterface::GUIData::GUIData(SuperFlatInterface& w)
 	Downsample_Sizer.Add(Downsample_SpinBox);
 	Downsample_Sizer.AddStretch();
 
+	ModelingMethod_Label.SetText("Modeling method:");
+	ModelingMethod_Label.SetFixedWidth(labelWidth1);
+	ModelingMethod_Label.SetTextAlignment(TextAlign::Right | TextAlign::VertCenter);
+	ModelingMethod_ComboBox.AddItem("Inpaint and smooth");
+	ModelingMethod_ComboBox.AddItem("Normalized convolution");
+	ModelingMethod_ComboBox.SetToolTip("<p><b>Inpaint and smooth</b> fills the non-sky areas with the selected inpainting method "
+		"and then blurs the result.</p>"
+		"<p><b>Normalized convolution</b> blurs the sky samples and the sky mask with the same kernel and divides them. "
+		"This replaces both steps with two FFT convolutions.</p>");
+	ModelingMethod_ComboBox.OnItemSelected((ComboBox::item_event_handler) & SuperFlatInterface::__ItemSelected, w);
+	ModelingMethod_Sizer.SetSpacing(4);
+	ModelingMethod_Sizer.Add(ModelingMethod_Label);
+	ModelingMethod_Sizer.Add(ModelingMethod_ComboBox);
+	ModelingMethod_Sizer.AddStretch();
+
+	InpaintingMethod_Label.SetText("Inpainting method:");
+	InpaintingMethod_Label.SetFixedWidth(labelWidth1);
+	InpaintingMethod_Label.SetTextAlignment(TextAlign::Right | TextAlign::VertCenter);
+	InpaintingMethod_ComboBox.AddItem("Ray marching");
+	InpaintingMethod_ComboBox.AddItem("Distance transform");
+	InpaintingMethod_ComboBox.AddItem("Multigrid");
+	InpaintingMethod_ComboBox.SetToolTip("<p>Algorithm used to fill the non-sky areas before smoothing.</p>"
+		"<p><b>Ray marching</b> casts rays from every masked pixel until they reach the sky. Its cost grows with the size of the masked areas.</p>"
+		"<p><b>Distance transform</b> first builds a map of the nearest sky pixel with an exact Euclidean distance transform, "
+		"then follows the rays through that map in a bounded number of steps.</p>"
+		"<p><b>Multigrid</b> fills the non-sky areas with the smooth solution of the Laplace equation, "
+		"using the sky as boundary condition. Its cost does not depend on the size of the masked areas.</p>");
+	InpaintingMethod_ComboBox.OnItemSelected((ComboBox::item_event_handler) & SuperFlatInterface::__ItemSelected, w);
+	InpaintingMethod_Sizer.SetSpacing(4);
+	InpaintingMethod_Sizer.Add(InpaintingMethod_Label);
+	InpaintingMethod_Sizer.Add(InpaintingMethod_ComboBox);
+	InpaintingMethod_Sizer.AddStretch();
+
+	RayCount_Label.SetText("Ray count:");
+	RayCount_Label.SetFixedWidth(labelWidth1);
+	RayCount_Label.SetTextAlignment(TextAlign::Right | TextAlign::VertCenter);
+	RayCount_ComboBox.AddItem("8");
+	RayCount_ComboBox.AddItem("16");
+	RayCount_ComboBox.AddItem("32");
+	RayCount_ComboBox.AddItem("64");
+	RayCount_ComboBox.SetToolTip("<p>Number of rays cast from every masked pixel by the ray marching and distance transform inpainting methods.</p>"
+		"<p>Fewer rays are faster but produce a noisier fill, which is mostly hidden by the final smoothing. The default is 32.</p>");
+	RayCount_ComboBox.OnItemSelected((ComboBox::item_event_handler) & SuperFlatInterface::__ItemSelected, w);
+	RayCount_Sizer.SetSpacing(4);
+	RayCount_Sizer.Add(RayCount_Label);
+	RayCount_Sizer.Add(RayCount_ComboBox);
+	RayCount_Sizer.AddStretch();
+
+	ExactInpainting_CheckBox.SetText("Exact inpainting");
+	ExactInpainting_CheckBox.SetToolTip("<p>If selected, the distance transform is only used to skip ray steps that cannot reach the sky, "
+		"producing exactly the same result as ray marching.</p>");
+	ExactInpainting_CheckBox.OnClick((Button::click_event_handler) & SuperFlatInterface::__Click, w);
+	ExactInpainting_Sizer.AddUnscaledSpacing(labelWidth1 + ui4);
+	ExactInpainting_Sizer.Add(ExactInpainting_CheckBox);
+	ExactInpainting_Sizer.AddStretch();
+
+	ApplyMode_Label.SetText("Output:");
+	ApplyMode_Label.SetFixedWidth(labelWidth1);
+	ApplyMode_Label.SetTextAlignment(TextAlign::Right | TextAlign::VertCenter);
+	ApplyMode_ComboBox.AddItem("Create flat model");
+	ApplyMode_ComboBox.AddItem("Divide target by model");
+	ApplyMode_ComboBox.AddItem("Subtract model from target");
+	ApplyMode_ComboBox.SetToolTip("<p><b>Create flat model</b> opens the model in a new window, at the downsampled size.</p>"
+		"<p><b>Divide target by model</b> and <b>Subtract model from target</b> correct the target view in place instead. "
+		"The model is expanded to full resolution with a cubic B-spline one row at a time, and the result is brought back to "
+		"the median level of the model over the sky, so no full resolution model is ever stored.</p>");
+	ApplyMode_ComboBox.OnItemSelected((ComboBox::item_event_handler) & SuperFlatInterface::__ItemSelected, w);
+	ApplyMode_Sizer.SetSpacing(4);
+	ApplyMode_Sizer.Add(ApplyMode_Label);
+	ApplyMode_Sizer.Add(ApplyMode_ComboBox);
+	ApplyMode_Sizer.AddStretch();
+
+	SplineGrid_Label.SetText("Spline grid model:");
+	SplineGrid_Label.SetFixedWidth(labelWidth1);
+	SplineGrid_Label.SetTextAlignment(TextAlign::Right | TextAlign::VertCenter);
+	SplineGrid_Edit.SetToolTip("<p>Optional file where the model is saved as a grid of bicubic B-spline control points, "
+		"at most 128 x 128 per channel, together with its sky levels. Leave empty to skip the file.</p>");
+	SplineGrid_Edit.OnEditCompleted((Edit::edit_event_handler) & SuperFlatInterface::__EditCompleted, w);
+	SplineGrid_ToolButton.SetIcon(Bitmap(w.ScaledResource(":/icons/select-file.png")));
+	SplineGrid_ToolButton.SetScaledFixedSize(20, 20);
+	SplineGrid_ToolButton.SetToolTip("<p>Select the spline grid model file.</p>");
+	SplineGrid_ToolButton.OnClick((Button::click_event_handler) & SuperFlatInterface::__Click, w);
+	SplineGrid_Sizer.SetSpacing(4);
+	SplineGrid_Sizer.Add(SplineGrid_Label);
+	SplineGrid_Sizer.Add(SplineGrid_Edit);
+	SplineGrid_Sizer.Add(SplineGrid_ToolButton);
+
+	UseSplineGrid_CheckBox.SetText("Apply saved model");
+	UseSplineGrid_CheckBox.SetToolTip("<p>If selected, the spline grid model file is read and divided into or subtracted from "
+		"the target, according to the output mode, in a single pass without any sky detection. The target must have the "
+		"geometry of the image the model was made from.</p>");
+	UseSplineGrid_CheckBox.OnClick((Button::click_event_handler) & SuperFlatInterface::__Click, w);
+	UseSplineGrid_Sizer.AddUnscaledSpacing(labelWidth1 + ui4);
+	UseSplineGrid_Sizer.Add(UseSplineGrid_CheckBox);
+	UseSplineGrid_Sizer.AddStretch();
+
+	MaxThreads_Label.SetText("Thread limit:");
+	MaxThreads_Label.SetFixedWidth(labelWidth1);
+	MaxThreads_Label.SetTextAlignment(TextAlign::Right | TextAlign::VertCenter);
+	MaxThreads_SpinBox.SetRange(int(TheSFMaxThreadsParameter->MinimumValue()), int(TheSFMaxThreadsParameter->MaximumValue()));
+	MaxThreads_SpinBox.SetMinimumValueText("<Auto>");
+	MaxThreads_SpinBox.SetToolTip("<p>Maximum number of worker threads used by SuperFlat. "
+		"<Auto> uses as many threads as allowed by the global PixInsight preferences.</p>");
+	MaxThreads_SpinBox.OnValueUpdated((SpinBox::value_event_handler) & SuperFlatInterface::__SpinBoxValueUpdated, w);
+	MaxThreads_Sizer.SetSpacing(4);
+	MaxThreads_Sizer.Add(MaxThreads_Label);
+	MaxThreads_Sizer.Add(MaxThreads_SpinBox);
+	MaxThreads_Sizer.AddStretch();
+
+	StageCache_Label.SetText("Stage cache (MiB):");
+	StageCache_Label.SetFixedWidth(labelWidth1);
+	StageCache_Label.SetTextAlignment(TextAlign::Right | TextAlign::VertCenter);
+	StageCache_SpinBox.SetRange(int(TheSFStageCacheSizeParameter->MinimumValue()), int(TheSFStageCacheSizeParameter->MaximumValue()));
+	StageCache_SpinBox.SetMinimumValueText("<Disabled>");
+	StageCache_SpinBox.SetToolTip("<p>Memory kept for the intermediate results of the last executions on views, in MiB. "
+		"Running again on the same image with a few parameters changed only recomputes the stages that depend on them.</p>");
+	StageCache_SpinBox.OnValueUpdated((SpinBox::value_event_handler) & SuperFlatInterface::__SpinBoxValueUpdated, w);
+	ClearStageCache_PushButton.SetText("Clear");
+	ClearStageCache_PushButton.SetToolTip("<p>Free all the intermediate results held by the stage cache.</p>");
+	ClearStageCache_PushButton.OnClick((Button::click_event_handler) & SuperFlatInterface::__Click, w);
+	StageCache_Sizer.SetSpacing(4);
+	StageCache_Sizer.Add(StageCache_Label);
+	StageCache_Sizer.Add(StageCache_SpinBox);
+	StageCache_Sizer.Add(ClearStageCache_PushButton);
+	StageCache_Sizer.AddStretch();
+
 	GenerateSkyMask_CheckBox.SetText("Generate sky mask");
 	GenerateSkyMask_CheckBox.SetToolTip("<p>If selected, a new image window with a sky mask will be created.</p>");
 	GenerateSkyMask_CheckBox.OnClick((Button::click_event_handler) & SuperFlatInterface::__Click, w);
@@ -301,16 +617,108 @@ SuperFlatInterface::GUIData::GUIData(SuperFlatInterface& w)
 	TestSkyDetection_Sizer.Add(TestSkyDetection_CheckBox);
 	TestSkyDetection_Sizer.AddStretch();
 
+	TargetFrames_Label.SetText("Target frames:");
+	TargetFrames_Label.SetFixedWidth(labelWidth1);
+	TargetFrames_Label.SetTextAlignment(TextAlign::Right | TextAlign::Top);
+	TargetFrames_TreeBox.SetNumberOfColumns(1);
+	TargetFrames_TreeBox.HideHeader();
+	TargetFrames_TreeBox.EnableMultipleSelections();
+	TargetFrames_TreeBox.DisableRootDecoration();
+	TargetFrames_TreeBox.EnableAlternateRowColor();
+	TargetFrames_TreeBox.SetScaledMinHeight(120);
+	TargetFrames_TreeBox.SetToolTip("<p>Image files processed by the global execution of this instance, with the parameters above. "
+		"Each frame is written to the output directory as an XISF file named after it with the output postfix appended: "
+		"the corrected frame, or its model when the output is the flat model. The sky mask, star catalog and spline grid "
+		"files selected above are written for every frame as well, next to its output and named after it.</p>"
+		"<p>Frames are read, processed and written at the same time, and small frames are processed several at a time.</p>");
+	AddFrames_PushButton.SetText("Add Files");
+	AddFrames_PushButton.SetToolTip("<p>Add image files to the list of target frames.</p>");
+	AddFrames_PushButton.OnClick((Button::click_event_handler) & SuperFlatInterface::__Click, w);
+	RemoveFrames_PushButton.SetText("Remove");
+	RemoveFrames_PushButton.SetToolTip("<p>Remove the selected target frames.</p>");
+	RemoveFrames_PushButton.OnClick((Button::click_event_handler) & SuperFlatInterface::__Click, w);
+	ClearFrames_PushButton.SetText("Clear");
+	ClearFrames_PushButton.SetToolTip("<p>Remove all target frames.</p>");
+	ClearFrames_PushButton.OnClick((Button::click_event_handler) & SuperFlatInterface::__Click, w);
+	TargetFramesButtons_Sizer.SetSpacing(4);
+	TargetFramesButtons_Sizer.Add(AddFrames_PushButton);
+	TargetFramesButtons_Sizer.Add(RemoveFrames_PushButton);
+	TargetFramesButtons_Sizer.Add(ClearFrames_PushButton);
+	TargetFramesButtons_Sizer.AddStretch();
+	TargetFrames_Sizer.SetSpacing(4);
+	TargetFrames_Sizer.Add(TargetFrames_Label);
+	TargetFrames_Sizer.Add(TargetFrames_TreeBox, 100);
+	TargetFrames_Sizer.Add(TargetFramesButtons_Sizer);
+
+	OutputDirectory_Label.SetText("Output directory:");
+	OutputDirectory_Label.SetFixedWidth(labelWidth1);
+	OutputDirectory_Label.SetTextAlignment(TextAlign::Right | TextAlign::VertCenter);
+	OutputDirectory_Edit.SetToolTip("<p>Directory where the outputs of the target frames are written. "
+		"Leave empty to write each output to the directory of its frame.</p>");
+	OutputDirectory_Edit.OnEditCompleted((Edit::edit_event_handler) & SuperFlatInterface::__EditCompleted, w);
+	OutputDirectory_ToolButton.SetIcon(Bitmap(w.ScaledResource(":/icons/select-file.png")));
+	OutputDirectory_ToolButton.SetScaledFixedSize(20, 20);
+	OutputDirectory_ToolButton.SetToolTip("<p>Select the output directory.</p>");
+	OutputDirectory_ToolButton.OnClick((Button::click_event_handler) & SuperFlatInterface::__Click, w);
+	OutputDirectory_Sizer.SetSpacing(4);
+	OutputDirectory_Sizer.Add(OutputDirectory_Label);
+	OutputDirectory_Sizer.Add(OutputDirectory_Edit);
+	OutputDirectory_Sizer.Add(OutputDirectory_ToolButton);
+
+	OutputPostfix_Label.SetText("Output postfix:");
+	OutputPostfix_Label.SetFixedWidth(labelWidth1);
+	OutputPostfix_Label.SetTextAlignment(TextAlign::Right | TextAlign::VertCenter);
+	OutputPostfix_Edit.SetFixedWidth(editWidth1);
+	OutputPostfix_Edit.SetToolTip("<p>Text appended to the names of the target frames to name their outputs.</p>");
+	OutputPostfix_Edit.OnEditCompleted((Edit::edit_event_handler) & SuperFlatInterface::__EditCompleted, w);
+	OutputPostfix_Sizer.SetSpacing(4);
+	OutputPostfix_Sizer.Add(OutputPostfix_Label);
+	OutputPostfix_Sizer.Add(OutputPostfix_Edit);
+	OutputPostfix_Sizer.AddStretch();
+
+	MasterFlat_Label.SetText("Master flat file:");
+	MasterFlat_Label.SetFixedWidth(labelWidth1);
+	MasterFlat_Label.SetTextAlignment(TextAlign::Right | TextAlign::VertCenter);
+	MasterFlat_Edit.SetToolTip("<p>Optional file where a master flat combined from the sky models of all target frames is "
+		"written at the end of a global execution. Each model is divided by its sky level and added to a running mean of "
+		"every pixel, with values beyond three standard deviations clipped, in which the sky pixels of the frame count a "
+		"hundred times more than the inpainted ones. Memory does not grow with the number of frames. The master flat has "
+		"the resolution of the models. Leave empty to skip the file.</p>");
+	MasterFlat_Edit.OnEditCompleted((Edit::edit_event_handler) & SuperFlatInterface::__EditCompleted, w);
+	MasterFlat_ToolButton.SetIcon(Bitmap(w.ScaledResource(":/icons/select-file.png")));
+	MasterFlat_ToolButton.SetScaledFixedSize(20, 20);
+	MasterFlat_ToolButton.SetToolTip("<p>Select the master flat file.</p>");
+	MasterFlat_ToolButton.OnClick((Button::click_event_handler) & SuperFlatInterface::__Click, w);
+	MasterFlat_Sizer.SetSpacing(4);
+	MasterFlat_Sizer.Add(MasterFlat_Label);
+	MasterFlat_Sizer.Add(MasterFlat_Edit);
+	MasterFlat_Sizer.Add(MasterFlat_ToolButton);
+
 	Global_Sizer.SetMargin(8);
 	Global_Sizer.SetSpacing(4);
 	Global_Sizer.Add(SkyDetectionThreshold_Sizer);
 	Global_Sizer.Add(StarDetectionSensitivity_Sizer);
 	Global_Sizer.Add(ObjectDiffusionDistance_Sizer);
 	Global_Sizer.Add(NonSkyMaskView_Sizer);
+	Global_Sizer.Add(StarCatalog_Sizer);
 	Global_Sizer.Add(Smoothness_Sizer);
+	Global_Sizer.Add(SmoothingMethod_Sizer);
 	Global_Sizer.Add(Downsample_Sizer);
+	Global_Sizer.Add(ModelingMethod_Sizer);
+	Global_Sizer.Add(InpaintingMethod_Sizer);
+	Global_Sizer.Add(RayCount_Sizer);
+	Global_Sizer.Add(ExactInpainting_Sizer);
+	Global_Sizer.Add(ApplyMode_Sizer);
+	Global_Sizer.Add(SplineGrid_Sizer);
+	Global_Sizer.Add(UseSplineGrid_Sizer);
+	Global_Sizer.Add(MaxThreads_Sizer);
+	Global_Sizer.Add(StageCache_Sizer);
 	Global_Sizer.Add(GenerateSkyMask_Sizer);
 	Global_Sizer.Add(TestSkyDetection_Sizer);
+	Global_Sizer.Add(TargetFrames_Sizer);
+	Global_Sizer.Add(OutputDirectory_Sizer);
+	Global_Sizer.Add(OutputPostfix_Sizer);
+	Global_Sizer.Add(MasterFlat_Sizer);
 
 	w.SetSizer(Global_Sizer);
 
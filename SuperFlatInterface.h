@@ -2,13 +2,16 @@
 #define __SuperFlatInterface_h
 
 #include <pcl/CheckBox.h>
+#include <pcl/ComboBox.h>
 #include <pcl/Edit.h>
 #include <pcl/Label.h>
 #include <pcl/NumericControl.h>
 #include <pcl/ProcessInterface.h>
+#include <pcl/PushButton.h>
 #include <pcl/Sizer.h>
 #include <pcl/SpinBox.h>
 #include <pcl/ToolButton.h>
+#include <pcl/TreeBox.h>
 
 #include "SuperFlatInstance.h"
 
@@ -25,6 +28,7 @@ public:
     IsoString IconImageSVG() const override;
     InterfaceFeatures Features() const override;
     void ApplyInstance() const override;
+    void ApplyInstanceGlobal() const override;
     void ResetInstance() override;
     bool Launch(const MetaProcess&, const ProcessImplementation*, bool& dynamic, unsigned& /*flags*/) override;
     ProcessImplementation* NewProcess() const override;
@@ -50,15 +54,67 @@ private:
                 Label           NonSkyMaskView_Label;
                 Edit            NonSkyMaskView_Edit;
                 ToolButton      NonSkyMaskView_ToolButton;
+            HorizontalSizer StarCatalog_Sizer;
+                Label           StarCatalog_Label;
+                Edit            StarCatalog_Edit;
+                ToolButton      StarCatalog_ToolButton;
             HorizontalSizer Smoothness_Sizer;
                 NumericControl  Smoothness_NumericControl;
+            HorizontalSizer SmoothingMethod_Sizer;
+                Label           SmoothingMethod_Label;
+                ComboBox        SmoothingMethod_ComboBox;
             HorizontalSizer   Downsample_Sizer;
                 Label             Downsample_Label;
                 SpinBox           Downsample_SpinBox;
+            HorizontalSizer ModelingMethod_Sizer;
+                Label           ModelingMethod_Label;
+                ComboBox        ModelingMethod_ComboBox;
+            HorizontalSizer InpaintingMethod_Sizer;
+                Label           InpaintingMethod_Label;
+                ComboBox        InpaintingMethod_ComboBox;
+            HorizontalSizer RayCount_Sizer;
+                Label           RayCount_Label;
+                ComboBox        RayCount_ComboBox;
+            HorizontalSizer ExactInpainting_Sizer;
+                CheckBox        ExactInpainting_CheckBox;
+            HorizontalSizer ApplyMode_Sizer;
+                Label           ApplyMode_Label;
+                ComboBox        ApplyMode_ComboBox;
+            HorizontalSizer SplineGrid_Sizer;
+                Label           SplineGrid_Label;
+                Edit            SplineGrid_Edit;
+                ToolButton      SplineGrid_ToolButton;
+            HorizontalSizer UseSplineGrid_Sizer;
+                CheckBox        UseSplineGrid_CheckBox;
+            HorizontalSizer MaxThreads_Sizer;
+                Label           MaxThreads_Label;
+                SpinBox         MaxThreads_SpinBox;
+            HorizontalSizer StageCache_Sizer;
+                Label           StageCache_Label;
+                SpinBox         StageCache_SpinBox;
+                PushButton      ClearStageCache_PushButton;
             HorizontalSizer GenerateSkyMask_Sizer;
                 CheckBox        GenerateSkyMask_CheckBox;
             HorizontalSizer TestSkyDetection_Sizer;
                 CheckBox        TestSkyDetection_CheckBox;
+            HorizontalSizer TargetFrames_Sizer;
+                Label           TargetFrames_Label;
+                TreeBox         TargetFrames_TreeBox;
+                VerticalSizer   TargetFramesButtons_Sizer;
+                    PushButton      AddFrames_PushButton;
+                    PushButton      RemoveFrames_PushButton;
+                    PushButton      ClearFrames_PushButton;
+            HorizontalSizer OutputDirectory_Sizer;
+                Label           OutputDirectory_Label;
+                Edit            OutputDirectory_Edit;
+                ToolButton      OutputDirectory_ToolButton;
+            HorizontalSizer OutputPostfix_Sizer;
+                Label           OutputPostfix_Label;
+                Edit            OutputPostfix_Edit;
+            HorizontalSizer MasterFlat_Sizer;
+                Label           MasterFlat_Label;
+                Edit            MasterFlat_Edit;
+                ToolButton      MasterFlat_ToolButton;
     };
 
     GUIData* GUI = nullptr;
@@ -69,6 +125,7 @@ private:
     void __EditValueUpdated(NumericEdit& sender, double value);
     void __SpinBoxValueUpdated(SpinBox& sender, int value);
     void __Click(Button& sender, bool checked);
+    void __ItemSelected(ComboBox& sender, int itemIndex);
     void __ViewDrag(Control& sender, const Point& pos, const View& view, unsigned modifiers, bool& wantsView);
     void __ViewDrop(Control& sender, const Point& pos, const View& view, unsigned modifiers);
 
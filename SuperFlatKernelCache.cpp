@@ -0,0 +1,131 @@
+#include <pcl/VariableShapeFilter.h>
+
+#include "SuperFlatKernelCache.h"
+
+namespace pcl
+{
+
+SuperFlatKernelCache::SuperFlatKernelCache()
+    : m_capacity(size_type(256) << 20)
+    , m_bytes(0)
+    , m_clock(0)
+    , m_hits(0)
+    , m_misses(0)
+{
+}
+
+SuperFlatKernelCache::~SuperFlatKernelCache()
+{
+    m_entries.Destroy();
+}
+
+void SuperFlatKernelCache::Convolve(ImageVariant& image, float sigma, float shape)
+{
+    // FFTConvolution is parallel on its own.
+    Entry* entry = Acquire(image, sigma, shape);
+    try {
+        entry->convolution >> image;
+    } catch (...) {
+        Release(entry);
+        throw;
+    }
+    Release(entry);
+}
+
+SuperFlatKernelCache::Entry* SuperFlatKernelCache::Acquire(const ImageVariant& image, float sigma, float shape)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    Entry* entry = nullptr;
+    for (Entry& e : m_entries)
+        if (!e.inUse && !e.dropped && (e.width == image.Width()) && (e.height == image.Height())
+            && (e.bitsPerSample == image.BitsPerSample()) && (e.sigma == sigma) && (e.shape == shape)) {
+            entry = &e;
+            break;
+        }
+
+    if (entry != nullptr) {
+        m_hits++;
+    } else {
+        m_misses++;
+        VariableShapeFilter H(sigma, shape, 0.01f, 1.0f, 0.0f);
+        entry = new Entry(H);
+        entry->width = image.Width();
+        entry->height = image.Height();
+        entry->bitsPerSample = image.BitsPerSample();
+        entry->sigma = sigma;
+        entry->shape = shape;
+        // The transform covers the image padded with the kernel, in complex samples of the image's precision.
+        entry->bytes = size_type(image.Width() + H.Size()) * size_type(image.Height() + H.Size()) * 2 * (image.BitsPerSample() >> 3);
+        m_entries << entry;
+        m_bytes += entry->bytes;
+    }
+    entry->lastUse = ++m_clock;
+    entry->inUse = true;
+    return entry;
+}
+
+void SuperFlatKernelCache::Release(Entry* entry)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    entry->inUse = false;
+    if (entry->dropped)
+        Destroy(entry);
+    Evict();
+}
+
+void SuperFlatKernelCache::SetCapacity(size_type bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_capacity = bytes;
+    Evict();
+}
+
+void SuperFlatKernelCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_type i = m_entries.Length(); i > 0; i--) {
+        Entry* entry = &m_entries[i - 1];
+        if (entry->inUse)
+            entry->dropped = true;
+        else
+            Destroy(entry);
+    }
+}
+
+size_type SuperFlatKernelCache::Hits() const
+{
+    return m_hits;
+}
+
+size_type SuperFlatKernelCache::Misses() const
+{
+    return m_misses;
+}
+
+void SuperFlatKernelCache::Destroy(Entry* entry)
+{
+    for (size_type i = 0; i < m_entries.Length(); i++)
+        if (&m_entries[i] == entry) {
+            m_bytes -= entry->bytes;
+            m_entries.Destroy(m_entries.At(i));
+            break;
+        }
+}
+
+void SuperFlatKernelCache::Evict()
+{
+    // The entry just used is the most recent one, so it is only dropped if it does not fit on its own. Pinned entries
+    // are left for their convolutions to release.
+    while (m_bytes > m_capacity) {
+        Entry* oldest = nullptr;
+        for (Entry& e : m_entries)
+            if (!e.inUse && ((oldest == nullptr) || (e.lastUse < oldest->lastUse)))
+                oldest = &e;
+        if (oldest == nullptr)
+            break;
+        Destroy(oldest);
+    }
+}
+
+}	// namespace pcl
@@ -0,0 +1,76 @@
+#ifndef __SuperFlatKernelCache_h
+#define __SuperFlatKernelCache_h
+
+#include <mutex>
+
+#include <pcl/FFTConvolution.h>
+#include <pcl/ImageVariant.h>
+#include <pcl/ReferenceArray.h>
+
+namespace pcl
+{
+
+// FFT convolutions kept alive for the whole life of the module. An FFTConvolution keeps the transform of its kernel
+// for as long as it is applied to images of the same geometry, so reusing the object for every image of the same size
+// and sample type, with the same kernel, skips the kernel transform of all but the first convolution: across the
+// channels, the stages, the executions and the frames of a batch. The least recently used entries are dropped when the
+// estimated size of the cached transforms exceeds the capacity.
+//
+// The lock is only held to find, insert and release entries, so that concurrent frames convolve in parallel. An entry is
+// pinned while a convolution uses it: it is neither evicted nor shared, as an FFTConvolution keeps the state of the
+// image it is applied to, and a concurrent convolution with the same kernel gets an entry of its own.
+class SuperFlatKernelCache
+{
+public:
+    SuperFlatKernelCache();
+    ~SuperFlatKernelCache();
+
+    // Convolves image with VariableShapeFilter(sigma, shape, 0.01, 1, 0).
+    void Convolve(ImageVariant& image, float sigma, float shape);
+
+    void SetCapacity(size_type bytes);
+    void Clear();
+
+    size_type Hits() const;
+    size_type Misses() const;
+
+private:
+    struct Entry
+    {
+        int width;
+        int height;
+        int bitsPerSample;
+        float sigma;
+        float shape;
+        size_type bytes;
+        uint64 lastUse;
+        // Pinned by a convolution, and to be destroyed once it is released, after Clear().
+        bool inUse;
+        bool dropped;
+        FFTConvolution convolution;
+
+        Entry(const KernelFilter& filter)
+            : inUse(false)
+            , dropped(false)
+            , convolution(filter)
+        {
+        }
+    };
+
+    ReferenceArray<Entry> m_entries;
+    std::mutex m_mutex;
+    size_type m_capacity;
+    size_type m_bytes;
+    uint64 m_clock;
+    size_type m_hits;
+    size_type m_misses;
+
+    Entry* Acquire(const ImageVariant& image, float sigma, float shape);
+    void Release(Entry* entry);
+    void Destroy(Entry* entry);
+    void Evict();
+};
+
+}	// namespace pcl
+
+#endif	// __SuperFlatKernelCache_h
@@ -0,0 +1,153 @@
+#include <cstring>
+#include <pcl/Math.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "SuperFlatMask.h"
+
+namespace pcl
+{
+
+static inline int PopCount(uint64 w)
+{
+#ifdef _MSC_VER
+    return int(__popcnt64(w));
+#else
+    return __builtin_popcountll(w);
+#endif
+}
+
+template <class P>
+static void BinarizeImage(SuperFlatMask& mask, const GenericImage<P>& image, double threshold)
+{
+    for (int c = 0; c < image.NumberOfChannels(); c++)
+        for (int y = 0; y < image.Height(); y++) {
+            const typename P::sample* p = image.ScanLine(y, c);
+            uint64* row = mask.Row(y, c);
+            for (int x = 0; x < image.Width(); x++)
+                if (p[x] >= threshold)
+                    row[x >> 6] |= uint64(1) << (x & 63);
+        }
+}
+
+SuperFlatMask::SuperFlatMask()
+    : m_width(0)
+    , m_height(0)
+    , m_channels(0)
+    , m_words(0)
+{
+}
+
+SuperFlatMask::SuperFlatMask(int width, int height, int numberOfChannels)
+    : m_width(width)
+    , m_height(height)
+    , m_channels(numberOfChannels)
+    , m_words((width + 63) >> 6)
+    , m_bits(size_type(m_words) * height * numberOfChannels, uint64(0))
+{
+}
+
+void SuperFlatMask::Binarize(const ImageVariant& image, double threshold)
+{
+    *this = SuperFlatMask(image.Width(), image.Height(), image.NumberOfChannels());
+    if (image.BitsPerSample() == 32)
+        BinarizeImage(*this, static_cast<const Image&>(*image), threshold);
+    else if (image.BitsPerSample() == 64)
+        BinarizeImage(*this, static_cast<const DImage&>(*image), threshold);
+}
+
+void SuperFlatMask::SetRow(int y, int channel, const uint8* values)
+{
+    uint64* row = Row(y, channel);
+    for (int i = 0; i < m_words; i++)
+        row[i] = 0;
+    for (int x = 0; x < m_width; x++)
+        if (values[x] != 0)
+            row[x >> 6] |= uint64(1) << (x & 63);
+}
+
+void SuperFlatMask::SetSpan(int y, int channel, int x0, int x1)
+{
+    x0 = pcl::Max(x0, 0);
+    x1 = pcl::Min(x1, m_width);
+    if (x0 >= x1)
+        return;
+    uint64* row = Row(y, channel);
+    const int first = x0 >> 6;
+    const int last = (x1 - 1) >> 6;
+    const uint64 head = ~uint64(0) << (x0 & 63);
+    const uint64 tail = ~uint64(0) >> (63 - ((x1 - 1) & 63));
+    if (first == last) {
+        row[first] |= head & tail;
+        return;
+    }
+    row[first] |= head;
+    for (int i = first + 1; i < last; i++)
+        row[i] = ~uint64(0);
+    row[last] |= tail;
+}
+
+SuperFlatMask SuperFlatMask::Median() const
+{
+    SuperFlatMask result(m_width, m_height, m_channels);
+    const int last = (m_width - 1) & 63;
+    for (int c = 0; c < m_channels; c++)
+        for (int y = 0; y < m_height; y++) {
+            const uint64* rows[3] = { Row(pcl::Max(y - 1, 0), c), Row(y, c), Row(pcl::Min(y + 1, m_height - 1), c) };
+            uint64* out = result.Row(y, c);
+            for (int i = 0; i < m_words; i++) {
+                // Two bit sums of the three pixels of each row around every pixel of the word.
+                uint64 s0[3], s1[3];
+                for (int k = 0; k < 3; k++) {
+                    const uint64* p = rows[k];
+                    const uint64 l = (p[i] << 1) | ((i > 0) ? p[i - 1] >> 63 : p[0] & 1);
+                    uint64 r = (p[i] >> 1) | ((i + 1 < m_words) ? p[i + 1] << 63 : 0);
+                    if (i == m_words - 1)
+                        r |= p[i] & (uint64(1) << last);
+                    const uint64 m = p[i];
+                    s0[k] = l ^ m ^ r;
+                    s1[k] = (l & m) | (r & (l ^ m));
+                }
+                // Three bit sum of the first two rows, then four bit sum with the third one.
+                const uint64 a0 = s0[0] ^ s0[1];
+                const uint64 ac = s0[0] & s0[1];
+                const uint64 a1 = s1[0] ^ s1[1] ^ ac;
+                const uint64 a2 = (s1[0] & s1[1]) | (ac & (s1[0] ^ s1[1]));
+                const uint64 b0 = a0 ^ s0[2];
+                const uint64 bc0 = a0 & s0[2];
+                const uint64 b1 = a1 ^ s1[2] ^ bc0;
+                const uint64 bc1 = (a1 & s1[2]) | (bc0 & (a1 ^ s1[2]));
+                const uint64 b2 = a2 ^ bc1;
+                const uint64 b3 = a2 & bc1;
+                // At least five of nine.
+                out[i] = b3 | (b2 & (b1 | b0));
+            }
+            out[m_words - 1] &= LastWordMask();
+        }
+    return result;
+}
+
+SuperFlatMask& SuperFlatMask::AndNot(const SuperFlatMask& mask)
+{
+    for (size_type i = 0; i < m_bits.Length(); i++)
+        m_bits[i] &= ~mask.m_bits[i];
+    return *this;
+}
+
+size_type SuperFlatMask::Count() const
+{
+    size_type count = 0;
+    for (uint64 w : m_bits)
+        count += PopCount(w);
+    return count;
+}
+
+bool SuperFlatMask::operator==(const SuperFlatMask& mask) const
+{
+    return (mask.m_width == m_width) && (mask.m_height == m_height) && (mask.m_channels == m_channels)
+           && (::memcmp(mask.m_bits.Begin(), m_bits.Begin(), m_bits.Length() * sizeof(uint64)) == 0);
+}
+
+}	// namespace pcl
@@ -0,0 +1,97 @@
+#ifndef __SuperFlatMask_h
+#define __SuperFlatMask_h
+
+#include <pcl/Array.h>
+#include <pcl/ImageVariant.h>
+
+namespace pcl
+{
+
+// Binary image of one bit per pixel, for the masks of the pipeline. Bit x % 64 of word x / 64 of a row holds pixel x.
+// Every row starts on a word of its own, and the bits past the end of a row are kept at zero, so that masks can be
+// combined and counted a word at a time, and different rows can be written by different threads.
+class SuperFlatMask
+{
+public:
+    SuperFlatMask();
+    SuperFlatMask(int width, int height, int numberOfChannels);
+
+    int Width() const
+    {
+        return m_width;
+    }
+
+    int Height() const
+    {
+        return m_height;
+    }
+
+    int NumberOfChannels() const
+    {
+        return m_channels;
+    }
+
+    int WordsPerRow() const
+    {
+        return m_words;
+    }
+
+    uint64* Row(int y, int channel)
+    {
+        return m_bits.At((size_type(channel) * m_height + y) * m_words);
+    }
+
+    const uint64* Row(int y, int channel) const
+    {
+        return m_bits.At((size_type(channel) * m_height + y) * m_words);
+    }
+
+    bool operator()(int x, int y, int channel) const
+    {
+        return ((Row(y, channel)[x >> 6] >> (x & 63)) & 1) != 0;
+    }
+
+    // A mask of the geometry of image, set where its samples are at or above threshold, as ImageVariant::Binarize()
+    // would leave them at one.
+    void Binarize(const ImageVariant& image, double threshold);
+
+    // Writes row y of channel from the nonzero bytes of values.
+    void SetRow(int y, int channel, const uint8* values);
+
+    // Sets the pixels [x0, x1) of row y of channel, a word at a time. The span is clipped to the row.
+    void SetSpan(int y, int channel, int x0, int x1);
+
+    // The 3x3 median with the edges extended, which for a binary image is the majority of the nine pixels. It is
+    // computed with bitwise adders, 64 pixels at a time.
+    SuperFlatMask Median() const;
+
+    // Clears the pixels set in mask.
+    SuperFlatMask& AndNot(const SuperFlatMask& mask);
+
+    // Number of pixels set.
+    size_type Count() const;
+
+    bool operator==(const SuperFlatMask& mask) const;
+
+    size_type Bytes() const
+    {
+        return m_bits.Length() * sizeof(uint64);
+    }
+
+private:
+    int m_width;
+    int m_height;
+    int m_channels;
+    int m_words;
+    Array<uint64> m_bits;
+
+    // The bits of the last word of a row that belong to pixels.
+    uint64 LastWordMask() const
+    {
+        return ((m_width & 63) != 0) ? (uint64(1) << (m_width & 63)) - 1 : ~uint64(0);
+    }
+};
+
+}	// namespace pcl
+
+#endif	// __SuperFlatMask_h
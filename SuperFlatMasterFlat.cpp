@@ -0,0 +1,154 @@
+#include <cstring>
+#include <pcl/Image.h>
+#include <pcl/Math.h>
+
+#include "SuperFlatMask.h"
+#include "SuperFlatMasterFlat.h"
+
+namespace pcl
+{
+
+// The samples of model divided by the sky level of their channel, in channel, row, column order.
+template <class P>
+static void ScaleModel(const GenericImage<P>& model, const Array<double>& skyLevels, float* values)
+{
+    for (int c = 0; c < model.NumberOfChannels(); c++) {
+        const double scale = (skyLevels[c] > 0) ? 1 / skyLevels[c] : 1.0;
+        for (const typename P::sample* f = model.PixelData(c), * end = f + model.NumberOfPixels(); f < end; f++)
+            *values++ = float(*f * scale);
+    }
+}
+
+SuperFlatMasterFlat::SuperFlatMasterFlat()
+    : m_width(0)
+    , m_height(0)
+    , m_channels(0)
+    , m_frames(0)
+    , m_samples(0)
+    , m_clipped(0)
+    , m_next(0)
+{
+}
+
+SuperFlatMasterFlat::~SuperFlatMasterFlat()
+{
+    for (Model* model : m_pending)
+        delete model;
+}
+
+void SuperFlatMasterFlat::Add(size_type index, const ImageVariant& model, const SuperFlatMask& sky, const Array<double>& skyLevels)
+{
+    // Scaling needs no lock, and leaves the model free for the caller to release.
+    Model* m = new Model;
+    m->index = index;
+    m->width = model.Width();
+    m->height = model.Height();
+    m->channels = model.NumberOfChannels();
+    m->values = Array<float>(size_type(m->width) * m->height * m->channels);
+    m->sky = sky;
+    if (model.BitsPerSample() == 32)
+        ScaleModel(static_cast<const pcl::Image&>(*model), skyLevels, m->values.Begin());
+    else if (model.BitsPerSample() == 64)
+        ScaleModel(static_cast<const DImage&>(*model), skyLevels, m->values.Begin());
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pending << m;
+    Flush();
+}
+
+void SuperFlatMasterFlat::Skip(size_type index)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (index < m_next)
+        return;
+    for (const Model* model : m_pending)
+        if (model->index == index)
+            return;
+    Model* m = new Model;
+    m->index = index;
+    m->width = m->height = m->channels = 0;
+    m_pending << m;
+    Flush();
+}
+
+Array<size_type> SuperFlatMasterFlat::Rejected() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_rejected;
+}
+
+void SuperFlatMasterFlat::Flush()
+{
+    for (bool found = true; found;) {
+        found = false;
+        for (Array<Model*>::iterator i = m_pending.Begin(); i != m_pending.End(); ++i)
+            if ((*i)->index == m_next) {
+                Model* model = *i;
+                m_pending.Remove(i);
+                if (!model->values.IsEmpty())
+                    Combine(*model);
+                delete model;
+                m_next++;
+                found = true;
+                break;
+            }
+    }
+}
+
+// Weighted running mean and variance of West (1979). The values of the samples that have enough weight are clipped to
+// their limits rather than dropped, so that the variance is not made smaller by the clipping itself.
+void SuperFlatMasterFlat::Combine(const Model& model)
+{
+    if (m_frames == 0) {
+        m_width = model.width;
+        m_height = model.height;
+        m_channels = model.channels;
+        const size_type samples = size_type(m_width) * m_height * m_channels;
+        m_weight = Array<float>(samples, 0.0f);
+        m_mean = Array<float>(samples, 0.0f);
+        m_m2 = Array<float>(samples, 0.0f);
+    } else if ((model.width != m_width) || (model.height != m_height) || (model.channels != m_channels)) {
+        m_rejected << model.index;
+        return;
+    }
+
+    for (int c = 0; c < m_channels; c++)
+        for (int y = 0; y < m_height; y++) {
+            const size_type offset = (size_type(c) * m_height + y) * m_width;
+            const float* f = model.values.At(offset);
+            const uint64* s = model.sky.Row(y, c);
+            float* W = m_weight.At(offset);
+            float* M = m_mean.At(offset);
+            float* M2 = m_m2.At(offset);
+            for (int x = 0; x < m_width; x++) {
+                float value = f[x];
+                if (W[x] >= MinimumWeight) {
+                    const float limit = ClipSigma * pcl::Max(pcl::Sqrt(M2[x] / W[x]), MinimumDeviation * pcl::Abs(M[x]));
+                    if (pcl::Abs(value - M[x]) > limit) {
+                        value = (value > M[x]) ? M[x] + limit : M[x] - limit;
+                        m_clipped++;
+                    }
+                }
+                const float delta = value - M[x];
+                const float w = (((s[x >> 6] >> (x & 63)) & 1) != 0) ? 1.0f : NonSkyWeight;
+                W[x] += w;
+                M[x] += delta * w / W[x];
+                M2[x] += w * delta * (value - M[x]);
+            }
+        }
+    m_samples += m_mean.Length();
+    m_frames++;
+}
+
+ImageVariant SuperFlatMasterFlat::Image() const
+{
+    ImageVariant image;
+    image.CreateFloatImage(32);
+    image.AllocateImage(m_width, m_height, m_channels, (m_channels == 3) ? ColorSpace::RGB : ColorSpace::Gray);
+    pcl::Image& master = static_cast<pcl::Image&>(*image);
+    for (int c = 0; c < m_channels; c++)
+        ::memcpy(master.PixelData(c), m_mean.At(size_type(c) * m_width * m_height), size_type(m_width) * m_height * sizeof(float));
+    return image;
+}
+
+}	// namespace pcl
@@ -0,0 +1,103 @@
+#ifndef __SuperFlatMasterFlat_h
+#define __SuperFlatMasterFlat_h
+
+#include <mutex>
+
+#include <pcl/Array.h>
+#include <pcl/ImageVariant.h>
+
+#include "SuperFlatMask.h"
+
+namespace pcl
+{
+
+// Master flat combined from the sky models of many frames as they are made. Every model is divided by its sky levels
+// and added to a running weighted mean and variance of each sample: the sky pixels of the frame count fully, and the
+// inpainted pixels with NonSkyWeight, so that where an object covers a pixel in some frames the others decide it. Once
+// a sample has the weight of MinimumWeight frames, values further than ClipSigma standard deviations from its mean are
+// clipped to that distance, a running winsorized mean. The running sums take three floats per sample of the model,
+// whatever the number of frames.
+//
+// The clipping makes the result depend on the order of the models, so they are combined in the order of their frame
+// indices, whatever the order concurrent frames finish in: a model that arrives before those of earlier frames is kept,
+// scaled to 32 bits, until they have been added or skipped. Those pending copies are bounded only by how far ahead of
+// the oldest unfinished frame the caller lets frames run, which for a batch is the number of frames it holds in memory.
+class SuperFlatMasterFlat
+{
+public:
+    static constexpr float NonSkyWeight = 0.01f;
+    static constexpr float MinimumWeight = 3;
+    static constexpr float ClipSigma = 3;
+    // Deviations below this fraction of the mean are never clipped, so that a run of nearly identical frames does
+    // not clip every later one.
+    static constexpr float MinimumDeviation = 1.0e-3f;
+
+    SuperFlatMasterFlat();
+
+    SuperFlatMasterFlat(const SuperFlatMasterFlat&) = delete;
+    ~SuperFlatMasterFlat();
+
+    // Adds model, the sky model of frame index whose sky pixels are those set in sky, divided by the sky level of each
+    // channel. A model without the geometry of the first frame combined is left out. Models of concurrent frames may be
+    // added from different threads; every index from zero on must be added or skipped.
+    void Add(size_type index, const ImageVariant& model, const SuperFlatMask& sky, const Array<double>& skyLevels);
+
+    // Leaves frame index out of the master flat, unless its model has already been added.
+    void Skip(size_type index);
+
+    // Frames left out because their model has another geometry than the first one, in order.
+    Array<size_type> Rejected() const;
+
+    // The running mean of every sample, a 32-bit image at the resolution of the models.
+    ImageVariant Image() const;
+
+    int Frames() const
+    {
+        return m_frames;
+    }
+
+    // Samples added and clipped, over all frames.
+    size_type Samples() const
+    {
+        return m_samples;
+    }
+
+    size_type Clipped() const
+    {
+        return m_clipped;
+    }
+
+private:
+    // A model waiting for those of earlier frames, or a frame skipped, with no values.
+    struct Model
+    {
+        size_type index;
+        int width;
+        int height;
+        int channels;
+        Array<float> values;
+        SuperFlatMask sky;
+    };
+
+    mutable std::mutex m_mutex;
+    int m_width;
+    int m_height;
+    int m_channels;
+    int m_frames;
+    size_type m_samples;
+    size_type m_clipped;
+    Array<float> m_weight;
+    Array<float> m_mean;
+    Array<float> m_m2;
+    // Index of the next frame to combine, and the frames added or skipped after it, in no particular order.
+    size_type m_next;
+    Array<Model*> m_pending;
+    Array<size_type> m_rejected;
+
+    void Combine(const Model& model);
+    void Flush();
+};
+
+}	// namespace pcl
+
+#endif	// __SuperFlatMasterFlat_h
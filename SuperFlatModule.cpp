@@ -11,12 +11,16 @@
 #include "SuperFlatModule.h"
 #include "SuperFlatProcess.h"
 #include "SuperFlatInterface.h"
+#include "SuperFlatSelfTest.h"
 
 namespace pcl
 {
 
+SuperFlatModule* TheSuperFlatModule = nullptr;
+
 SuperFlatModule::SuperFlatModule()
 {
+    TheSuperFlatModule = this;
 }
 
 const char* SuperFlatModule::Version() const
@@ -81,6 +85,28 @@ void SuperFlatModule::GetReleaseDate(int& year, int& month, int& day) const
     day = MODULE_RELEASE_DAY;
 }
 
+void SuperFlatModule::OnUnload()
+{
+    m_threadPool.Shutdown();
+    m_kernelCache.Clear();
+    m_stageCache.Clear();
+}
+
+SuperFlatThreadPool& SuperFlatModule::ThreadPool()
+{
+    return m_threadPool;
+}
+
+SuperFlatKernelCache& SuperFlatModule::KernelCache()
+{
+    return m_kernelCache;
+}
+
+SuperFlatStageCache& SuperFlatModule::StageCache()
+{
+    return m_stageCache;
+}
+
 }   // namespace pcl
 
 PCL_MODULE_EXPORT int InstallPixInsightModule(int mode)
@@ -90,6 +116,10 @@ PCL_MODULE_EXPORT int InstallPixInsightModule(int mode)
     if (mode == pcl::InstallMode::FullInstall) {
         new pcl::SuperFlatProcess;
         new pcl::SuperFlatInterface;
+#ifdef SUPERFLAT_SELF_TEST
+        if (!pcl::SuperFlatSelfTest::Run())
+            return -1;
+#endif
     }
 
     return 0;
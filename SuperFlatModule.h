@@ -3,6 +3,10 @@
 
 #include <pcl/MetaModule.h>
 
+#include "SuperFlatKernelCache.h"
+#include "SuperFlatStageCache.h"
+#include "SuperFlatThreadPool.h"
+
 namespace pcl
 {
 
@@ -20,8 +24,22 @@ public:
     String TradeMarks() const override;
     String OriginalFileName() const override;
     void GetReleaseDate(int& year, int& month, int& day) const override;
+    void OnUnload() override;
+
+    SuperFlatThreadPool& ThreadPool();
+    SuperFlatKernelCache& KernelCache();
+    SuperFlatStageCache& StageCache();
+
+private:
+    SuperFlatThreadPool m_threadPool;
+    SuperFlatKernelCache m_kernelCache;
+    SuperFlatStageCache m_stageCache;
 };
 
+PCL_BEGIN_LOCAL
+extern SuperFlatModule* TheSuperFlatModule;
+PCL_END_LOCAL
+
 }   // namespace pcl
 
 #endif  // __SuperFlatModule_h
\ No newline at end of file
@@ -10,6 +10,23 @@ SFSmoothness* TheSFSmoothnessParameter = nullptr;
 SFGenerateSkyMask* TheSFGenerateSkyMaskParameter = nullptr;
 SFTestSkyDetection* TheSFTestSkyDetectionParameter = nullptr;
 SFDownsample* TheSFDownsampleParameter = nullptr;
+SFInpaintingMethod* TheSFInpaintingMethodParameter = nullptr;
+SFExactInpainting* TheSFExactInpaintingParameter = nullptr;
+SFModelingMethod* TheSFModelingMethodParameter = nullptr;
+SFRayCount* TheSFRayCountParameter = nullptr;
+SFSmoothingMethod* TheSFSmoothingMethodParameter = nullptr;
+SFApplyMode* TheSFApplyModeParameter = nullptr;
+SFUseSplineGrid* TheSFUseSplineGridParameter = nullptr;
+SFMaxThreads* TheSFMaxThreadsParameter = nullptr;
+SFStageCacheSize* TheSFStageCacheSizeParameter = nullptr;
+SFNonSkyMaskViewId* TheSFNonSkyMaskViewIdParameter = nullptr;
+SFStarCatalogFile* TheSFStarCatalogFileParameter = nullptr;
+SFSplineGridFile* TheSFSplineGridFileParameter = nullptr;
+SFTargetFrames* TheSFTargetFramesParameter = nullptr;
+SFTargetFramePath* TheSFTargetFramePathParameter = nullptr;
+SFOutputDirectory* TheSFOutputDirectoryParameter = nullptr;
+SFOutputPostfix* TheSFOutputPostfixParameter = nullptr;
+SFMasterFlatFile* TheSFMasterFlatFileParameter = nullptr;
 
 SFSkyDetectionThreshold::SFSkyDetectionThreshold(MetaProcess* P) : MetaFloat(P)
 {
@@ -181,4 +198,357 @@ double SFDownsample::MaximumValue() const
     return 16;
 }
 
+SFInpaintingMethod::SFInpaintingMethod(MetaProcess* P) : MetaEnumeration(P)
+{
+    TheSFInpaintingMethodParameter = this;
+}
+
+IsoString SFInpaintingMethod::Id() const
+{
+    return "inpaintingMethod";
+}
+
+size_type SFInpaintingMethod::NumberOfElements() const
+{
+    return NumberOfItems;
+}
+
+IsoString SFInpaintingMethod::ElementId(size_type i) const
+{
+    switch (i) {
+    default:
+    case RayMarching:
+        return "RayMarching";
+    case DistanceTransform:
+        return "DistanceTransform";
+    case Multigrid:
+        return "Multigrid";
+    }
+}
+
+int SFInpaintingMethod::ElementValue(size_type i) const
+{
+    return int(i);
+}
+
+size_type SFInpaintingMethod::DefaultValueIndex() const
+{
+    return size_type(Default);
+}
+
+SFExactInpainting::SFExactInpainting(MetaProcess* P) : MetaBoolean(P)
+{
+    TheSFExactInpaintingParameter = this;
+}
+
+IsoString SFExactInpainting::Id() const
+{
+    return "exactInpainting";
+}
+
+bool SFExactInpainting::DefaultValue() const
+{
+    return false;
+}
+
+SFModelingMethod::SFModelingMethod(MetaProcess* P) : MetaEnumeration(P)
+{
+    TheSFModelingMethodParameter = this;
+}
+
+IsoString SFModelingMethod::Id() const
+{
+    return "modelingMethod";
+}
+
+size_type SFModelingMethod::NumberOfElements() const
+{
+    return NumberOfItems;
+}
+
+IsoString SFModelingMethod::ElementId(size_type i) const
+{
+    switch (i) {
+    default:
+    case InpaintAndSmooth:
+        return "InpaintAndSmooth";
+    case NormalizedConvolution:
+        return "NormalizedConvolution";
+    }
+}
+
+int SFModelingMethod::ElementValue(size_type i) const
+{
+    return int(i);
+}
+
+size_type SFModelingMethod::DefaultValueIndex() const
+{
+    return size_type(Default);
+}
+
+SFRayCount::SFRayCount(MetaProcess* P) : MetaEnumeration(P)
+{
+    TheSFRayCountParameter = this;
+}
+
+IsoString SFRayCount::Id() const
+{
+    return "rayCount";
+}
+
+size_type SFRayCount::NumberOfElements() const
+{
+    return NumberOfItems;
+}
+
+IsoString SFRayCount::ElementId(size_type i) const
+{
+    switch (i) {
+    case Rays8:
+        return "Rays8";
+    case Rays16:
+        return "Rays16";
+    default:
+    case Rays32:
+        return "Rays32";
+    case Rays64:
+        return "Rays64";
+    }
+}
+
+int SFRayCount::ElementValue(size_type i) const
+{
+    return int(i);
+}
+
+size_type SFRayCount::DefaultValueIndex() const
+{
+    return size_type(Default);
+}
+
+SFSmoothingMethod::SFSmoothingMethod(MetaProcess* P) : MetaEnumeration(P)
+{
+    TheSFSmoothingMethodParameter = this;
+}
+
+IsoString SFSmoothingMethod::Id() const
+{
+    return "smoothingMethod";
+}
+
+size_type SFSmoothingMethod::NumberOfElements() const
+{
+    return NumberOfItems;
+}
+
+IsoString SFSmoothingMethod::ElementId(size_type i) const
+{
+    switch (i) {
+    default:
+    case Convolution:
+        return "Convolution";
+    case Multiresolution:
+        return "Multiresolution";
+    }
+}
+
+int SFSmoothingMethod::ElementValue(size_type i) const
+{
+    return int(i);
+}
+
+size_type SFSmoothingMethod::DefaultValueIndex() const
+{
+    return size_type(Default);
+}
+
+SFApplyMode::SFApplyMode(MetaProcess* P) : MetaEnumeration(P)
+{
+    TheSFApplyModeParameter = this;
+}
+
+IsoString SFApplyMode::Id() const
+{
+    return "applyMode";
+}
+
+size_type SFApplyMode::NumberOfElements() const
+{
+    return NumberOfItems;
+}
+
+IsoString SFApplyMode::ElementId(size_type i) const
+{
+    switch (i) {
+    default:
+    case CreateModel:
+        return "CreateModel";
+    case Divide:
+        return "Divide";
+    case Subtract:
+        return "Subtract";
+    }
+}
+
+int SFApplyMode::ElementValue(size_type i) const
+{
+    return int(i);
+}
+
+size_type SFApplyMode::DefaultValueIndex() const
+{
+    return size_type(Default);
+}
+
+SFUseSplineGrid::SFUseSplineGrid(MetaProcess* P) : MetaBoolean(P)
+{
+    TheSFUseSplineGridParameter = this;
+}
+
+IsoString SFUseSplineGrid::Id() const
+{
+    return "useSplineGrid";
+}
+
+bool SFUseSplineGrid::DefaultValue() const
+{
+    return false;
+}
+
+SFMaxThreads::SFMaxThreads(MetaProcess* P) : MetaUInt32(P)
+{
+    TheSFMaxThreadsParameter = this;
+}
+
+IsoString SFMaxThreads::Id() const
+{
+    return "maxThreads";
+}
+
+double SFMaxThreads::DefaultValue() const
+{
+    return 0;
+}
+
+double SFMaxThreads::MinimumValue() const
+{
+    return 0;
+}
+
+double SFMaxThreads::MaximumValue() const
+{
+    return PCL_MAX_PROCESSORS;
+}
+
+SFStageCacheSize::SFStageCacheSize(MetaProcess* P) : MetaUInt32(P)
+{
+    TheSFStageCacheSizeParameter = this;
+}
+
+IsoString SFStageCacheSize::Id() const
+{
+    return "stageCacheSize";
+}
+
+double SFStageCacheSize::DefaultValue() const
+{
+    return 1024;
+}
+
+double SFStageCacheSize::MinimumValue() const
+{
+    return 0;
+}
+
+double SFStageCacheSize::MaximumValue() const
+{
+    return 65536;
+}
+
+SFNonSkyMaskViewId::SFNonSkyMaskViewId(MetaProcess* P) : MetaString(P)
+{
+    TheSFNonSkyMaskViewIdParameter = this;
+}
+
+IsoString SFNonSkyMaskViewId::Id() const
+{
+    return "nonSkyMaskViewId";
+}
+
+SFStarCatalogFile::SFStarCatalogFile(MetaProcess* P) : MetaString(P)
+{
+    TheSFStarCatalogFileParameter = this;
+}
+
+IsoString SFStarCatalogFile::Id() const
+{
+    return "starCatalogFile";
+}
+
+SFSplineGridFile::SFSplineGridFile(MetaProcess* P) : MetaString(P)
+{
+    TheSFSplineGridFileParameter = this;
+}
+
+IsoString SFSplineGridFile::Id() const
+{
+    return "splineGridFile";
+}
+
+SFTargetFrames::SFTargetFrames(MetaProcess* P) : MetaTable(P)
+{
+    TheSFTargetFramesParameter = this;
+}
+
+IsoString SFTargetFrames::Id() const
+{
+    return "targetFrames";
+}
+
+SFTargetFramePath::SFTargetFramePath(MetaTable* P) : MetaString(P)
+{
+    TheSFTargetFramePathParameter = this;
+}
+
+IsoString SFTargetFramePath::Id() const
+{
+    return "path";
+}
+
+SFOutputDirectory::SFOutputDirectory(MetaProcess* P) : MetaString(P)
+{
+    TheSFOutputDirectoryParameter = this;
+}
+
+IsoString SFOutputDirectory::Id() const
+{
+    return "outputDirectory";
+}
+
+SFOutputPostfix::SFOutputPostfix(MetaProcess* P) : MetaString(P)
+{
+    TheSFOutputPostfixParameter = this;
+}
+
+IsoString SFOutputPostfix::Id() const
+{
+    return "outputPostfix";
+}
+
+String SFOutputPostfix::DefaultValue() const
+{
+    return "_sf";
+}
+
+SFMasterFlatFile::SFMasterFlatFile(MetaProcess* P) : MetaString(P)
+{
+    TheSFMasterFlatFileParameter = this;
+}
+
+IsoString SFMasterFlatFile::Id() const
+{
+    return "masterFlatFile";
+}
+
 }	// namespace pcl
\ No newline at end of file
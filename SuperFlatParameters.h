@@ -98,6 +98,234 @@ public:
 
 extern SFDownsample* TheSFDownsampleParameter;
 
+class SFInpaintingMethod : public MetaEnumeration
+{
+public:
+    enum { RayMarching,
+           DistanceTransform,
+           Multigrid,
+           NumberOfItems,
+           Default = RayMarching };
+
+    SFInpaintingMethod(MetaProcess*);
+
+    IsoString Id() const override;
+    size_type NumberOfElements() const override;
+    IsoString ElementId(size_type) const override;
+    int ElementValue(size_type) const override;
+    size_type DefaultValueIndex() const override;
+};
+
+extern SFInpaintingMethod* TheSFInpaintingMethodParameter;
+
+class SFExactInpainting : public MetaBoolean
+{
+public:
+    SFExactInpainting(MetaProcess*);
+
+    IsoString Id() const override;
+    bool DefaultValue() const override;
+};
+
+extern SFExactInpainting* TheSFExactInpaintingParameter;
+
+class SFModelingMethod : public MetaEnumeration
+{
+public:
+    enum { InpaintAndSmooth,
+           NormalizedConvolution,
+           NumberOfItems,
+           Default = InpaintAndSmooth };
+
+    SFModelingMethod(MetaProcess*);
+
+    IsoString Id() const override;
+    size_type NumberOfElements() const override;
+    IsoString ElementId(size_type) const override;
+    int ElementValue(size_type) const override;
+    size_type DefaultValueIndex() const override;
+};
+
+extern SFModelingMethod* TheSFModelingMethodParameter;
+
+class SFRayCount : public MetaEnumeration
+{
+public:
+    enum { Rays8,
+           Rays16,
+           Rays32,
+           Rays64,
+           NumberOfItems,
+           Default = Rays32 };
+
+    SFRayCount(MetaProcess*);
+
+    IsoString Id() const override;
+    size_type NumberOfElements() const override;
+    IsoString ElementId(size_type) const override;
+    int ElementValue(size_type) const override;
+    size_type DefaultValueIndex() const override;
+};
+
+extern SFRayCount* TheSFRayCountParameter;
+
+class SFSmoothingMethod : public MetaEnumeration
+{
+public:
+    enum { Convolution,
+           Multiresolution,
+           NumberOfItems,
+           Default = Convolution };
+
+    SFSmoothingMethod(MetaProcess*);
+
+    IsoString Id() const override;
+    size_type NumberOfElements() const override;
+    IsoString ElementId(size_type) const override;
+    int ElementValue(size_type) const override;
+    size_type DefaultValueIndex() const override;
+};
+
+extern SFSmoothingMethod* TheSFSmoothingMethodParameter;
+
+class SFApplyMode : public MetaEnumeration
+{
+public:
+    enum { CreateModel,
+           Divide,
+           Subtract,
+           NumberOfItems,
+           Default = CreateModel };
+
+    SFApplyMode(MetaProcess*);
+
+    IsoString Id() const override;
+    size_type NumberOfElements() const override;
+    IsoString ElementId(size_type) const override;
+    int ElementValue(size_type) const override;
+    size_type DefaultValueIndex() const override;
+};
+
+extern SFApplyMode* TheSFApplyModeParameter;
+
+class SFUseSplineGrid : public MetaBoolean
+{
+public:
+    SFUseSplineGrid(MetaProcess*);
+
+    IsoString Id() const override;
+    bool DefaultValue() const override;
+};
+
+extern SFUseSplineGrid* TheSFUseSplineGridParameter;
+
+class SFMaxThreads : public MetaUInt32
+{
+public:
+    SFMaxThreads(MetaProcess*);
+
+    IsoString Id() const override;
+    double DefaultValue() const override;
+    double MinimumValue() const override;
+    double MaximumValue() const override;
+};
+
+extern SFMaxThreads* TheSFMaxThreadsParameter;
+
+class SFStageCacheSize : public MetaUInt32
+{
+public:
+    SFStageCacheSize(MetaProcess*);
+
+    IsoString Id() const override;
+    double DefaultValue() const override;
+    double MinimumValue() const override;
+    double MaximumValue() const override;
+};
+
+extern SFStageCacheSize* TheSFStageCacheSizeParameter;
+
+class SFNonSkyMaskViewId : public MetaString
+{
+public:
+    SFNonSkyMaskViewId(MetaProcess*);
+
+    IsoString Id() const override;
+};
+
+extern SFNonSkyMaskViewId* TheSFNonSkyMaskViewIdParameter;
+
+class SFStarCatalogFile : public MetaString
+{
+public:
+    SFStarCatalogFile(MetaProcess*);
+
+    IsoString Id() const override;
+};
+
+extern SFStarCatalogFile* TheSFStarCatalogFileParameter;
+
+class SFSplineGridFile : public MetaString
+{
+public:
+    SFSplineGridFile(MetaProcess*);
+
+    IsoString Id() const override;
+};
+
+extern SFSplineGridFile* TheSFSplineGridFileParameter;
+
+class SFTargetFrames : public MetaTable
+{
+public:
+    SFTargetFrames(MetaProcess*);
+
+    IsoString Id() const override;
+};
+
+extern SFTargetFrames* TheSFTargetFramesParameter;
+
+class SFTargetFramePath : public MetaString
+{
+public:
+    SFTargetFramePath(MetaTable*);
+
+    IsoString Id() const override;
+};
+
+extern SFTargetFramePath* TheSFTargetFramePathParameter;
+
+class SFOutputDirectory : public MetaString
+{
+public:
+    SFOutputDirectory(MetaProcess*);
+
+    IsoString Id() const override;
+};
+
+extern SFOutputDirectory* TheSFOutputDirectoryParameter;
+
+class SFOutputPostfix : public MetaString
+{
+public:
+    SFOutputPostfix(MetaProcess*);
+
+    IsoString Id() const override;
+    String DefaultValue() const override;
+};
+
+extern SFOutputPostfix* TheSFOutputPostfixParameter;
+
+class SFMasterFlatFile : public MetaString
+{
+public:
+    SFMasterFlatFile(MetaProcess*);
+
+    IsoString Id() const override;
+};
+
+extern SFMasterFlatFile* TheSFMasterFlatFileParameter;
+
 PCL_END_LOCAL
 
 }	// namespace pcl
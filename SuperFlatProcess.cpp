@@ -25,6 +25,23 @@ SuperFlatProcess::SuperFlatProcess()
     new SFDownsample(this);
     new SFGenerateSkyMask(this);
     new SFTestSkyDetection(this);
+    new SFInpaintingMethod(this);
+    new SFExactInpainting(this);
+    new SFModelingMethod(this);
+    new SFRayCount(this);
+    new SFSmoothingMethod(this);
+    new SFApplyMode(this);
+    new SFUseSplineGrid(this);
+    new SFMaxThreads(this);
+    new SFStageCacheSize(this);
+    new SFNonSkyMaskViewId(this);
+    new SFStarCatalogFile(this);
+    new SFSplineGridFile(this);
+    new SFTargetFrames(this);
+    new SFTargetFramePath(TheSFTargetFramesParameter);
+    new SFOutputDirectory(this);
+    new SFOutputPostfix(this);
+    new SFMasterFlatFile(this);
 }
 
 IsoString SuperFlatProcess::Id() const
@@ -102,7 +119,163 @@ bool SuperFlatProcess::NeedsValidation() const
 
 bool SuperFlatProcess::CanProcessCommandLines() const
 {
-    return false;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+
+static void ShowHelp()
+{
+    Console().Write(
+"<raw>"
+"Usage: SuperFlat [<arg_list>] [<file_list>]"
+"\n"
+"\n--threshold=<n>"
+"\n"
+"\n      Sky detection threshold."
+"\n"
+"\n--sensitivity=<n>"
+"\n"
+"\n      Star detection sensitivity."
+"\n"
+"\n--distance=<n>"
+"\n"
+"\n      Object diffusion distance, in pixels."
+"\n"
+"\n--smoothness=<n>"
+"\n"
+"\n      Smoothness of the model."
+"\n"
+"\n--downsample=<n>"
+"\n"
+"\n      Downsampling factor of the model."
+"\n"
+"\n--output=model|divide|subtract"
+"\n"
+"\n      Write the background models of the frames, or the frames divided by"
+"\n      them or with them subtracted. The default is model."
+"\n"
+"\n--apply-grid=<file>"
+"\n"
+"\n      Apply the spline grid of <file> to the frames instead of modeling them,"
+"\n      as selected by --output=divide|subtract."
+"\n"
+"\n-m[+|-], --sky-mask[+|-]"
+"\n"
+"\n      Write the sky mask of every frame too."
+"\n"
+"\n-o=<dir>, --output-directory=<dir>"
+"\n"
+"\n      Directory of the output files. By default, each output file is written"
+"\n      to the directory of its frame."
+"\n"
+"\n--postfix=<text>"
+"\n"
+"\n      Text appended to the names of the output files. The default is _sf."
+"\n"
+"\n--master=<file>"
+"\n"
+"\n      Combine the sky models of all frames into a master flat, written to"
+"\n      <file> at the end of the batch."
+"\n"
+"\n--threads=<n>"
+"\n"
+"\n      Maximum number of worker threads, or zero for all processors."
+"\n"
+"\n--interface"
+"\n"
+"\n      Launches the interface of this process."
+"\n"
+"\n--help"
+"\n"
+"\n      Displays this help and exits."
+"\n"
+"\nThe frames in <file_list> are processed by a global execution, several at a"
+"\ntime when they are small, while the next ones are read and the previous ones"
+"\nwritten."
+"</raw>");
+}
+
+// Value of a numeric argument, within the range of parameter.
+static double ArgumentValue(const Argument& arg, const MetaNumeric* parameter)
+{
+    const double value = arg.NumericValue();
+    if ((value < parameter->MinimumValue()) || (value > parameter->MaximumValue()))
+        throw Error("Argument out of range: " + arg.Token());
+    return value;
+}
+
+int SuperFlatProcess::ProcessCommandLine(const StringList& argv) const
+{
+    ArgumentList arguments = ExtractArguments(argv, ArgumentItemMode::AsImages, ArgumentOption::AllowWildcards);
+
+    SuperFlatInstance instance(this);
+    bool launchInterface = false;
+
+    for (const Argument& arg : arguments) {
+        if (arg.IsNumeric()) {
+            if (arg.Id() == "-threshold")
+                instance.skyDetectionThreshold = ArgumentValue(arg, TheSFSkyDetectionThresholdParameter);
+            else if (arg.Id() == "-sensitivity")
+                instance.starDetectionSensitivity = ArgumentValue(arg, TheSFStarDetectionSensitivityParameter);
+            else if (arg.Id() == "-distance")
+                instance.objectDiffusionDistance = int(ArgumentValue(arg, TheSFObjectDiffusionDistanceParameter));
+            else if (arg.Id() == "-smoothness")
+                instance.smoothness = ArgumentValue(arg, TheSFSmoothnessParameter);
+            else if (arg.Id() == "-downsample")
+                instance.downsample = int(ArgumentValue(arg, TheSFDownsampleParameter));
+            else if (arg.Id() == "-threads")
+                instance.maxThreads = int(ArgumentValue(arg, TheSFMaxThreadsParameter));
+            else
+                throw Error("Unknown numeric argument: " + arg.Token());
+        } else if (arg.IsString()) {
+            if ((arg.Id() == "o") || (arg.Id() == "-output-directory"))
+                instance.outputDirectory = arg.StringValue();
+            else if (arg.Id() == "-postfix")
+                instance.outputPostfix = arg.StringValue();
+            else if (arg.Id() == "-master")
+                instance.masterFlatFile = arg.StringValue();
+            else if (arg.Id() == "-output") {
+                if (arg.StringValue() == "model")
+                    instance.applyMode = SFApplyMode::CreateModel;
+                else if (arg.StringValue() == "divide")
+                    instance.applyMode = SFApplyMode::Divide;
+                else if (arg.StringValue() == "subtract")
+                    instance.applyMode = SFApplyMode::Subtract;
+                else
+                    throw Error("Invalid output: " + arg.Token());
+            } else if (arg.Id() == "-apply-grid") {
+                instance.splineGridFile = arg.StringValue();
+                instance.useSplineGrid = true;
+            } else
+                throw Error("Unknown string argument: " + arg.Token());
+        } else if (arg.IsSwitch()) {
+            if ((arg.Id() == "m") || (arg.Id() == "-sky-mask"))
+                instance.generateSkyMask = arg.SwitchState();
+            else
+                throw Error("Unknown switch argument: " + arg.Token());
+        } else if (arg.IsLiteral()) {
+            if ((arg.Id() == "m") || (arg.Id() == "-sky-mask"))
+                instance.generateSkyMask = true;
+            else if (arg.Id() == "-interface")
+                launchInterface = true;
+            else if (arg.Id() == "-help") {
+                ShowHelp();
+                return 0;
+            } else
+                throw Error("Unknown argument: " + arg.Token());
+        } else if (arg.IsItemList()) {
+            for (const String& item : arg.Items())
+                instance.targetFrames << item;
+        }
+    }
+
+    if (launchInterface || instance.targetFrames.IsEmpty())
+        instance.LaunchInterface();
+    else
+        instance.LaunchGlobal();
+
+    return 0;
 }
 
 }	// namespace pcl
\ No newline at end of file
@@ -21,6 +21,7 @@ public:
     ProcessImplementation* Clone(const ProcessImplementation&) const override;
     bool NeedsValidation() const override;
     bool CanProcessCommandLines() const override;
+    int ProcessCommandLine(const StringList& argv) const override;
 };
 
 PCL_BEGIN_LOCAL
@@ -0,0 +1,166 @@
+#ifndef __SuperFlatRays_h
+#define __SuperFlatRays_h
+
+#include <pcl/Math.h>
+
+#include "SuperFlatSIMD.h"
+
+namespace pcl
+{
+
+// Unit steps up to 16 pixels, then 10% longer at each step.
+struct SuperFlatGeometricSteps
+{
+    static constexpr int Next(int j)
+    {
+        return (j < 16) ? j + 1 : int(j * 1.1f);
+    }
+};
+
+// Directions, steps and 1/distance weights of N rays. The directions are computed at static initialization in single
+// precision with pcl::Cos() and pcl::Sin(), as the original per-pixel kernel computed them, so that rays sample the
+// same pixels as it did.
+template <int N, class S = SuperFlatGeometricSteps>
+class SuperFlatRayTable
+{
+public:
+    static constexpr int MaxDistance = 1 << 20;
+    static constexpr int NumberOfSteps = []() {
+        int n = 0;
+        for (int j = 1; j < MaxDistance; j = S::Next(j))
+            n++;
+        return n;
+    }();
+
+    // Odd rays only start marching at this distance.
+    static constexpr int FarDistance = 64;
+
+    float dx[N] = {};
+    float dy[N] = {};
+    int step[NumberOfSteps] = {};
+    float weight[NumberOfSteps] = {};
+    int firstFarStep = 0;
+
+    SuperFlatRayTable()
+    {
+        for (int i = 0; i < N; i++) {
+            const float rad = pcl::Pi() * 2.0f * i / N;
+            dx[i] = pcl::Cos(rad);
+            dy[i] = pcl::Sin(rad);
+        }
+        int k = 0;
+        for (int j = 1; j < MaxDistance; j = S::Next(j), k++) {
+            step[k] = j;
+            weight[k] = 1.0f / float(j);
+            if (j < FarDistance)
+                firstFarStep = k + 1;
+        }
+    }
+
+    int StepsWithin(int distance) const
+    {
+        int k = 0;
+        while ((k < NumberOfSteps) && (step[k] < distance))
+            k++;
+        return k;
+    }
+};
+
+template <int N, class S = SuperFlatGeometricSteps>
+struct SuperFlatRays
+{
+    static inline const SuperFlatRayTable<N, S> table;
+};
+
+// Marches all the rays of the table from pixel (x, y) and returns the 1/distance weighted mean of the first sky sample
+// (any nonzero sample) met along each ray. Rays whose weight falls below 1% of the accumulated weight are abandoned.
+template <class T, int N, class S>
+inline T MarchRays(const T* input, int width, int height, int x, int y, int numberOfSteps)
+{
+    const SuperFlatRayTable<N, S>& rays = SuperFlatRays<N, S>::table;
+    T p = 0;
+    float w0 = 0.0f;
+    for (int i = 0; i < N; i++) {
+        for (int k = (i % 2 != 0) ? rays.firstFarStep : 0; k < numberOfSteps; k++) {
+            const float w = rays.weight[k];
+            if (w < w0 * 0.01f)
+                break;
+            const int j = rays.step[k];
+            const int ix = pcl::Range(int(x + rays.dx[i] * j + 0.5f), 0, width - 1);
+            const int iy = pcl::Range(int(y + rays.dy[i] * j + 0.5f), 0, height - 1);
+            const T in = input[size_type(iy) * width + ix];
+            if (in == 0)
+                continue;
+            p += in * w;
+            w0 += w;
+            break;
+        }
+    }
+    return (w0 > 0.0f) ? T(p / w0) : T(0);
+}
+
+#ifdef SUPERFLAT_SSE2
+
+// Same as MarchRays() for the four pixels (x, y) ... (x + 3, y). All lanes follow the same ray and step, so they share
+// the row being sampled; sky pixels (nonzero) are copied unchanged.
+template <class T, int N, class S>
+inline void MarchRays4(const T* input, int width, int height, int x, int y, int numberOfSteps, T* output)
+{
+    const SuperFlatRayTable<N, S>& rays = SuperFlatRays<N, S>::table;
+    const T* self = input + size_type(y) * width + x;
+    int holes = 0;
+    for (int l = 0; l < 4; l++)
+        if (self[l] > 0)
+            output[l] = self[l];
+        else
+            holes |= 1 << l;
+    if (holes == 0)
+        return;
+
+    const __m128 xs = _mm_setr_ps(float(x), float(x + 1), float(x + 2), float(x + 3));
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 xmax = _mm_set1_ps(float(width - 1));
+    const __m128 hundredth = _mm_set1_ps(0.01f);
+    T p[4] = { 0, 0, 0, 0 };
+    __m128 w0 = _mm_setzero_ps();
+    alignas(16) int ix[4];
+    alignas(16) float w0s[4];
+
+    for (int i = 0; i < N; i++) {
+        int active = holes;
+        for (int k = (i % 2 != 0) ? rays.firstFarStep : 0; (k < numberOfSteps) && (active != 0); k++) {
+            const float w = rays.weight[k];
+            const __m128 ww = _mm_set1_ps(w);
+            active &= ~_mm_movemask_ps(_mm_cmplt_ps(ww, _mm_mul_ps(w0, hundredth)));
+            if (active == 0)
+                break;
+            const int j = rays.step[k];
+            const __m128 fx = _mm_add_ps(_mm_add_ps(xs, _mm_set1_ps(rays.dx[i] * j)), half);
+            _mm_store_si128(reinterpret_cast<__m128i*>(ix), _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(fx, zero), xmax)));
+            const int iy = pcl::Range(int(y + rays.dy[i] * j + 0.5f), 0, height - 1);
+            const T* row = input + size_type(iy) * width;
+            int hits = 0;
+            for (int l = 0; l < 4; l++)
+                if ((active & (1 << l)) && (row[ix[l]] != 0)) {
+                    p[l] += row[ix[l]] * w;
+                    hits |= 1 << l;
+                }
+            if (hits != 0) {
+                w0 = _mm_add_ps(w0, _mm_and_ps(ww, _mm_castsi128_ps(_mm_setr_epi32(-(hits & 1), -((hits >> 1) & 1), -((hits >> 2) & 1), -((hits >> 3) & 1)))));
+                active &= ~hits;
+            }
+        }
+    }
+
+    _mm_store_ps(w0s, w0);
+    for (int l = 0; l < 4; l++)
+        if (holes & (1 << l))
+            output[l] = (w0s[l] > 0.0f) ? T(p[l] / w0s[l]) : T(0);
+}
+
+#endif	// SUPERFLAT_SSE2
+
+}	// namespace pcl
+
+#endif	// __SuperFlatRays_h
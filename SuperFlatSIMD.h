@@ -0,0 +1,11 @@
+#ifndef __SuperFlatSIMD_h
+#define __SuperFlatSIMD_h
+
+// SSE2 is part of every x64 target, so it needs neither compiler flags nor runtime dispatch. Kernels that use it must
+// keep a scalar path for the other targets.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define SUPERFLAT_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#endif	// __SuperFlatSIMD_h
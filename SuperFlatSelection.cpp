@@ -0,0 +1,22 @@
+#include <pcl/Math.h>
+
+#include "SuperFlatSelection.h"
+
+namespace pcl
+{
+
+SuperFlatSelection::SuperFlatSelection(int size, bool circular, double k)
+    : m_radius(size >> 1)
+{
+    // A disk of diameter size covers the pixels whose centers are within size/2 of the central one.
+    const double r2 = 0.25 * size * size;
+    int count = 0;
+    for (int dy = -m_radius; dy <= m_radius; dy++) {
+        const int w = circular ? int(pcl::Sqrt(r2 - dy * dy)) : m_radius;
+        m_halfWidth << w;
+        count += 2 * w + 1;
+    }
+    m_rank = pcl::Range(pcl::RoundInt(k * (count - 1)), 0, count - 1);
+}
+
+}	// namespace pcl
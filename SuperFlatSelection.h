@@ -0,0 +1,127 @@
+#ifndef __SuperFlatSelection_h
+#define __SuperFlatSelection_h
+
+#include <pcl/Array.h>
+
+namespace pcl
+{
+
+// Order statistic filter over a square or circular window, the equivalent of MorphologicalTransformation with a
+// SelectionFilter (or a MedianFilter) and a BoxStructure or CircularStructure. Samples are quantized to Levels levels
+// and counted in a histogram of the window, which is slid from pixel to pixel by removing the samples that leave the
+// window and adding those that enter it, so the cost per pixel grows with the size of the window rather than with its
+// area.
+class SuperFlatSelection
+{
+public:
+    static constexpr int Levels = 65536;
+
+    // Window of size x size pixels, or the disk of diameter size centered on it. size must be odd and below 256. The
+    // selected sample is the one of rank RoundInt(k*(n - 1)) among the n samples of the window, as for SelectionFilter;
+    // k = 0.5 gives the median.
+    SuperFlatSelection(int size, bool circular, double k);
+
+    int Radius() const
+    {
+        return m_radius;
+    }
+
+    // Half width of row dy of the window, -Radius() <= dy <= Radius(). Both shapes are symmetric, so this is also the
+    // half height of column dy.
+    int HalfWidth(int dy) const
+    {
+        return m_halfWidth[dy + m_radius];
+    }
+
+    int Rank() const
+    {
+        return m_rank;
+    }
+
+    bool IsMedian3x3() const
+    {
+        return (m_radius == 1) && (m_halfWidth[0] == 1) && (m_rank == 4);
+    }
+
+private:
+    int m_radius;
+    Array<int> m_halfWidth;
+    int m_rank;
+};
+
+// Histogram of the quantized samples of a window, with counts of each level and of each block of 16 and 256 levels.
+// The selected level is tracked from one window to the next: it moves little between neighboring pixels, and the block
+// counts let it skip whole stretches of levels on the way.
+class SuperFlatSelectionHistogram
+{
+public:
+    SuperFlatSelectionHistogram(int rank)
+        : m_fine(SuperFlatSelection::Levels, uint16(0))
+        , m_middle(SuperFlatSelection::Levels >> 4, uint16(0))
+        , m_coarse(SuperFlatSelection::Levels >> 8, uint16(0))
+        , m_rank(rank)
+        , m_level(0)
+        , m_below(0)
+    {
+    }
+
+    void Add(int level)
+    {
+        m_fine[level]++;
+        m_middle[level >> 4]++;
+        m_coarse[level >> 8]++;
+        if (level < m_level)
+            m_below++;
+    }
+
+    void Remove(int level)
+    {
+        m_fine[level]--;
+        m_middle[level >> 4]--;
+        m_coarse[level >> 8]--;
+        if (level < m_level)
+            m_below--;
+    }
+
+    // Level of the sample of the selected rank. The window must hold more than rank samples.
+    int Select()
+    {
+        // Down while there are more than rank samples below the level, then up while the samples below it and at it
+        // are not more than rank. A block is skipped at once when the count stays on the same side of the rank.
+        while (m_below > m_rank) {
+            if (((m_level & 255) == 0) && (m_level > 0) && (m_below - m_coarse[(m_level >> 8) - 1] > m_rank)) {
+                m_level -= 256;
+                m_below -= m_coarse[m_level >> 8];
+            } else if (((m_level & 15) == 0) && (m_level > 0) && (m_below - m_middle[(m_level >> 4) - 1] > m_rank)) {
+                m_level -= 16;
+                m_below -= m_middle[m_level >> 4];
+            } else
+                m_below -= m_fine[--m_level];
+        }
+        for (;;) {
+            if (((m_level & 255) == 0) && (m_below + m_coarse[m_level >> 8] <= m_rank)) {
+                m_below += m_coarse[m_level >> 8];
+                m_level += 256;
+            } else if (((m_level & 15) == 0) && (m_below + m_middle[m_level >> 4] <= m_rank)) {
+                m_below += m_middle[m_level >> 4];
+                m_level += 16;
+            } else if (m_below + m_fine[m_level] <= m_rank)
+                m_below += m_fine[m_level++];
+            else
+                return m_level;
+        }
+    }
+
+private:
+    Array<uint16> m_fine;
+    Array<uint16> m_middle;
+    Array<uint16> m_coarse;
+    int m_rank;
+    // Selected level, and number of samples of the window below it.
+    int m_level;
+    int m_below;
+};
+
+}	// namespace pcl
+
+#endif	// __SuperFlatSelection_h
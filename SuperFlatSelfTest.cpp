@@ -0,0 +1,108 @@
+#ifdef SUPERFLAT_SELF_TEST
+
+#include <pcl/Console.h>
+#include <pcl/ElapsedTime.h>
+#include <pcl/MorphologicalTransformation.h>
+
+#include "SuperFlatBlur.h"
+#include "SuperFlatBuffers.h"
+#include "SuperFlatInstance.h"
+#include "SuperFlatProcess.h"
+#include "SuperFlatSelection.h"
+#include "SuperFlatSelfTest.h"
+
+namespace pcl
+{
+
+bool SuperFlatSelfTest::Run()
+{
+    const bool blur = CheckBlur();
+    const bool median = CheckMedian();
+    return blur && median;
+}
+
+bool SuperFlatSelfTest::CheckBlur()
+{
+    Console console;
+    console.WriteLn(String().Format("<end><cbr>SuperFlat: running-sum blur, 1024x1024 pixels, bounds %.1e interior, %.1e edges",
+        BlurInteriorBound, BlurEdgeBound));
+    bool passed = true;
+    for (double sigma : { 96.0, 128.0, 192.0, 255.0 }) {
+        if (!SuperFlatShapeBlur::IsApplicable(sigma)) {
+            console.CriticalLn(String().Format("*** sigma %5.1f: the running sums do not apply", sigma));
+            passed = false;
+            continue;
+        }
+        const SuperFlatShapeBlur::Deviation d = SuperFlatShapeBlur::Compare(sigma, 1024, 1024);
+        const String line = String().Format("sigma %5.1f, radius %3d: max deviation %.3e interior, %.3e edges",
+            sigma, d.radius, d.interior, d.edges);
+        if ((d.interior <= BlurInteriorBound) && (d.edges <= BlurEdgeBound))
+            console.WriteLn(line);
+        else {
+            console.CriticalLn("*** " + line);
+            passed = false;
+        }
+    }
+    return passed;
+}
+
+bool SuperFlatSelfTest::CheckMedian()
+{
+    // The same noisy three-channel image, with repeated values, through the 3x3 median of select() and through
+    // MorphologicalTransformation with a MedianFilter. The outermost rows and columns are left out, where the two
+    // extend the image each in its own way.
+    const int width = 1000;
+    const int height = 700;
+    SuperFlatBuffers buffers;
+    ImageVariant image = buffers.Acquire(32, width, height, 3, ColorSpace::RGB);
+    uint32 seed = 12345;
+    for (int c = 0; c < 3; c++)
+        for (int y = 0; y < height; y++) {
+            float* row = static_cast<Image&>(*image).ScanLine(y, c);
+            for (int x = 0; x < width; x++) {
+                seed = seed * 1664525u + 1013904223u;
+                row[x] = float(0.1 + 0.5 * x / width + 0.4 * ((seed >> 20) & 255) / 255);
+            }
+        }
+    ImageVariant reference;
+    reference.CreateFloatImage(32);
+    reference.CopyImage(image);
+
+    SuperFlatInstance instance(TheSuperFlatProcess);
+    SuperFlatExecution execution;
+    StatusMonitor monitor;
+    ElapsedTime T;
+    instance.select(image, SuperFlatSelection(3, false, 0.5), 1, buffers, execution, monitor);
+    const double fastTime = T();
+
+    T.Reset();
+    MorphologicalTransformation mf;
+    mf.SetStructure(BoxStructure(3));
+    mf.SetOperator(MedianFilter());
+    mf >> reference;
+    const double pclTime = T();
+
+    size_type mismatches = 0;
+    for (int c = 0; c < 3; c++)
+        for (int y = 1; y < height - 1; y++) {
+            const float* a = static_cast<const Image&>(*image).ScanLine(y, c);
+            const float* b = static_cast<const Image&>(*reference).ScanLine(y, c);
+            for (int x = 1; x < width - 1; x++)
+                if (a[x] != b[x])
+                    mismatches++;
+        }
+
+    Console console;
+    const String line = String().Format("SuperFlat: 3x3 median, %dx%d pixels, 3 channels: %.3f s, MedianFilter %.3f s, %u mismatches",
+        width, height, fastTime, pclTime, unsigned(mismatches));
+    if (mismatches == 0)
+        console.WriteLn("<end><cbr>" + line);
+    else
+        console.CriticalLn("<end><cbr>*** " + line);
+    buffers.Release(image);
+    return mismatches == 0;
+}
+
+}	// namespace pcl
+
+#endif	// SUPERFLAT_SELF_TEST
@@ -0,0 +1,31 @@
+#ifndef __SuperFlatSelfTest_h
+#define __SuperFlatSelfTest_h
+
+namespace pcl
+{
+
+// Checks of the fast paths of the module against the PCL implementations they replace, on fixed synthetic images.
+// They are only built with SUPERFLAT_SELF_TEST defined, and then run when the module is installed. Results are written
+// to the console; a check fails when the results differ by more than its stated bound.
+class SuperFlatSelfTest
+{
+public:
+    // Runs all the checks, and returns whether they all passed.
+    static bool Run();
+
+private:
+    // Largest absolute differences of the running-sum blur from FFT convolution in the interior of the image, and from
+    // a direct convolution within a kernel radius of its edges, on samples in [0.25, 1], for sigmas of 96 pixels up to
+    // the 255 pixels of the sky reference blur.
+    static constexpr double BlurInteriorBound = 1.0e-5;
+    static constexpr double BlurEdgeBound = 1.0e-4;
+
+    static bool CheckBlur();
+    // The 3x3 median network of SuperFlatInstance::select(), which must reproduce MedianFilter exactly, timed against
+    // it.
+    static bool CheckMedian();
+};
+
+}	// namespace pcl
+
+#endif	// __SuperFlatSelfTest_h
@@ -0,0 +1,189 @@
+#include <cstring>
+#include <pcl/ErrorHandler.h>
+#include <pcl/File.h>
+#include <pcl/Math.h>
+
+#include "SuperFlatBlur.h"
+#include "SuperFlatSplineGrid.h"
+
+namespace pcl
+{
+
+static const char SplineGridId[8] = { 'S', 'F', 'G', 'R', 'I', 'D', '0', '1' };
+
+// Position of node i of n along an axis of size pixels, in pixels.
+static double NodePosition(int i, int n, int size)
+{
+    return (n > 1) ? double(i) * (size - 1) / (n - 1) : 0.0;
+}
+
+// Replaces n samples spaced stride apart by the coefficients of the cubic B-spline that interpolates them, with the
+// samples mirrored at both ends (Unser's recursive filter).
+static void InterpolatingBSpline(double* c, int n, size_type stride)
+{
+    if (n < 2)
+        return;
+    const double z = pcl::Sqrt(3.0) - 2;
+    for (int k = 0; k < n; k++)
+        c[k * stride] *= 6;
+
+    // Causal initialization: the sum over the mirrored samples, exact for short sequences and truncated where z^k no
+    // longer matters for long ones.
+    double sum;
+    if (n <= 32) {
+        double zk = z;
+        double z2n = pcl::Pow(z, double(n - 1));
+        sum = c[0] + z2n * c[(n - 1) * stride];
+        z2n *= z2n / z;
+        for (int k = 1; k <= n - 2; k++) {
+            sum += (zk + z2n) * c[k * stride];
+            zk *= z;
+            z2n /= z;
+        }
+        sum /= 1 - zk * zk;
+    } else {
+        sum = c[0];
+        double zk = z;
+        for (int k = 1; k < 32; k++, zk *= z)
+            sum += zk * c[k * stride];
+    }
+    c[0] = sum;
+    for (int k = 1; k < n; k++)
+        c[k * stride] += z * c[(k - 1) * stride];
+
+    c[(n - 1) * stride] = z / (z * z - 1) * (c[(n - 1) * stride] + z * c[(n - 2) * stride]);
+    for (int k = n - 1; --k >= 0;)
+        c[k * stride] = z * (c[(k + 1) * stride] - c[k * stride]);
+}
+
+template <class P>
+static void FitGrid(const GenericImage<P>& model, int width, int height, int factor, int columns, int rows, Array<float>& points)
+{
+    const int mw = model.Width();
+    const int mh = model.Height();
+    Array<double> grid(size_type(columns) * rows);
+    for (int c = 0; c < model.NumberOfChannels(); c++) {
+        // The model bilinearly interpolated at the nodes; pixel x of the image is at (x + 0.5)/factor - 0.5 in the
+        // model.
+        for (int j = 0; j < rows; j++) {
+            const double v = pcl::Range((NodePosition(j, rows, height) + 0.5) / factor - 0.5, 0.0, double(mh - 1));
+            const int iv = pcl::Min(int(v), pcl::Max(mh - 2, 0));
+            const double fv = v - iv;
+            const typename P::sample* p0 = model.ScanLine(iv, c);
+            const typename P::sample* p1 = model.ScanLine(pcl::Min(iv + 1, mh - 1), c);
+            for (int i = 0; i < columns; i++) {
+                const double u = pcl::Range((NodePosition(i, columns, width) + 0.5) / factor - 0.5, 0.0, double(mw - 1));
+                const int iu = pcl::Min(int(u), pcl::Max(mw - 2, 0));
+                const int iu1 = pcl::Min(iu + 1, mw - 1);
+                const double fu = u - iu;
+                grid[size_type(j) * columns + i] = (1 - fv) * ((1 - fu) * p0[iu] + fu * p0[iu1]) + fv * ((1 - fu) * p1[iu] + fu * p1[iu1]);
+            }
+        }
+        for (int j = 0; j < rows; j++)
+            InterpolatingBSpline(grid.At(size_type(j) * columns), columns, 1);
+        for (int i = 0; i < columns; i++)
+            InterpolatingBSpline(grid.At(i), rows, columns);
+        for (double g : grid)
+            points << float(g);
+    }
+}
+
+SuperFlatSplineGrid::SuperFlatSplineGrid()
+    : m_width(0)
+    , m_height(0)
+    , m_channels(0)
+    , m_columns(0)
+    , m_rows(0)
+{
+}
+
+void SuperFlatSplineGrid::Fit(const ImageVariant& model, const Array<double>& skyLevels, int width, int height, int factor, int nodes)
+{
+    m_width = width;
+    m_height = height;
+    m_channels = model.NumberOfChannels();
+    m_columns = pcl::Max(1, pcl::Min(nodes, model.Width()));
+    m_rows = pcl::Max(1, pcl::Min(nodes, model.Height()));
+    m_levels = skyLevels;
+    m_points.Clear();
+    if (model.BitsPerSample() == 32)
+        FitGrid(static_cast<const Image&>(*model), width, height, factor, m_columns, m_rows, m_points);
+    else if (model.BitsPerSample() == 64)
+        FitGrid(static_cast<const DImage&>(*model), width, height, factor, m_columns, m_rows, m_points);
+    Prepare();
+}
+
+void SuperFlatSplineGrid::Write(const String& filePath) const
+{
+    const int32 header[5] = { m_width, m_height, m_channels, m_columns, m_rows };
+    const size_type offset = sizeof(SplineGridId) + sizeof(header);
+    ByteArray data(offset + m_levels.Length() * sizeof(double) + m_points.Length() * sizeof(float));
+    ::memcpy(data.Begin(), SplineGridId, sizeof(SplineGridId));
+    ::memcpy(data.At(sizeof(SplineGridId)), header, sizeof(header));
+    ::memcpy(data.At(offset), m_levels.Begin(), m_levels.Length() * sizeof(double));
+    ::memcpy(data.At(offset + m_levels.Length() * sizeof(double)), m_points.Begin(), m_points.Length() * sizeof(float));
+    File::WriteFile(filePath, data);
+}
+
+void SuperFlatSplineGrid::Read(const String& filePath)
+{
+    const ByteArray data = File::ReadFile(filePath);
+    int32 header[5];
+    if ((data.Length() < sizeof(SplineGridId) + sizeof(header)) || (::memcmp(data.Begin(), SplineGridId, sizeof(SplineGridId)) != 0))
+        throw Error("Not a SuperFlat spline grid file: " + filePath);
+    ::memcpy(header, data.At(sizeof(SplineGridId)), sizeof(header));
+    const size_type offset = sizeof(SplineGridId) + sizeof(header);
+    const size_type points = size_type(header[2]) * header[3] * header[4];
+    if ((header[0] < 1) || (header[1] < 1) || (header[2] < 1) || (header[3] < 1) || (header[4] < 1)
+        || (data.Length() != offset + header[2] * sizeof(double) + points * sizeof(float)))
+        throw Error("Corrupted SuperFlat spline grid file: " + filePath);
+
+    m_width = header[0];
+    m_height = header[1];
+    m_channels = header[2];
+    m_columns = header[3];
+    m_rows = header[4];
+    m_levels = Array<double>(m_channels);
+    m_points = Array<float>(points);
+    ::memcpy(m_levels.Begin(), data.At(offset), m_channels * sizeof(double));
+    ::memcpy(m_points.Begin(), data.At(offset + m_channels * sizeof(double)), points * sizeof(float));
+    Prepare();
+}
+
+void SuperFlatSplineGrid::Prepare()
+{
+    m_columnIndex = Array<int>(m_width);
+    m_columnWeights = Array<double>(4 * size_type(m_width));
+    for (int x = 0; x < m_width; x++) {
+        const double u = (m_width > 1) ? double(x) * (m_columns - 1) / (m_width - 1) : 0.0;
+        const int iu = pcl::Min(int(u), m_columns - 1);
+        m_columnIndex[x] = iu;
+        SuperFlatCubicBSpline(u - iu, m_columnWeights.At(4 * size_type(x)));
+    }
+}
+
+void SuperFlatSplineGrid::EvaluateRow(int y, int channel, double* out) const
+{
+    // The four node rows around y are first combined into one row of control points, padded with their mirror
+    // images, then interpolated at every pixel.
+    double w[4];
+    const double v = (m_height > 1) ? double(y) * (m_rows - 1) / (m_height - 1) : 0.0;
+    const int iv = pcl::Min(int(v), m_rows - 1);
+    SuperFlatCubicBSpline(v - iv, w);
+    Array<double> row(m_columns + 3);
+    for (int i = -1; i <= m_columns + 1; i++) {
+        const int column = SuperFlatMirror(i, m_columns);
+        double s = 0;
+        for (int k = 0; k < 4; k++)
+            s += w[k] * Point(column, SuperFlatMirror(iv - 1 + k, m_rows), channel);
+        row[i + 1] = s;
+    }
+
+    for (int x = 0; x < m_width; x++) {
+        const double* r = row.At(m_columnIndex[x]);
+        const double* c = m_columnWeights.At(4 * size_type(x));
+        out[x] = c[0] * r[0] + c[1] * r[1] + c[2] * r[2] + c[3] * r[3];
+    }
+}
+
+}	// namespace pcl
@@ -0,0 +1,76 @@
+#ifndef __SuperFlatSplineGrid_h
+#define __SuperFlatSplineGrid_h
+
+#include <pcl/Array.h>
+#include <pcl/ImageVariant.h>
+#include <pcl/String.h>
+
+namespace pcl
+{
+
+// Background model stored as the control points of a bicubic B-spline, a few thousand per channel instead of an image.
+// The nodes are spread evenly over the image, the first and last ones on its edge pixels, so the same grid applies to
+// any image of the geometry it was fitted to. Rows are evaluated with precomputed column weights, four multiply-adds
+// per sample.
+class SuperFlatSplineGrid
+{
+public:
+    static constexpr int DefaultNodes = 128;
+
+    SuperFlatSplineGrid();
+
+    // Fits the grid to model, a smooth image averaged down by factor from an image of width x height pixels, with at
+    // most nodes nodes along each axis. The spline interpolates the model at the nodes. The sky level of every channel
+    // is stored with the grid, to renormalize the images it is applied to.
+    void Fit(const ImageVariant& model, const Array<double>& skyLevels, int width, int height, int factor, int nodes = DefaultNodes);
+
+    // Side file: an identifier, the geometry, the sky levels and the control points as 32-bit floats.
+    void Write(const String& filePath) const;
+    void Read(const String& filePath);
+
+    int Width() const
+    {
+        return m_width;
+    }
+
+    int Height() const
+    {
+        return m_height;
+    }
+
+    int NumberOfChannels() const
+    {
+        return m_channels;
+    }
+
+    double SkyLevel(int channel) const
+    {
+        return m_levels[channel];
+    }
+
+    // The model at the pixels of row y of channel.
+    void EvaluateRow(int y, int channel, double* out) const;
+
+private:
+    int m_width;
+    int m_height;
+    int m_channels;
+    int m_columns;
+    int m_rows;
+    Array<double> m_levels;
+    Array<float> m_points;
+    // Node column to the left of every pixel of a row, and the weights of the four columns around it.
+    Array<int> m_columnIndex;
+    Array<double> m_columnWeights;
+
+    float Point(int column, int row, int channel) const
+    {
+        return m_points[(size_type(channel) * m_rows + row) * m_columns + column];
+    }
+
+    void Prepare();
+};
+
+}	// namespace pcl
+
+#endif	// __SuperFlatSplineGrid_h
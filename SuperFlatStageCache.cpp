@@ -0,0 +1,144 @@
+#include <pcl/Image.h>
+#include <pcl/ImageWindow.h>
+
+#include "SuperFlatStageCache.h"
+
+namespace pcl
+{
+
+// Samples per row and per column that the signature of an image reads.
+static constexpr int SignatureGrid = 64;
+
+// FNV-1a hash of size bytes, continuing from hash.
+static uint64 Hash(uint64 hash, const void* data, size_type size)
+{
+    for (const uint8* p = reinterpret_cast<const uint8*>(data), * end = p + size; p < end; p++)
+        hash = (hash ^ *p) * 0x100000001b3ull;
+    return hash;
+}
+
+// The samples of image on a grid of SignatureGrid x SignatureGrid pixels, hashed after hash.
+template <class P>
+static uint64 Signature(const GenericImage<P>& image, uint64 hash)
+{
+    const int dx = pcl::Max(1, image.Width() / SignatureGrid);
+    const int dy = pcl::Max(1, image.Height() / SignatureGrid);
+    for (int c = 0; c < image.NumberOfChannels(); c++)
+        for (int y = dy / 2; y < image.Height(); y += dy) {
+            const typename P::sample* row = image.ScanLine(y, c);
+            for (int x = dx / 2; x < image.Width(); x += dx)
+                hash = Hash(hash, row + x, sizeof(typename P::sample));
+        }
+    return hash;
+}
+
+static size_type ImageBytes(const ImageVariant& image)
+{
+    return image ? image.ImageSize() : 0;
+}
+
+SuperFlatStageCache::SuperFlatStageCache()
+    : m_capacity(size_type(1024) << 20)
+    , m_clock(0)
+    , m_hits(0)
+    , m_misses(0)
+{
+}
+
+SuperFlatStageCache::~SuperFlatStageCache()
+{
+    m_entries.Destroy();
+}
+
+SuperFlatStageCache::Key SuperFlatStageCache::KeyOf(const View& view, const ImageVariant& image, int downsample)
+{
+    Key key;
+    key.viewId = view.FullId();
+    key.historyIndex = view.Window().CurrentHistoryIndex();
+    key.downsample = downsample;
+    const int geometry[] = { image.Width(), image.Height(), image.NumberOfChannels(), image.BitsPerSample() };
+    uint64 hash = Hash(0xcbf29ce484222325ull, geometry, sizeof(geometry));
+    if (image.BitsPerSample() == 32)
+        hash = Signature(static_cast<const Image&>(*image), hash);
+    else if (image.BitsPerSample() == 64)
+        hash = Signature(static_cast<const DImage&>(*image), hash);
+    key.signature = hash;
+    return key;
+}
+
+SuperFlatStageCache::Entry& SuperFlatStageCache::Find(const Key& key)
+{
+    for (Entry& e : m_entries)
+        if (e.key == key) {
+            m_hits++;
+            e.lastUse = ++m_clock;
+            return e;
+        }
+
+    m_misses++;
+    Entry* entry = new Entry;
+    entry->key = key;
+    entry->lastUse = ++m_clock;
+    m_entries << entry;
+    Update(*entry);
+    return *entry;
+}
+
+void SuperFlatStageCache::Update(Entry& entry)
+{
+    entry.bytes = ImageBytes(entry.downImage) + ImageBytes(entry.ref) + ImageBytes(entry.smoothed) + ImageBytes(entry.inpainted)
+                  + entry.sky.Bytes() + entry.inpaintedSky.Bytes();
+    Evict(&entry);
+}
+
+void SuperFlatStageCache::SetCapacity(size_type bytes)
+{
+    m_capacity = bytes;
+    Evict(nullptr);
+}
+
+size_type SuperFlatStageCache::Capacity() const
+{
+    return m_capacity;
+}
+
+size_type SuperFlatStageCache::Bytes() const
+{
+    size_type bytes = 0;
+    for (const Entry& e : m_entries)
+        bytes += e.bytes;
+    return bytes;
+}
+
+void SuperFlatStageCache::Clear()
+{
+    m_entries.Destroy();
+}
+
+size_type SuperFlatStageCache::Hits() const
+{
+    return m_hits;
+}
+
+size_type SuperFlatStageCache::Misses() const
+{
+    return m_misses;
+}
+
+void SuperFlatStageCache::Evict(const Entry* keep)
+{
+    for (;;) {
+        if ((m_entries.Length() <= size_type(MaxEntries)) && (Bytes() <= m_capacity))
+            break;
+
+        size_type oldest = m_entries.Length();
+        for (size_type i = 0; i < m_entries.Length(); i++)
+            if ((&m_entries[i] != keep) && ((oldest == m_entries.Length()) || (m_entries[i].lastUse < m_entries[oldest].lastUse)))
+                oldest = i;
+        if (oldest == m_entries.Length())
+            break;
+        m_entries.Destroy(m_entries.At(oldest));
+    }
+}
+
+}	// namespace pcl
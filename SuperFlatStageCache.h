@@ -0,0 +1,121 @@
+#ifndef __SuperFlatStageCache_h
+#define __SuperFlatStageCache_h
+
+#include <pcl/ImageVariant.h>
+#include <pcl/MetaParameter.h> // pcl_enum
+#include <pcl/ReferenceArray.h>
+#include <pcl/View.h>
+
+#include "SuperFlatMask.h"
+#include "SuperFlatStars.h"
+
+namespace pcl
+{
+
+// Identifies the image an execution runs on without reading all of its pixels: the view, the current history index of
+// its window, the downsampling factor and a signature of the geometry and of a sparse grid of samples. The signature
+// tells apart the states an undo followed by another process leaves at the same history index; only an edit confined
+// to pixels off the grid would go unnoticed, and clearing the cache discards it.
+struct SuperFlatStageCacheKey
+{
+    IsoString viewId;
+    int historyIndex = 0;
+    int downsample = 0;
+    uint64 signature = 0;
+
+    bool operator==(const SuperFlatStageCacheKey& key) const
+    {
+        return (viewId == key.viewId) && (historyIndex == key.historyIndex) && (downsample == key.downsample)
+               && (signature == key.signature);
+    }
+};
+
+// The stages cached for one image, each with the parameters it was computed with.
+struct SuperFlatStageCacheEntry
+{
+    SuperFlatStageCacheKey key;
+
+    // The downsampled image, reused instead of downsampling the view again.
+    ImageVariant downImage;
+
+    bool hasCatalog = false;
+    float starSensitivity = 0;
+    SuperFlatStarCatalog catalog;
+
+    ImageVariant ref;
+    pcl_enum refMethod = 0;
+
+    ImageVariant smoothed;
+    int smoothedDistance = 0;
+
+    // The 3x3 median of the thresholded sky, valid while it has pixels.
+    SuperFlatMask sky;
+    float skyThreshold = 0;
+
+    ImageVariant inpainted;
+    SuperFlatMask inpaintedSky;
+    pcl_enum inpaintingMethod = 0;
+    pcl_enum rayCount = 0;
+    bool exactInpainting = false;
+
+    size_type bytes = 0;
+    uint64 lastUse = 0;
+};
+
+// Intermediate results of the last executions on views, kept for the whole life of the module so that running again
+// on the same image with a few parameters changed only recomputes the stages that depend on them. Each stage is kept
+// with the parameters it was computed with, and is dropped with everything after it when recomputed:
+//
+//   downsampled image  the key of the entry
+//   star catalog       starDetectionSensitivity (the stars are stamped again for objectDiffusionDistance)
+//   sky reference      smoothingMethod
+//   selection passes   objectDiffusionDistance
+//   sky mask           skyDetectionThreshold, and the two stages above
+//   inpainted model    the sky mask less the stars and the non-sky mask, and the inpainting parameters
+//
+// Changing the smoothness alone thus only blurs the inpainted model again. The least recently used entries are dropped
+// beyond MaxEntries, or while the cached images exceed the capacity; the entry in use is always kept.
+class SuperFlatStageCache
+{
+public:
+    typedef SuperFlatStageCacheEntry Entry;
+    typedef SuperFlatStageCacheKey Key;
+
+    static constexpr int MaxEntries = 4;
+
+    SuperFlatStageCache();
+    ~SuperFlatStageCache();
+
+    // The key of image, the image of view, downsampled by downsample.
+    static Key KeyOf(const View& view, const ImageVariant& image, int downsample);
+
+    // The entry of key, a new and empty one if there is none. Only executions on views use the cache, and those run one
+    // at a time.
+    Entry& Find(const Key& key);
+
+    // Accounts for the stages stored into entry, and drops older entries as needed.
+    void Update(Entry& entry);
+
+    // Total size of the cached images, in bytes; zero disables the cache.
+    void SetCapacity(size_type bytes);
+    size_type Capacity() const;
+    size_type Bytes() const;
+
+    void Clear();
+
+    size_type Hits() const;
+    size_type Misses() const;
+
+private:
+    ReferenceArray<Entry> m_entries;
+    size_type m_capacity;
+    uint64 m_clock;
+    size_type m_hits;
+    size_type m_misses;
+
+    void Evict(const Entry* keep);
+};
+
+}	// namespace pcl
+
+#endif	// __SuperFlatStageCache_h
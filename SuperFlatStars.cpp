@@ -0,0 +1,189 @@
+#include <limits>
+#include <pcl/File.h>
+#include <pcl/Math.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "SuperFlatMask.h"
+#include "SuperFlatStars.h"
+
+namespace pcl
+{
+
+static inline int TrailingZeros(uint64 w)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward64(&i, w);
+    return int(i);
+#else
+    return __builtin_ctzll(w);
+#endif
+}
+
+// A run of star pixels [x0, x1) of row y, and the run it has been merged with.
+struct StarRun
+{
+    int y;
+    int x0;
+    int x1;
+    int parent;
+};
+
+static int FindRoot(Array<StarRun>& runs, int i)
+{
+    while (runs[i].parent != i) {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+// Appends the runs of set bits of a row, found a word at a time.
+static void AppendRuns(Array<StarRun>& runs, const uint64* row, int words, int width, int y)
+{
+    int start = -1;
+    for (int i = 0; i < words; i++) {
+        const uint64 w = row[i];
+        for (int p = 0; p < 64;) {
+            if (start < 0) {
+                const uint64 set = w >> p;
+                if (set == 0)
+                    break;
+                p += TrailingZeros(set);
+                start = 64 * i + p;
+            } else {
+                const uint64 clear = ~w >> p;
+                if (clear == 0)
+                    break;
+                p += TrailingZeros(clear);
+                runs << StarRun { y, start, 64 * i + p, int(runs.Length()) };
+                start = -1;
+            }
+        }
+    }
+    if (start >= 0)
+        runs << StarRun { y, start, width, int(runs.Length()) };
+}
+
+template <class P>
+static void ExtractStars(Array<SuperFlatStar>& stars, const SuperFlatMask& mask, const GenericImage<P>& fine, const GenericImage<P>& coarse)
+{
+    for (int c = 0; c < mask.NumberOfChannels(); c++) {
+        // Runs of every row, each one merged with the runs of the previous row that touch it or its corners.
+        Array<StarRun> runs;
+        size_type previous = 0;
+        for (int y = 0; y < mask.Height(); y++) {
+            const size_type first = runs.Length();
+            AppendRuns(runs, mask.Row(y, c), mask.WordsPerRow(), mask.Width(), y);
+            size_type j = previous;
+            for (size_type i = first; i < runs.Length(); i++) {
+                while ((j < first) && (runs[j].x1 < runs[i].x0))
+                    j++;
+                for (size_type k = j; (k < first) && (runs[k].x0 <= runs[i].x1); k++) {
+                    const int a = FindRoot(runs, int(i));
+                    const int b = FindRoot(runs, int(k));
+                    if (a != b)
+                        runs[pcl::Max(a, b)].parent = pcl::Min(a, b);
+                }
+            }
+            previous = first;
+        }
+
+        // Roots are the first runs of their stars, so every star is created when its first run is met.
+        const size_type base = stars.Length();
+        Array<int> index(runs.Length(), -1);
+        Array<double> weight;
+        Array<double> sx;
+        Array<double> sy;
+        for (size_type i = 0; i < runs.Length(); i++) {
+            const StarRun& r = runs[i];
+            const int root = FindRoot(runs, int(i));
+            if (index[root] < 0) {
+                index[root] = int(weight.Length());
+                stars << SuperFlatStar { c, 0, 0, -std::numeric_limits<double>::max(), r.x0, r.y, r.x1, r.y + 1, 0, 0 };
+                weight << 0.0;
+                sx << 0.0;
+                sy << 0.0;
+            }
+            const int n = index[root];
+            SuperFlatStar& s = stars[base + n];
+            s.x0 = pcl::Min(s.x0, r.x0);
+            s.x1 = pcl::Max(s.x1, r.x1);
+            s.y1 = r.y + 1;
+            s.area += r.x1 - r.x0;
+            const typename P::sample* f = fine.ScanLine(r.y, c);
+            const typename P::sample* g = coarse.ScanLine(r.y, c);
+            for (int x = r.x0; x < r.x1; x++) {
+                const double v = double(f[x]) - double(g[x]);
+                s.peak = pcl::Max(s.peak, v);
+                if (v > 0) {
+                    weight[n] += v;
+                    sx[n] += v * x;
+                    sy[n] += v * r.y;
+                }
+            }
+        }
+
+        // Stars without a positive sample are placed at the center of their bounding box.
+        for (size_type n = 0; n < weight.Length(); n++) {
+            SuperFlatStar& s = stars[base + n];
+            s.x = (weight[n] > 0) ? sx[n] / weight[n] : 0.5 * (s.x0 + s.x1 - 1);
+            s.y = (weight[n] > 0) ? sy[n] / weight[n] : 0.5 * (s.y0 + s.y1 - 1);
+        }
+    }
+}
+
+void SuperFlatStarCatalog::Extract(const SuperFlatMask& stars, const ImageVariant& fine, const ImageVariant& coarse)
+{
+    m_stars.Clear();
+    if (fine.BitsPerSample() == 32)
+        ExtractStars(m_stars, stars, static_cast<const Image&>(*fine), static_cast<const Image&>(*coarse));
+    else if (fine.BitsPerSample() == 64)
+        ExtractStars(m_stars, stars, static_cast<const DImage&>(*fine), static_cast<const DImage&>(*coarse));
+}
+
+void SuperFlatStarCatalog::Stamp(SuperFlatMask& mask, double distance)
+{
+    for (int c = 0; c < mask.NumberOfChannels(); c++) {
+        Array<double> peaks;
+        for (const SuperFlatStar& s : m_stars)
+            if (s.channel == c)
+                peaks << s.peak;
+        if (peaks.IsEmpty())
+            continue;
+        peaks.Sort();
+        const double median = peaks[peaks.Length() >> 1];
+
+        for (SuperFlatStar& s : m_stars) {
+            if (s.channel != c)
+                continue;
+            const double scale = (median > 0) ? pcl::Pow(pcl::Max(s.peak, 0.0) / median, 0.25) : 1.0;
+            const double dx = pcl::Max(s.x - s.x0, s.x1 - 1 - s.x);
+            const double dy = pcl::Max(s.y - s.y0, s.y1 - 1 - s.y);
+            const double margin = pcl::Min(distance * pcl::Range(scale, 0.5, 4.0), pcl::Max(distance, MaximumMargin));
+            s.radius = pcl::Sqrt(dx * dx + dy * dy) + margin;
+
+            const int y0 = pcl::Max(0, int(pcl::Ceil(s.y - s.radius)));
+            const int y1 = pcl::Min(mask.Height() - 1, int(pcl::Floor(s.y + s.radius)));
+            for (int y = y0; y <= y1; y++) {
+                const double w = pcl::Sqrt(pcl::Max(0.0, s.radius * s.radius - (y - s.y) * (y - s.y)));
+                mask.SetSpan(y, c, int(pcl::Ceil(s.x - w)), int(pcl::Floor(s.x + w)) + 1);
+            }
+        }
+    }
+}
+
+void SuperFlatStarCatalog::WriteCSV(const String& filePath, double scale) const
+{
+    IsoString text = "channel,x,y,peak,area,width,height,radius\n";
+    for (const SuperFlatStar& s : m_stars)
+        text.AppendFormat("%d,%.2f,%.2f,%.6g,%.0f,%.0f,%.0f,%.2f\n", s.channel,
+                          (s.x + 0.5) * scale - 0.5, (s.y + 0.5) * scale - 0.5, s.peak, s.area * scale * scale,
+                          (s.x1 - s.x0) * scale, (s.y1 - s.y0) * scale, s.radius * scale);
+    File::WriteTextFile(filePath, text);
+}
+
+}	// namespace pcl
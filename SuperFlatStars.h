@@ -0,0 +1,70 @@
+#ifndef __SuperFlatStars_h
+#define __SuperFlatStars_h
+
+#include <pcl/Array.h>
+#include <pcl/ImageVariant.h>
+#include <pcl/String.h>
+
+namespace pcl
+{
+
+class SuperFlatMask;
+
+// A connected group of star pixels of one channel, measured on the band-pass image of the star detection.
+struct SuperFlatStar
+{
+    int channel;
+    // Centroid weighted by the positive band-pass samples, and the largest of them.
+    double x;
+    double y;
+    double peak;
+    // Bounding box [x0, x1) x [y0, y1) and number of pixels.
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    int area;
+    // Radius of the disk stamped into the star mask.
+    double radius;
+};
+
+// List of the stars found in a star mask. The stars are stamped back into a mask as disks whose radius grows with
+// their brightness, so that the cost of the mask is proportional to the number of stars rather than to the area of
+// the image.
+class SuperFlatStarCatalog
+{
+public:
+    // Largest margin, in pixels, that the brightness of a star may widen its disk to. It is above the largest object
+    // diffusion distance, so it only stops the scaling of large distances, by up to four times, from masking most of
+    // the image around a few bright stars.
+    static constexpr double MaximumMargin = 128;
+
+    // Labels the 8-connected components of stars, and measures them on the band-pass image fine - coarse.
+    void Extract(const SuperFlatMask& stars, const ImageVariant& fine, const ImageVariant& coarse);
+
+    // Sets every star of mask to a disk around its centroid that covers its bounding box with a margin of distance
+    // pixels, scaled by the fourth root of the ratio of its peak to the median peak of its channel and limited to
+    // [distance/2, 4*distance], and to MaximumMargin unless distance itself is larger.
+    void Stamp(SuperFlatMask& mask, double distance);
+
+    // Writes the catalog as comma separated values, with the coordinates and sizes multiplied by scale, the factor
+    // between the image the stars were found in and the full resolution image.
+    void WriteCSV(const String& filePath, double scale) const;
+
+    size_type Length() const
+    {
+        return m_stars.Length();
+    }
+
+    const SuperFlatStar& operator[](size_type i) const
+    {
+        return m_stars[i];
+    }
+
+private:
+    Array<SuperFlatStar> m_stars;
+};
+
+}	// namespace pcl
+
+#endif	// __SuperFlatStars_h
@@ -0,0 +1,126 @@
+#include <chrono>
+#include <exception>
+
+#include "SuperFlatThreadPool.h"
+
+namespace pcl
+{
+
+class SuperFlatPoolWorker : public Thread
+{
+public:
+    SuperFlatPoolWorker(SuperFlatThreadPool& pool, int id)
+        : m_pool(pool)
+        , m_id(id)
+    {
+    }
+
+    void Run() override
+    {
+        m_pool.WorkerLoop(m_id);
+    }
+
+private:
+    SuperFlatThreadPool& m_pool;
+    int m_id;
+};
+
+SuperFlatThreadPool::SuperFlatThreadPool()
+    : m_busy(0)
+    , m_quit(false)
+    , m_maxThreads(0)
+{
+}
+
+SuperFlatThreadPool::~SuperFlatThreadPool()
+{
+    Shutdown();
+}
+
+void SuperFlatThreadPool::SetMaxThreads(int maxThreads)
+{
+    m_maxThreads = pcl::Max(0, maxThreads);
+}
+
+int SuperFlatThreadPool::MaxThreads() const
+{
+    return m_maxThreads;
+}
+
+int SuperFlatThreadPool::NumberOfThreads(size_type count) const
+{
+    int n = Thread::NumberOfThreads(count, 1);
+    if (m_maxThreads > 0)
+        n = pcl::Min(n, m_maxThreads);
+    return pcl::Max(1, n);
+}
+
+void SuperFlatThreadPool::Run(int n, const Task& task, const Monitor& monitor)
+{
+    Job job = { &task, 0, n, n };
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_jobs << &job;
+    // Enough workers for every task waiting, counting those that are idle, but never more than the processors
+    // PixInsight allows us; the remaining tasks wait for a worker to become free.
+    size_type waiting = 0;
+    for (const Job* j : m_jobs)
+        waiting += j->count - j->next;
+    const size_type capacity = NumberOfThreads(PCL_MAX_PROCESSORS);
+    while (m_workers.Length() - m_busy < waiting && m_workers.Length() < capacity) {
+        m_workers << new SuperFlatPoolWorker(*this, int(m_workers.Length()));
+        m_workers[m_workers.Length() - 1].Start();
+    }
+    m_wake.notify_all();
+
+    std::exception_ptr error;
+    while (!m_done.wait_for(lock, std::chrono::milliseconds(20), [&job]() { return job.pending == 0; }))
+        if (!error) {
+            lock.unlock();
+            try {
+                monitor();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            lock.lock();
+        }
+    lock.unlock();
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void SuperFlatThreadPool::Shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+    for (SuperFlatPoolWorker& w : m_workers)
+        w.Wait();
+    m_workers.Destroy();
+    m_quit = false;
+}
+
+void SuperFlatThreadPool::WorkerLoop(int id)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_wake.wait(lock, [this]() { return m_quit || !m_jobs.IsEmpty(); });
+        if (m_quit)
+            return;
+        Job* job = m_jobs[0];
+        const int task = job->next++;
+        if (job->next == job->count)
+            m_jobs.Remove(m_jobs.Begin());
+        m_busy++;
+        lock.unlock();
+        (*job->task)(task);
+        lock.lock();
+        m_busy--;
+        if (--job->pending == 0)
+            m_done.notify_all();
+    }
+}
+
+}	// namespace pcl
@@ -0,0 +1,74 @@
+#ifndef __SuperFlatThreadPool_h
+#define __SuperFlatThreadPool_h
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+#include <pcl/Array.h>
+#include <pcl/ReferenceArray.h>
+#include <pcl/Thread.h>
+
+namespace pcl
+{
+
+class SuperFlatPoolWorker;
+
+// Worker threads kept alive for the whole life of the module, so that the many short parallel stages of an execution
+// (and of a batch of executions) do not pay for thread creation and teardown.
+class SuperFlatThreadPool
+{
+public:
+    typedef std::function<void(int)> Task;
+    typedef std::function<void()> Monitor;
+
+    SuperFlatThreadPool();
+    ~SuperFlatThreadPool();
+
+    // Maximum number of workers used by a stage; zero means as many as PixInsight allows.
+    void SetMaxThreads(int maxThreads);
+    int MaxThreads() const;
+
+    // Number of workers a stage of count work items will run on.
+    int NumberOfThreads(size_type count) const;
+
+    // Runs task(0) ... task(n - 1) on n workers and returns once all of them have finished. While waiting, monitor() is
+    // called every few milliseconds from the calling thread. If it throws, the exception is rethrown after the running
+    // tasks return, so the tasks must watch for a cancellation flag raised by the monitor.
+    //
+    // Several threads may run stages at the same time, as the frames of a batch do. Their tasks share the workers in
+    // the order they were submitted, so a task may start after the others of its stage have finished, and must never
+    // wait for them. The pool never grows beyond NumberOfThreads(PCL_MAX_PROCESSORS) workers.
+    void Run(int n, const Task& task, const Monitor& monitor);
+
+    // Stops and joins all workers. They are started again on demand.
+    void Shutdown();
+
+private:
+    // A call to Run(): the next task to hand out, and the number of tasks that have not finished yet.
+    struct Job
+    {
+        const Task* task;
+        int next;
+        int count;
+        int pending;
+    };
+
+    ReferenceArray<SuperFlatPoolWorker> m_workers;
+    // Jobs with tasks not handed out yet, oldest first.
+    Array<Job*> m_jobs;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    int m_busy;
+    bool m_quit;
+    int m_maxThreads;
+
+    void WorkerLoop(int id);
+
+    friend class SuperFlatPoolWorker;
+};
+
+}	// namespace pcl
+
+#endif	// __SuperFlatThreadPool_h